@@ -3,6 +3,7 @@ COMPILER_FLAGS="-g -DDEBUG=0 -Ofast -DCOMPILER_GCC -Wall -Werror -Wpedantic -Wex
 
 mkdir -p ../build
 g++ server_linux.cpp -o ../build/server_linux $COMPILER_FLAGS -lpthread
+g++ server_linux_uring.cpp -o ../build/server_linux_uring $COMPILER_FLAGS -lpthread
 
 
 # in case carriage return characters are confusing bash, remove them with:
@@ -1,5 +1,7 @@
 #include <stdint.h>
 #include <stdio.h>
+#include <time.h>
+#include <sys/stat.h>  // stat() and fstat(), which Windows has too
 
 #if !defined(COMPILER_MSVC)
 #define COMPILER_MSVC 0
@@ -22,6 +24,16 @@
 #endif
 #endif
 
+// NOTE(vincent): The SIMD kernels, the pause in spin loops and the CPU timer are x86 only.
+// Other targets get the scalar kernels, a plain spin and the monotonic clock (-DARCH_X86=0 tries that on x86).
+#if !defined(ARCH_X86)
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define ARCH_X86 1
+#else
+#define ARCH_X86 0
+#endif
+#endif
+
 #define internal static
 
 #define Kilobytes(Value) ((Value) * 1000LL)
@@ -29,14 +41,25 @@
 #define Gigabytes(Value) (Megabytes(Value) * 1000LL)
 #define Terabytes(Value) (Gigabytes(Value) * 1000LL)
 
-#define SERVER_STORAGE_SIZE Megabytes(64)
+#define SERVER_STORAGE_RESERVE Gigabytes(1)  // address space for the server arena, which commits what it uses
 
-#define NUMBER_OF_THREADS 4
-// NOTE(vincent): Needs to be at least 1, ideally <= the number of cores on the machine.
-// TODO(vincent): maybe we can ask the OS to query how many cores we have
+#define MAX_THREAD_COUNT 256
+// NOTE(vincent): The thread count, the main thread included, comes from the config file (threads:),
+// and by default from the number of CPUs the process may run on. This only bounds it.
 
 #define DEFAULT_SERVER_PORT "80"  // the port users will be connecting to
-
+#define DEFAULT_IDLE_TIMEOUT 10   // seconds before we close a silent keep-alive connection
+#define DEFAULT_FILE_CACHE_SIZE 64  // megabytes of file contents kept in memory
+#define DEFAULT_MAX_HEADER_SIZE 64  // kilobytes a request header may take before we answer it with a 400
+#define DEFAULT_MAX_CONNECTIONS 10000  // connections open at once, idle keep-alive ones included
+#define DEFAULT_CONNECTION_MEMORY 128  // megabytes of slabs for the buffers of the connections, idle ones included
+#define DEFAULT_THREAD_IDLE_TIMEOUT 60  // seconds an extra worker of the elastic pool stays idle before it exits
+#define DEFAULT_BACKLOG 511        // pending connections per listening socket, the kernel caps it to net.core.somaxconn
+
+// NOTE(vincent): Build with -DRUN_BENCHMARKS=1, optimizations on, to time the hot loops at startup.
+#if !defined(RUN_BENCHMARKS)
+#define RUN_BENCHMARKS 0
+#endif
 
 #if DEBUG
 #define Assert(Expression) if (!(Expression)) {*(int *)0 = 0;}
@@ -65,12 +88,63 @@ typedef float f32;
 typedef double f64;
 
 
+// NOTE(vincent): Reserving address space costs no memory, committing it does. Windows makes the
+// difference explicit. Linux commits a page when we first touch it, so there we only reserve without
+// swap accounting (MAP_NORESERVE), and decommitting gives the pages back while keeping the range.
+// Decommitted pages read as zeros the next time.
+#define MEMORY_COMMIT_GRANULARITY 65536  // a multiple of the page size, and what VirtualAlloc() reserves by
+
+#if COMPILER_MSVC
+inline void *
+ReserveMemory(void *BaseAddress, size_t Size)
+{
+    return VirtualAlloc(BaseAddress, Size, MEM_RESERVE, PAGE_NOACCESS);
+}
+inline b32
+CommitMemory(void *Base, size_t Size)
+{
+    return VirtualAlloc(Base, Size, MEM_COMMIT, PAGE_READWRITE) != 0;
+}
+inline void
+DecommitMemory(void *Base, size_t Size)
+{
+    VirtualFree(Base, Size, MEM_DECOMMIT);
+}
+#else
+inline void *
+ReserveMemory(void *BaseAddress, size_t Size)
+{
+    void *Result = mmap(BaseAddress, Size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    return (Result == MAP_FAILED) ? 0 : Result;
+}
+inline b32
+CommitMemory(void *Base, size_t Size)
+{
+    return true;
+}
+inline void
+DecommitMemory(void *Base, size_t Size)
+{
+    madvise(Base, Size, MADV_DONTNEED);
+}
+#endif
+
+// NOTE(vincent): A fixed arena pushes into the Size bytes it was given. A growable arena 
+// (InitializeGrowableArena()) was given Size bytes of reserved address space instead, and commits 
+// them as pushes reach them, MEMORY_COMMIT_GRANULARITY at a time. When EndTemporaryMemory() brings
+// Used back down, what it committed past RetainSize goes back to the OS: a request that needed
+// a lot of memory doesn't keep it once it's done, while the usual ones don't commit and
+// decommit the same pages every time.
 struct memory_arena
 {
     u32 Size;
     u8 *Base;
     u32 Used;
     s32 TempCount;
+    
+    b32 IsGrowable;
+    u32 Committed;          // Base to Base + Committed is backed by memory, the whole of it for a fixed arena
+    u32 RetainSize;
 };
 
 inline void
@@ -80,6 +154,58 @@ InitializeArena(memory_arena *Arena, u32 Size, void *Base)
     Arena->Base = (u8 *)Base;
     Arena->Used = 0;
     Arena->TempCount = 0;
+    Arena->IsGrowable = false;
+    Arena->Committed = Size;
+    Arena->RetainSize = Size;
+}
+
+inline void
+InitializeGrowableArena(memory_arena *Arena, u32 ReservedSize, void *Base, u32 RetainSize)
+{
+    // NOTE(vincent): Base to Base + ReservedSize must be reserved and not committed yet.
+    InitializeArena(Arena, ReservedSize, Base);
+    Arena->IsGrowable = true;
+    Arena->Committed = 0;
+    Arena->RetainSize = RetainSize;
+}
+
+internal u32
+ArenaCommitEnd(memory_arena *Arena, u32 Used)
+{
+    // NOTE(vincent): Where the commit granule holding the byte before Base + Used ends, as an offset
+    // from Base. Granules are aligned on addresses, not on Base, so that decommitting one never
+    // touches memory before Base.
+    uintptr_t Base = (uintptr_t)Arena->Base;
+    uintptr_t End = (Base + Used + MEMORY_COMMIT_GRANULARITY - 1) & ~((uintptr_t)MEMORY_COMMIT_GRANULARITY - 1);
+    u32 Result = (u32)(End - Base);
+    if (Result > Arena->Size)
+        Result = Arena->Size;
+    return Result;
+}
+
+internal void
+CommitArena(memory_arena *Arena, u32 Used)
+{
+    // NOTE(vincent): Only fails on Windows, when the system is out of commit charge, which we treat
+    // like pushing past the end of a fixed arena.
+    u32 NewCommitted = ArenaCommitEnd(Arena, Used);
+    if (!CommitMemory(Arena->Base + Arena->Committed, NewCommitted - Arena->Committed))
+    {
+        InvalidCodePath;
+    }
+    Arena->Committed = NewCommitted;
+}
+
+internal void
+DecommitArena(memory_arena *Arena)
+{
+    // NOTE(vincent): Keeps what Used and RetainSize need, rounded up to a granule.
+    u32 Keep = ArenaCommitEnd(Arena, (Arena->Used > Arena->RetainSize) ? Arena->Used : Arena->RetainSize);
+    if (Arena->Committed > Keep)
+    {
+        DecommitMemory(Arena->Base + Keep, Arena->Committed - Keep);
+        Arena->Committed = Keep;
+    }
 }
 
 #define PushStruct(Arena, type) (type *)PushSize_(Arena, sizeof(type))
@@ -109,11 +235,23 @@ inline void *
 PushSize_(memory_arena *Arena, u32 Size)
 {
     Assert((Arena->Used + Size) <= Arena->Size);
+    if (Arena->Used + Size > Arena->Committed)
+        CommitArena(Arena, Arena->Used + Size);
     void *Result = Arena->Base + Arena->Used;
     Arena->Used += Size;
     return Result;
 }
 
+inline void
+AlignArena(memory_arena *Arena, u32 Alignment)
+{
+    // NOTE(vincent): Alignment must be a power of two. Pushes are tightly packed by default,
+    // so structs that care about their address (atomics, tagged pointers) should align first.
+    u32 Misalignment = (u32)((uintptr_t)(Arena->Base + Arena->Used) & (Alignment - 1));
+    if (Misalignment)
+        PushSize_(Arena, Alignment - Misalignment);
+}
+
 
 struct temporary_memory
 {
@@ -140,6 +278,8 @@ EndTemporaryMemory(temporary_memory TempMemory)
     Arena->Used = TempMemory.Used;
     --Arena->TempCount;
     Assert(Arena->TempCount >= 0);
+    if (Arena->IsGrowable)
+        DecommitArena(Arena);
 }
 
 internal void
@@ -151,10 +291,7 @@ CheckArena(memory_arena *Arena)
 internal void
 SubArena(memory_arena *Result, memory_arena *Arena, u32 Size)
 {
-    Result->Size = Size;
-    Result->Base = (u8 *)PushSize_(Arena, Size);
-    Result->Used = 0;
-    Result->TempCount = 0;
+    InitializeArena(Result, Size, PushSize_(Arena, Size));
 }
 
 #if COMPILER_GCC
@@ -162,6 +299,238 @@ typedef int SOCKET;        // This is to make the Linux platform "understand" th
 #define INVALID_SOCKET -1  // Same
 #endif
 
+// NOTE(vincent): The few atomic operations that platform-independent code needs, with the
+// C++11 memory model's orderings: loads acquire, stores release, read-modify-writes are full barriers.
+// On GCC these are the __atomic builtins that std::atomic is made of.
+#if COMPILER_MSVC
+inline u32
+AtomicAddU32(u32 volatile *Value, u32 Addend)
+{
+    // Returns the value from before the addition.
+    return (u32)InterlockedExchangeAdd((LONG volatile *)Value, (LONG)Addend);
+}
+inline u32
+AtomicCompareExchangeU32(u32 volatile *Value, u32 Expected, u32 New)
+{
+    // Returns the value from before, which is Expected iff we wrote New.
+    return (u32)InterlockedCompareExchange((LONG volatile *)Value, (LONG)New, (LONG)Expected);
+}
+inline u32
+AtomicLoadU32(u32 volatile *Value)
+{
+    return *Value;  // MSVC gives volatile reads acquire semantics
+}
+inline void
+AtomicStoreU32(u32 volatile *Value, u32 New)
+{
+    *Value = New;  // and volatile writes release semantics
+}
+#define AtomicFence() MemoryBarrier()  // a full fence: no load or store moves across it
+#define SpinPause() YieldProcessor()
+#else
+inline u32
+AtomicAddU32(u32 volatile *Value, u32 Addend)
+{
+    // Returns the value from before the addition.
+    return __atomic_fetch_add(Value, Addend, __ATOMIC_SEQ_CST);
+}
+inline u32
+AtomicCompareExchangeU32(u32 volatile *Value, u32 Expected, u32 New)
+{
+    // Returns the value from before, which is Expected iff we wrote New.
+    __atomic_compare_exchange_n(Value, &Expected, New, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Expected;
+}
+inline u32
+AtomicLoadU32(u32 volatile *Value)
+{
+    return __atomic_load_n(Value, __ATOMIC_ACQUIRE);
+}
+inline void
+AtomicStoreU32(u32 volatile *Value, u32 New)
+{
+    __atomic_store_n(Value, New, __ATOMIC_RELEASE);
+}
+#define AtomicFence() __atomic_thread_fence(__ATOMIC_SEQ_CST)  // a full fence: no load or store moves across it
+#if ARCH_X86
+#define SpinPause() __builtin_ia32_pause()
+#else
+#define SpinPause() __asm__ __volatile__("" ::: "memory")  // a plain spin, which still reloads what it waits on
+#endif
+#endif
+
+#define CACHE_LINE_SIZE 64
+
+// NOTE(vincent): SIMD code asks what the CPU supports once, at startup, and picks its kernels from that.
+// SSE2 is always there on x86-64, not on every 32-bit x86. SSE2, SSSE3 and AVX2 functions are compiled
+// with TARGET_SSE2, TARGET_SSSE3 and TARGET_AVX2, so that the rest of the program doesn't need -mssse3
+// or -mavx2 and still runs on older CPUs. Without ARCH_X86, every feature is reported missing.
+#if ARCH_X86
+#if COMPILER_MSVC
+#include <intrin.h>
+#define TARGET_SSE2
+#define TARGET_SSSE3
+#define TARGET_AVX2
+#else
+#include <x86intrin.h>
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+struct cpu_features
+{
+    b32 SSE2;
+    b32 SSSE3;
+    b32 AVX2;
+};
+
+internal cpu_features
+DetectCPUFeatures()
+{
+    cpu_features Result = {};
+#if !ARCH_X86
+#elif COMPILER_MSVC
+    int Info[4];
+    __cpuid(Info, 0);
+    int MaxLeaf = Info[0];
+    __cpuid(Info, 1);
+    Result.SSE2 = (Info[3] >> 26) & 1;
+    Result.SSSE3 = (Info[2] >> 9) & 1;
+    b32 OSSavesYMM = ((Info[2] >> 27) & 1) && ((_xgetbv(0) & 6) == 6);  // OSXSAVE, then XCR0
+    if (MaxLeaf >= 7 && OSSavesYMM)
+    {
+        __cpuidex(Info, 7, 0);
+        Result.AVX2 = (Info[1] >> 5) & 1;
+    }
+#else
+    __builtin_cpu_init();
+    Result.SSE2 = __builtin_cpu_supports("sse2");
+    Result.SSSE3 = __builtin_cpu_supports("ssse3");
+    Result.AVX2 = __builtin_cpu_supports("avx2");
+#endif
+    return Result;
+}
+
+inline u32
+FindLowestSetBit(u32 Value)
+{
+    // Value must not be zero.
+#if COMPILER_MSVC
+    unsigned long Index;
+    _BitScanForward(&Index, Value);
+    return (u32)Index;
+#else
+    return (u32)__builtin_ctz(Value);
+#endif
+}
+
+inline u64
+ReadCPUTimer()
+{
+#if ARCH_X86
+    return __rdtsc();
+#elif COMPILER_MSVC
+    LARGE_INTEGER Counter;
+    QueryPerformanceCounter(&Counter);
+    return (u64)Counter.QuadPart;
+#else
+    timespec Time;  // nanoseconds instead of ticks: the benchmarks only compare kernels with each other
+    clock_gettime(CLOCK_MONOTONIC, &Time);
+    return (u64)Time.tv_sec*1000000000 + (u64)Time.tv_nsec;
+#endif
+}
+
+// NOTE(vincent): Threads get in line and are served in order. Only meant for short critical sections.
+struct ticket_mutex
+{
+    u32 volatile Ticket;
+    u32 volatile Serving;
+};
+
+inline void
+BeginTicketMutex(ticket_mutex *Mutex)
+{
+    u32 Ticket = AtomicAddU32(&Mutex->Ticket, 1);
+    while (Ticket != AtomicLoadU32(&Mutex->Serving))
+        SpinPause();
+}
+
+inline void
+EndTicketMutex(ticket_mutex *Mutex)
+{
+    AtomicAddU32(&Mutex->Serving, 1);
+}
+
+// NOTE(vincent): A lock-free stack of the indices of some array, for free lists that any thread
+// can pop from and push to without scanning the array. Top holds the index+1 of the top element
+// in its low 16 bits (0 when the stack is empty) and a tag in its high 16 bits, which every change
+// increments. The tag is what makes the compare-exchange fail if, between our read of Next[] for the
+// top element and the compare-exchange, that element was popped and pushed back: the index alone
+// would match. Next[Index] is the index+1 of the element below Index, only meaningful while it is in.
+#define INDEX_STACK_MAX 0xFFFF
+#define INDEX_STACK_TAG_ONE 0x10000
+
+struct index_stack
+{
+    u32 volatile Top;
+    u32 volatile *Next;
+};
+
+internal void
+InitializeIndexStack(index_stack *Stack, u32 volatile *Next, u32 Count)
+{
+    // NOTE(vincent): Next has room for Count indices, which all start in the stack, 0 on top.
+    Assert(Count <= INDEX_STACK_MAX);
+    Stack->Next = Next;
+    for (u32 Index = 0; Index < Count; Index++)
+        Next[Index] = (Index + 1 < Count) ? Index + 2 : 0;
+    Stack->Top = Count ? 1 : 0;
+}
+
+inline b32
+IndexStackIsEmpty(u32 Top)
+{
+    return (Top & INDEX_STACK_MAX) == 0;
+}
+
+internal b32
+PopIndex(index_stack *Stack, u32 *Index)
+{
+    // NOTE(vincent): Returns false right away if the stack is empty.
+    u32 Top = AtomicLoadU32(&Stack->Top);
+    for (;;)
+    {
+        if (IndexStackIsEmpty(Top))
+            return false;
+        u32 TopIndex = (Top & INDEX_STACK_MAX) - 1;
+        u32 NewTop = ((Top & ~INDEX_STACK_MAX) + INDEX_STACK_TAG_ONE) | AtomicLoadU32(Stack->Next + TopIndex);
+        u32 Previous = AtomicCompareExchangeU32(&Stack->Top, Top, NewTop);
+        if (Previous == Top)
+        {
+            *Index = TopIndex;
+            return true;
+        }
+        Top = Previous;
+    }
+}
+
+internal void
+PushIndex(index_stack *Stack, u32 Index)
+{
+    u32 Top = AtomicLoadU32(&Stack->Top);
+    for (;;)
+    {
+        AtomicStoreU32(Stack->Next + Index, Top & INDEX_STACK_MAX);
+        u32 NewTop = ((Top & ~INDEX_STACK_MAX) + INDEX_STACK_TAG_ONE) | (Index + 1);
+        u32 Previous = AtomicCompareExchangeU32(&Stack->Top, Top, NewTop);
+        if (Previous == Top)
+            break;
+        Top = Previous;
+    }
+}
+
 // NOTE(vincent): forward declaring three functions that the server code needs 
 // and that the platform layer has to implement:
 internal b32 HandleReceiveError(int BytesReceived, SOCKET ClientSocket);
@@ -169,11 +538,13 @@ internal b32 HandleSendError(int BytesSent, SOCKET ClientSocket);
 internal void ShutdownConnection(SOCKET ClientSocket);
 
 struct platform_work_queue;
+struct connection;
 #define PLATFORM_WORK_QUEUE_CALLBACK(name) void name(platform_work_queue *Queue, void *Data)
 typedef PLATFORM_WORK_QUEUE_CALLBACK(platform_work_queue_callback);
 
-typedef void platform_add_entry(platform_work_queue *Queue, 
-                                platform_work_queue_callback *Callback, void *Data);
+// NOTE(vincent): Returns false when the queue is full, in which case the entry wasn't added.
+typedef b32 platform_add_entry(platform_work_queue *Queue, 
+                               platform_work_queue_callback *Callback, void *Data);
 
 
 struct platform_work_queue_entry
@@ -185,6 +556,69 @@ struct platform_work_queue_entry
 #define PLATFORM_DO_NEXT_WORK_ENTRY(name) b32 name(platform_work_queue *Queue)
 typedef PLATFORM_DO_NEXT_WORK_ENTRY(platform_do_next_work_entry);
 
+struct opened_file
+{
+    FILE *Handle;
+    u32 Size;
+};
+
+// NOTE(vincent): Opens RelativePath for reading, resolved from the directory the platform layer opened
+// as Directory (see AddVirtualHost()), and refuses anything that would end up outside of it, through
+// ".." or symlinks (openat2() with RESOLVE_BENEATH on Linux). Returns a zero Handle if the file can't be
+// opened or isn't a regular file, like OpenFileForReading().
+// Optional: a platform layer that can't do it passes a null pointer, and files are opened by path.
+#define PLATFORM_OPEN_BENEATH(name) opened_file name(s64 Directory, char *RelativePath)
+typedef PLATFORM_OPEN_BENEATH(platform_open_beneath);
+
+// NOTE(vincent): stat() of RelativePath, resolved from Directory like PLATFORM_OPEN_BENEATH (fstatat() on Linux).
+// "." is Directory itself. Returns false if there is nothing there.
+// Optional: a platform layer without PLATFORM_OPEN_BENEATH passes a null pointer for both.
+#define PLATFORM_STAT_BENEATH(name) b32 name(s64 Directory, char *RelativePath, struct stat *Status)
+typedef PLATFORM_STAT_BENEATH(platform_stat_beneath);
+
+// NOTE(vincent): The file cache and the protection cache know files by their complete path, root/host/...
+// A site_directory says where to look those paths up: from the site's handle, for the paths that start
+// with its PathLength bytes, and by path for the others (the root above the sites) or without a handle.
+struct site_directory
+{
+    platform_open_beneath *OpenBeneath;  // null: everything by path
+    platform_stat_beneath *StatBeneath;
+    s64 Handle;
+    u32 PathLength;
+};
+
+// NOTE(vincent): Sends up to Count bytes of File, from Offset, straight to the socket without copying them
+// through our memory (e.g. sendfile() on Linux). Returns how many bytes were sent, or -1 on error.
+// Optional: a platform layer that can't do it passes a null pointer, and files go through SendBuffer.
+#define PLATFORM_SEND_FILE(name) s64 name(SOCKET ClientSocket, FILE *File, size_t Offset, size_t Count)
+typedef PLATFORM_SEND_FILE(platform_send_file);
+
+// NOTE(vincent): Puts the calling thread to sleep for as long as *Address is Expected, until another thread
+// calls the wake function on that address (futex on Linux, WaitOnAddress on Windows).
+// It may also return for no reason, so callers check their condition again in a loop.
+#define PLATFORM_WAIT_ON_ADDRESS(name) void name(u32 volatile *Address, u32 Expected)
+typedef PLATFORM_WAIT_ON_ADDRESS(platform_wait_on_address);
+#define PLATFORM_WAKE_ON_ADDRESS(name) void name(u32 volatile *Address)  // wakes up one waiting thread
+typedef PLATFORM_WAKE_ON_ADDRESS(platform_wake_on_address);
+
+// NOTE(vincent): The NUMA node of the thread that runs Queue's entries, as a slab node index (see server_slab.cpp).
+// Optional: a null pointer means node 0.
+#define PLATFORM_GET_THREAD_NODE(name) u32 name(platform_work_queue *Queue)
+typedef PLATFORM_GET_THREAD_NODE(platform_get_thread_node);
+
+// NOTE(vincent): For the work queue modes: takes over a connection that has nothing to read, so that it
+// doesn't hold a worker while it is idle. Once the socket is readable, the platform layer calls
+// ResumeWatchedConnection() with Data, and it shuts the socket down if the connection stays quiet for
+// the idle timeout. Returns false if it can't, and the connection is still the caller's.
+// Optional: with a null pointer, ReceiveAndSend() blocks in recv() instead.
+#define PLATFORM_WATCH_CONNECTION(name) b32 name(platform_work_queue *Queue, connection *Connection, void *Data)
+typedef PLATFORM_WATCH_CONNECTION(platform_watch_connection);
+
+// NOTE(vincent): How many bytes of the mappings that hold Base..Base+Size the OS backs with huge pages
+// right now. Optional: a platform layer that can't tell passes a null pointer.
+#define PLATFORM_COUNT_HUGE_PAGES(name) size_t name(void *Base, size_t Size)
+typedef PLATFORM_COUNT_HUGE_PAGES(platform_count_huge_pages);
+
 struct server_memory
 {
     u32 StorageSize;
@@ -193,6 +627,12 @@ struct server_memory
     platform_work_queue *Queue;
     platform_add_entry *PlatformAddEntry;
     platform_do_next_work_entry *PlatformDoNextWorkEntry;  // NOTE(vincent): for the main thread
+    platform_send_file *PlatformSendFile;  // may be null
+    platform_wait_on_address *PlatformWaitOnAddress;
+    platform_wake_on_address *PlatformWakeOnAddress;
+    platform_count_huge_pages *PlatformCountHugePages;  // may be null
+    platform_get_thread_node *PlatformGetThreadNode;    // may be null
+    platform_watch_connection *PlatformWatchConnection; // may be null
 };
 
 
@@ -401,6 +841,29 @@ StringsAreEqual(string A, string B)
     }
     return Result;
 }
+
+inline char
+ToLowerCase(char C)
+{
+    if ('A' <= C && C <= 'Z')
+        C += 'a' - 'A';
+    return C;
+}
+
+internal b32
+StringsAreEqualIgnoreCase(string A, const char *B)
+{
+    u32 Count = 0;
+    while (Count < A.Length && *B)
+    {
+        if (ToLowerCase(A.Base[Count]) != ToLowerCase(*B))
+            break;
+        B++;
+        Count++;
+    }
+    return (*B == 0 && Count == A.Length);
+}
+
 internal b32
 StringBeginsWith(string A, const char *B)
 {
@@ -433,6 +896,14 @@ Minimum(u32 A, u32 B)
     return B;
 }
 
+internal u32
+Maximum(u32 A, u32 B)
+{
+    if (A > B)
+        return A;
+    return B;
+}
+
 internal void
 IntegerToString(u32 Integer, char *Buffer)
 {
@@ -548,6 +1019,23 @@ SprintInt(char *Dest, int Integer)
     return DigitCount;
 }
 
+inline u32
+SprintUnsigned(char *Dest, u64 Integer)
+{
+    // NOTE(vincent): Like SprintInt(), for sizes that may not fit an int.
+    char Digits[20];
+    u32 DigitCount = 0;
+    do {
+        Digits[DigitCount++] = (char)(Integer % 10) + '0';
+        Integer /= 10;
+    } while (Integer > 0);
+    
+    for (u32 DigitIndex = 0; DigitIndex < DigitCount; DigitIndex++)
+        Dest[DigitIndex] = Digits[DigitCount - 1 - DigitIndex];
+    Dest[DigitCount] = 0;
+    return DigitCount;
+}
+
 internal u32
 StringLineLength(char *String)
 {
@@ -633,19 +1121,100 @@ GetInternetAddress(struct sockaddr *sa)
 
 // -------------------------------------------------------------
 
+struct parsed_config_file_result;
 struct initialize_server_memory_result
 {
     u32 ParsingErrorCount;
     char *PortString;
+    parsed_config_file_result *Config;
 };
 
 
+internal opened_file
+OpenFileForReading(char *Filename)
+{
+    // NOTE(vincent): Returns a zero Handle if the file can't be opened, or if it isn't a regular file
+    // we can measure. fopen() happily opens directories on Linux, which then report an absurd size.
+    opened_file Result = {};
+    
+    FILE *File = fopen(Filename, "rb");
+    if (File)
+    {
+        fseek(File, 0, SEEK_END);
+        long Size = ftell(File);
+        fseek(File, 0, SEEK_SET);
+        if (0 <= Size && Size <= 0xFFFFFFFF)
+        {
+            Result.Handle = File;
+            Result.Size = (u32)Size;
+        }
+        else
+            fclose(File);
+    }
+    return Result;
+}
+
+inline char *
+SiteRelativePath(site_directory *Site, string Path)
+{
+    // NOTE(vincent): Where Path goes on from the site's directory, "." for the directory itself,
+    // or 0 if it isn't beneath it. Path must be null-terminated, and start with the site's path if it is that long.
+    char *Result = 0;
+    if (Site && Site->OpenBeneath && Path.Length >= Site->PathLength &&
+        (Path.Length == Site->PathLength || Path.Base[Site->PathLength] == '/'))
+    {
+        Result = Path.Base + Site->PathLength;
+        while (*Result == '/')
+            Result++;
+        if (!*Result)
+            Result = ".";
+    }
+    return Result;
+}
+
+internal b32
+StatSitePath(site_directory *Site, string Path, struct stat *Status)
+{
+    char *RelativePath = SiteRelativePath(Site, Path);
+    if (RelativePath)
+        return Site->StatBeneath(Site->Handle, RelativePath, Status);
+    return stat(Path.Base, Status) == 0;
+}
+
+internal opened_file
+OpenSitePath(site_directory *Site, string Path)
+{
+    char *RelativePath = SiteRelativePath(Site, Path);
+    if (RelativePath)
+        return Site->OpenBeneath(Site->Handle, RelativePath);
+    return OpenFileForReading(Path.Base);
+}
+
 struct push_read_entire_file
 {
     char *Memory;
     size_t Size;
     b32 Success;
 };
+
+internal push_read_entire_file
+PushReadOpenedFile(memory_arena *Arena, opened_file File)
+{
+    // NOTE(vincent): Like PushReadEntireFile(), for a file we opened already. Closes it.
+    push_read_entire_file Result = {};
+    if (File.Handle)
+    {
+        Result.Size = File.Size;
+        if (Result.Size <= Arena->Size - Arena->Used)
+        {
+            Result.Memory = PushArray(Arena, (u32)Result.Size, char);
+            Result.Success = (fread(Result.Memory, 1, Result.Size, File.Handle) == Result.Size);
+        }
+        fclose(File.Handle);
+    }
+    return Result;
+}
+
 internal push_read_entire_file
 PushReadEntireFile(memory_arena *Arena, char *Filename)
 {
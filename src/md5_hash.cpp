@@ -26,13 +26,60 @@ struct md5_result
     u32 d;
 };
 
-internal md5_result
-MD5(u8 *Source, u32 MessageLength)
+// NOTE(vincent): The 64 steps of a chunk, as the RFC lists them: round function, the four state
+// words in the order the step rotates them, index of the message word, constant, shift.
+// Each kernel defines what one STEP is, and gets every constant as a literal.
+#define MD5_STEPS(STEP) \
+    STEP(F, A, B, C, D,  0, 0xd76aa478,  7) STEP(F, D, A, B, C,  1, 0xe8c7b756, 12) \
+    STEP(F, C, D, A, B,  2, 0x242070db, 17) STEP(F, B, C, D, A,  3, 0xc1bdceee, 22) \
+    STEP(F, A, B, C, D,  4, 0xf57c0faf,  7) STEP(F, D, A, B, C,  5, 0x4787c62a, 12) \
+    STEP(F, C, D, A, B,  6, 0xa8304613, 17) STEP(F, B, C, D, A,  7, 0xfd469501, 22) \
+    STEP(F, A, B, C, D,  8, 0x698098d8,  7) STEP(F, D, A, B, C,  9, 0x8b44f7af, 12) \
+    STEP(F, C, D, A, B, 10, 0xffff5bb1, 17) STEP(F, B, C, D, A, 11, 0x895cd7be, 22) \
+    STEP(F, A, B, C, D, 12, 0x6b901122,  7) STEP(F, D, A, B, C, 13, 0xfd987193, 12) \
+    STEP(F, C, D, A, B, 14, 0xa679438e, 17) STEP(F, B, C, D, A, 15, 0x49b40821, 22) \
+    STEP(G, A, B, C, D,  1, 0xf61e2562,  5) STEP(G, D, A, B, C,  6, 0xc040b340,  9) \
+    STEP(G, C, D, A, B, 11, 0x265e5a51, 14) STEP(G, B, C, D, A,  0, 0xe9b6c7aa, 20) \
+    STEP(G, A, B, C, D,  5, 0xd62f105d,  5) STEP(G, D, A, B, C, 10, 0x02441453,  9) \
+    STEP(G, C, D, A, B, 15, 0xd8a1e681, 14) STEP(G, B, C, D, A,  4, 0xe7d3fbc8, 20) \
+    STEP(G, A, B, C, D,  9, 0x21e1cde6,  5) STEP(G, D, A, B, C, 14, 0xc33707d6,  9) \
+    STEP(G, C, D, A, B,  3, 0xf4d50d87, 14) STEP(G, B, C, D, A,  8, 0x455a14ed, 20) \
+    STEP(G, A, B, C, D, 13, 0xa9e3e905,  5) STEP(G, D, A, B, C,  2, 0xfcefa3f8,  9) \
+    STEP(G, C, D, A, B,  7, 0x676f02d9, 14) STEP(G, B, C, D, A, 12, 0x8d2a4c8a, 20) \
+    STEP(H, A, B, C, D,  5, 0xfffa3942,  4) STEP(H, D, A, B, C,  8, 0x8771f681, 11) \
+    STEP(H, C, D, A, B, 11, 0x6d9d6122, 16) STEP(H, B, C, D, A, 14, 0xfde5380c, 23) \
+    STEP(H, A, B, C, D,  1, 0xa4beea44,  4) STEP(H, D, A, B, C,  4, 0x4bdecfa9, 11) \
+    STEP(H, C, D, A, B,  7, 0xf6bb4b60, 16) STEP(H, B, C, D, A, 10, 0xbebfbc70, 23) \
+    STEP(H, A, B, C, D, 13, 0x289b7ec6,  4) STEP(H, D, A, B, C,  0, 0xeaa127fa, 11) \
+    STEP(H, C, D, A, B,  3, 0xd4ef3085, 16) STEP(H, B, C, D, A,  6, 0x04881d05, 23) \
+    STEP(H, A, B, C, D,  9, 0xd9d4d039,  4) STEP(H, D, A, B, C, 12, 0xe6db99e5, 11) \
+    STEP(H, C, D, A, B, 15, 0x1fa27cf8, 16) STEP(H, B, C, D, A,  2, 0xc4ac5665, 23) \
+    STEP(I, A, B, C, D,  0, 0xf4292244,  6) STEP(I, D, A, B, C,  7, 0x432aff97, 10) \
+    STEP(I, C, D, A, B, 14, 0xab9423a7, 15) STEP(I, B, C, D, A,  5, 0xfc93a039, 21) \
+    STEP(I, A, B, C, D, 12, 0x655b59c3,  6) STEP(I, D, A, B, C,  3, 0x8f0ccc92, 10) \
+    STEP(I, C, D, A, B, 10, 0xffeff47d, 15) STEP(I, B, C, D, A,  1, 0x85845dd1, 21) \
+    STEP(I, A, B, C, D,  8, 0x6fa87e4f,  6) STEP(I, D, A, B, C, 15, 0xfe2ce6e0, 10) \
+    STEP(I, C, D, A, B,  6, 0xa3014314, 15) STEP(I, B, C, D, A, 13, 0x4e0811a1, 21) \
+    STEP(I, A, B, C, D,  4, 0xf7537e82,  6) STEP(I, D, A, B, C, 11, 0xbd3af235, 10) \
+    STEP(I, C, D, A, B,  2, 0x2ad7d2bb, 15) STEP(I, B, C, D, A,  9, 0xeb86d391, 21)
+
+// The round functions. F and G are the usual (B & C) | (~B & D) and (D & B) | (~D & C), with one operation less.
+#define MD5_F(B, C, D) ((D) ^ ((B) & ((C) ^ (D))))
+#define MD5_G(B, C, D) ((C) ^ ((D) & ((B) ^ (C))))
+#define MD5_H(B, C, D) ((B) ^ (C) ^ (D))
+#define MD5_I(B, C, D) ((C) ^ ((B) | ~(D)))
+#define MD5_STEP_SCALAR(f, a, b, c, d, g, Constant, Shift) \
+    a += MD5_##f(b, c, d) + M[g] + Constant; \
+    a = ((a << Shift) | (a >> (32 - Shift))) + b;
+
+internal u32
+MD5Pad(u8 *Source, u32 MessageLength)
 {
     // NOTE(vincent): MessageLength is in bytes.
     // We assume that the Source buffer is big enough to hold some additional padding at the end.
     // The space required for padding is 1 + 511 + 64 bits = 576 bits = 72 bytes.
     // The padding is not required to be initialized to 0.
+    // Returns how many 64-byte chunks the padded message has.
     
     Assert(Source[MessageLength + 71] || !Source[MessageLength + 71]);
     
@@ -40,39 +87,6 @@ MD5(u8 *Source, u32 MessageLength)
     // In other words,
     Assert( (((u32)0xFFFFFFFF) / 8) >= MessageLength);
     
-    u32 PerRoundShifts[64] = { 
-        7, 12, 17, 22,  7, 12, 17, 22,  7, 12, 17, 22,  7, 12, 17, 22,
-        5,  9, 14, 20,  5,  9, 14, 20,  5,  9, 14, 20,  5,  9, 14, 20,
-        4, 11, 16, 23,  4, 11, 16, 23,  4, 11, 16, 23,  4, 11, 16, 23,
-        6, 10, 15, 21,  6, 10, 15, 21,  6, 10, 15, 21,  6, 10, 15, 21
-    };
-    
-    u32 K[64] = {
-        0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
-        0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
-        0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
-        0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
-        0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
-        0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
-        0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
-        0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
-        0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
-        0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
-        0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
-        0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
-        0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
-        0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
-        0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
-        0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391 
-    };
-    
-    md5_result State;
-    State.a = 0x67452301; // 01 23 45 67 in memory order (how you read the bytes when address increases)
-    State.b = 0xefcdab89; // 89 ab cd ef
-    State.c = 0x98badcfe; // fe dc ba 98
-    State.d = 0x10325476; // 76 54 32 10
-    
-    // padding
     Source[MessageLength] = 0x80; // bits: 1000 0000
     u32 ChunkOffset = MessageLength & 63;
     u32 ZeroBytesCount = (ChunkOffset <= 55 ? 55 - ChunkOffset : 63-(ChunkOffset-56));
@@ -87,8 +101,20 @@ MD5(u8 *Source, u32 MessageLength)
     *WriteSizePtr = OriginalSizeInBits;
     WriteSizePtr[1] = 0;
     
+    return PaddedLength / 64;
+}
+
+internal md5_result
+MD5(u8 *Source, u32 MessageLength)
+{
+    // NOTE(vincent): Source needs 72 bytes of room after the message, see MD5Pad().
+    md5_result State;
+    State.a = 0x67452301; // 01 23 45 67 in memory order (how you read the bytes when address increases)
+    State.b = 0xefcdab89; // 89 ab cd ef
+    State.c = 0x98badcfe; // fe dc ba 98
+    State.d = 0x10325476; // 76 54 32 10
     
-    u32 ChunksCount = PaddedLength / 64;
+    u32 ChunksCount = MD5Pad(Source, MessageLength);
     
     // Process the message in successive 512-bit chunks:
     for (u32 ChunkIndex = 0; ChunkIndex < ChunksCount; ChunkIndex++)
@@ -100,35 +126,7 @@ MD5(u8 *Source, u32 MessageLength)
         u32 B = State.b;
         u32 C = State.c;
         u32 D = State.d;
-        for (int i = 0; i < 64; i++)
-        {
-            u32 F,g;
-            if (i <= 15)
-            {
-                F = (B & C) | ((~B) & D);
-                g = i;
-            }
-            else if (i <= 31)
-            {
-                F = (D & B) | ((~D) & C);
-                g = (5*i + 1) & 15;
-            }
-            else if (i <= 47)
-            {
-                F = B ^ C ^ D;
-                g = (3*i + 5) & 15;
-            }
-            else
-            {
-                F = C ^ (B | (~D));
-                g = (7*i) & 15;
-            }
-            F = F + A + K[i] + M[g];
-            A = D;
-            D = C;
-            C = B;
-            B = B + ((F << PerRoundShifts[i]) | (F >> (32-PerRoundShifts[i]))); // left rotate
-        }
+        MD5_STEPS(MD5_STEP_SCALAR)
         State.a += A;
         State.b += B;
         State.c += C;
@@ -138,6 +136,206 @@ MD5(u8 *Source, u32 MessageLength)
     return State;
 }
 
+// NOTE(vincent): The multi-buffer kernels hash 4 (SSE2) or 8 (AVX2) independent messages at once,
+// one message per 32-bit lane, with the same 64 steps as MD5(): MD5 has no parallelism within
+// a chunk to speak of, but it has as much as we like across messages. Each lane reads word g of
+// its own chunk, so the chunks of the lanes are transposed first. Messages may have different
+// lengths: a lane that has no chunk left rereads its last one, and keeps its state as it was.
+// Every Sources[i] needs the same 72 bytes of room as for MD5().
+// Only TestMD5() and BenchmarkMD5() use them for now: a request has one password to hash at most.
+#define MD5_MANY(name) void name(u8 **Sources, u32 *Lengths, md5_result *Results, u32 Count)
+typedef MD5_MANY(md5_many);
+
+#define MD5_F_SSE2(B, C, D) _mm_xor_si128(D, _mm_and_si128(B, _mm_xor_si128(C, D)))
+#define MD5_G_SSE2(B, C, D) _mm_xor_si128(C, _mm_and_si128(D, _mm_xor_si128(B, C)))
+#define MD5_H_SSE2(B, C, D) _mm_xor_si128(_mm_xor_si128(B, C), D)
+#define MD5_I_SSE2(B, C, D) _mm_xor_si128(C, _mm_or_si128(B, _mm_xor_si128(D, Ones)))
+#define MD5_STEP_SSE2(f, a, b, c, d, g, Constant, Shift) \
+    a = _mm_add_epi32(a, _mm_add_epi32(MD5_##f##_SSE2(b, c, d), _mm_add_epi32(W[g], _mm_set1_epi32((int)Constant)))); \
+    a = _mm_add_epi32(_mm_or_si128(_mm_slli_epi32(a, Shift), _mm_srli_epi32(a, 32 - Shift)), b);
+
+internal MD5_MANY(MD5ManyScalar)
+{
+    for (u32 Index = 0; Index < Count; Index++)
+        Results[Index] = MD5(Sources[Index], Lengths[Index]);
+}
+
+#if ARCH_X86
+TARGET_SSE2 internal void
+MD5x4(u8 **Sources, u32 *Lengths, md5_result *Results)
+{
+    u32 ChunkCounts[4];
+    u32 MaxChunkCount = 0;
+    for (u32 Lane = 0; Lane < 4; Lane++)
+    {
+        ChunkCounts[Lane] = MD5Pad(Sources[Lane], Lengths[Lane]);
+        MaxChunkCount = Maximum(MaxChunkCount, ChunkCounts[Lane]);
+    }
+    __m128i LaneChunkCounts = _mm_loadu_si128((__m128i *)ChunkCounts);
+    __m128i Ones = _mm_set1_epi32(-1);
+    __m128i StateA = _mm_set1_epi32(0x67452301);
+    __m128i StateB = _mm_set1_epi32((int)0xefcdab89);
+    __m128i StateC = _mm_set1_epi32((int)0x98badcfe);
+    __m128i StateD = _mm_set1_epi32(0x10325476);
+    
+    for (u32 ChunkIndex = 0; ChunkIndex < MaxChunkCount; ChunkIndex++)
+    {
+        u8 *Chunks[4];
+        for (u32 Lane = 0; Lane < 4; Lane++)
+            Chunks[Lane] = Sources[Lane] + 64*Minimum(ChunkIndex, ChunkCounts[Lane] - 1);
+        
+        // NOTE(vincent): Four 4x4 transposes: W[g] holds word g of the four chunks.
+        __m128i W[16];
+        for (u32 Quarter = 0; Quarter < 4; Quarter++)
+        {
+            __m128i R0 = _mm_loadu_si128((__m128i *)(Chunks[0] + 16*Quarter));
+            __m128i R1 = _mm_loadu_si128((__m128i *)(Chunks[1] + 16*Quarter));
+            __m128i R2 = _mm_loadu_si128((__m128i *)(Chunks[2] + 16*Quarter));
+            __m128i R3 = _mm_loadu_si128((__m128i *)(Chunks[3] + 16*Quarter));
+            __m128i T0 = _mm_unpacklo_epi32(R0, R1);
+            __m128i T1 = _mm_unpacklo_epi32(R2, R3);
+            __m128i T2 = _mm_unpackhi_epi32(R0, R1);
+            __m128i T3 = _mm_unpackhi_epi32(R2, R3);
+            W[4*Quarter + 0] = _mm_unpacklo_epi64(T0, T1);
+            W[4*Quarter + 1] = _mm_unpackhi_epi64(T0, T1);
+            W[4*Quarter + 2] = _mm_unpacklo_epi64(T2, T3);
+            W[4*Quarter + 3] = _mm_unpackhi_epi64(T2, T3);
+        }
+        
+        __m128i A = StateA;
+        __m128i B = StateB;
+        __m128i C = StateC;
+        __m128i D = StateD;
+        MD5_STEPS(MD5_STEP_SSE2)
+        __m128i Active = _mm_cmpgt_epi32(LaneChunkCounts, _mm_set1_epi32((int)ChunkIndex));
+        StateA = _mm_add_epi32(StateA, _mm_and_si128(A, Active));
+        StateB = _mm_add_epi32(StateB, _mm_and_si128(B, Active));
+        StateC = _mm_add_epi32(StateC, _mm_and_si128(C, Active));
+        StateD = _mm_add_epi32(StateD, _mm_and_si128(D, Active));
+    }
+    
+    u32 Words[4][4];
+    _mm_storeu_si128((__m128i *)Words[0], StateA);
+    _mm_storeu_si128((__m128i *)Words[1], StateB);
+    _mm_storeu_si128((__m128i *)Words[2], StateC);
+    _mm_storeu_si128((__m128i *)Words[3], StateD);
+    for (u32 Lane = 0; Lane < 4; Lane++)
+    {
+        Results[Lane].a = Words[0][Lane];
+        Results[Lane].b = Words[1][Lane];
+        Results[Lane].c = Words[2][Lane];
+        Results[Lane].d = Words[3][Lane];
+    }
+}
+
+TARGET_SSE2 internal MD5_MANY(MD5ManySSE2)
+{
+    u32 Index = 0;
+    for (; Index + 4 <= Count; Index += 4)
+        MD5x4(Sources + Index, Lengths + Index, Results + Index);
+    MD5ManyScalar(Sources + Index, Lengths + Index, Results + Index, Count - Index);
+}
+
+#define MD5_F_AVX2(B, C, D) _mm256_xor_si256(D, _mm256_and_si256(B, _mm256_xor_si256(C, D)))
+#define MD5_G_AVX2(B, C, D) _mm256_xor_si256(C, _mm256_and_si256(D, _mm256_xor_si256(B, C)))
+#define MD5_H_AVX2(B, C, D) _mm256_xor_si256(_mm256_xor_si256(B, C), D)
+#define MD5_I_AVX2(B, C, D) _mm256_xor_si256(C, _mm256_or_si256(B, _mm256_xor_si256(D, Ones)))
+#define MD5_STEP_AVX2(f, a, b, c, d, g, Constant, Shift) \
+    a = _mm256_add_epi32(a, _mm256_add_epi32(MD5_##f##_AVX2(b, c, d), _mm256_add_epi32(W[g], _mm256_set1_epi32((int)Constant)))); \
+    a = _mm256_add_epi32(_mm256_or_si256(_mm256_slli_epi32(a, Shift), _mm256_srli_epi32(a, 32 - Shift)), b);
+
+TARGET_AVX2 internal void
+MD5x8(u8 **Sources, u32 *Lengths, md5_result *Results)
+{
+    u32 ChunkCounts[8];
+    u32 MaxChunkCount = 0;
+    for (u32 Lane = 0; Lane < 8; Lane++)
+    {
+        ChunkCounts[Lane] = MD5Pad(Sources[Lane], Lengths[Lane]);
+        MaxChunkCount = Maximum(MaxChunkCount, ChunkCounts[Lane]);
+    }
+    __m256i LaneChunkCounts = _mm256_loadu_si256((__m256i *)ChunkCounts);
+    __m256i Ones = _mm256_set1_epi32(-1);
+    __m256i StateA = _mm256_set1_epi32(0x67452301);
+    __m256i StateB = _mm256_set1_epi32((int)0xefcdab89);
+    __m256i StateC = _mm256_set1_epi32((int)0x98badcfe);
+    __m256i StateD = _mm256_set1_epi32(0x10325476);
+    
+    for (u32 ChunkIndex = 0; ChunkIndex < MaxChunkCount; ChunkIndex++)
+    {
+        u8 *Chunks[8];
+        for (u32 Lane = 0; Lane < 8; Lane++)
+            Chunks[Lane] = Sources[Lane] + 64*Minimum(ChunkIndex, ChunkCounts[Lane] - 1);
+        
+        // NOTE(vincent): The same 4x4 transposes as MD5x4(), with lanes 0-3 in the low halves
+        // and lanes 4-7 in the high halves, since AVX2 unpacks within each half.
+        __m256i W[16];
+        for (u32 Quarter = 0; Quarter < 4; Quarter++)
+        {
+            __m256i R[4];
+            for (u32 Row = 0; Row < 4; Row++)
+            {
+                __m128i Low = _mm_loadu_si128((__m128i *)(Chunks[Row] + 16*Quarter));
+                __m128i High = _mm_loadu_si128((__m128i *)(Chunks[Row + 4] + 16*Quarter));
+                R[Row] = _mm256_inserti128_si256(_mm256_castsi128_si256(Low), High, 1);
+            }
+            __m256i T0 = _mm256_unpacklo_epi32(R[0], R[1]);
+            __m256i T1 = _mm256_unpacklo_epi32(R[2], R[3]);
+            __m256i T2 = _mm256_unpackhi_epi32(R[0], R[1]);
+            __m256i T3 = _mm256_unpackhi_epi32(R[2], R[3]);
+            W[4*Quarter + 0] = _mm256_unpacklo_epi64(T0, T1);
+            W[4*Quarter + 1] = _mm256_unpackhi_epi64(T0, T1);
+            W[4*Quarter + 2] = _mm256_unpacklo_epi64(T2, T3);
+            W[4*Quarter + 3] = _mm256_unpackhi_epi64(T2, T3);
+        }
+        
+        __m256i A = StateA;
+        __m256i B = StateB;
+        __m256i C = StateC;
+        __m256i D = StateD;
+        MD5_STEPS(MD5_STEP_AVX2)
+        __m256i Active = _mm256_cmpgt_epi32(LaneChunkCounts, _mm256_set1_epi32((int)ChunkIndex));
+        StateA = _mm256_add_epi32(StateA, _mm256_and_si256(A, Active));
+        StateB = _mm256_add_epi32(StateB, _mm256_and_si256(B, Active));
+        StateC = _mm256_add_epi32(StateC, _mm256_and_si256(C, Active));
+        StateD = _mm256_add_epi32(StateD, _mm256_and_si256(D, Active));
+    }
+    
+    u32 Words[4][8];
+    _mm256_storeu_si256((__m256i *)Words[0], StateA);
+    _mm256_storeu_si256((__m256i *)Words[1], StateB);
+    _mm256_storeu_si256((__m256i *)Words[2], StateC);
+    _mm256_storeu_si256((__m256i *)Words[3], StateD);
+    _mm256_zeroupper();
+    for (u32 Lane = 0; Lane < 8; Lane++)
+    {
+        Results[Lane].a = Words[0][Lane];
+        Results[Lane].b = Words[1][Lane];
+        Results[Lane].c = Words[2][Lane];
+        Results[Lane].d = Words[3][Lane];
+    }
+}
+
+TARGET_AVX2 internal MD5_MANY(MD5ManyAVX2)
+{
+    u32 Index = 0;
+    for (; Index + 8 <= Count; Index += 8)
+        MD5x8(Sources + Index, Lengths + Index, Results + Index);
+    MD5ManySSE2(Sources + Index, Lengths + Index, Results + Index, Count - Index);
+}
+#endif
+
+internal md5_many *
+SelectMD5Many(cpu_features CPU)
+{
+#if ARCH_X86
+    md5_many *Result = CPU.AVX2 ? MD5ManyAVX2 : CPU.SSE2 ? MD5ManySSE2 : MD5ManyScalar;
+#else
+    md5_many *Result = MD5ManyScalar;
+#endif
+    return Result;
+}
+
 
 internal void
 PrintMD5NoNull(char *Dest, md5_result Hash)
@@ -196,193 +394,470 @@ TestMD5()
     for (u32 SuccessIndex = 0; SuccessIndex < ArrayCount(Success); SuccessIndex++)
         Assert(Success[SuccessIndex]);
     
+    // NOTE(vincent): The multi-buffer kernels have to agree with MD5() on the vectors above, and on
+    // batches whose messages end in different chunks, around the 56 and 64 byte boundaries, with a
+    // count that leaves a remainder for the narrower kernels.
+    cpu_features CPU = DetectCPUFeatures();
+#if ARCH_X86
+    md5_many *Kernels[] = {MD5ManyScalar, MD5ManySSE2, MD5ManyAVX2};
+#else
+    md5_many *Kernels[] = {MD5ManyScalar};
+#endif
+    u32 KernelCount = CPU.AVX2 ? 3 : CPU.SSE2 ? 2 : 1;
+    u8 Messages[11][300];
+    u8 *Sources[11];
+    u32 Lengths[11];
+    md5_result Expected[11];
+    md5_result Results[11];
+    b32 ManySuccess = true;
+    for (u32 Round = 0; Round < 40; Round++)
+    {
+        for (u32 Index = 0; Index < ArrayCount(Messages); Index++)
+        {
+            Sources[Index] = Messages[Index];
+            if (Round == 0)
+                Lengths[Index] = String[Index % ArrayCount(String)].Length;
+            else
+                Lengths[Index] = (Round*7 + Index*29) % (sizeof(Messages[0]) - 72);
+            for (u32 Byte = 0; Byte < Lengths[Index]; Byte++)
+                Messages[Index][Byte] = (Round == 0) ? String[Index % ArrayCount(String)].Base[Byte] : (u8)(Byte*31 + Index);
+            Expected[Index] = MD5(Messages[Index], Lengths[Index]);
+        }
+        for (u32 KernelIndex = 0; KernelIndex < KernelCount; KernelIndex++)
+        {
+            for (u32 Count = 0; Count <= ArrayCount(Messages); Count++)
+            {
+                Kernels[KernelIndex](Sources, Lengths, Results, Count);
+                for (u32 Index = 0; Index < Count; Index++)
+                    ManySuccess &= (memcmp(&Results[Index], &Expected[Index], sizeof(md5_result)) == 0);
+            }
+        }
+    }
+    Assert(ManySuccess);
 }
 
-internal char
-SextetToAscii(char Sextet)
+internal void
+BenchmarkMD5(cpu_features CPU)
 {
-    // NOTE(vincent): Converts a sextet into an ascii character, following Base64 encoding rules.
-    // https://en.wikipedia.org/wikipedia.org/wiki/Base64#Base64_table
-    char Output = 0;
+    // NOTE(vincent): Hashes batches of 8 messages of a few sizes with each kernel, and prints the
+    // throughput in GB/s of message bytes. 16 bytes is about what a password is, so every hash is a
+    // single chunk there; bigger messages are more like computing ETags over files.
+    struct kernel
+    {
+        const char *Name;
+        md5_many *Many;
+    };
+    kernel Kernels[] =
+    {
+        {"scalar", MD5ManyScalar},
+#if ARCH_X86
+        {"SSE2 x4", MD5ManySSE2},
+        {"AVX2 x8", MD5ManyAVX2},
+#endif
+    };
+    u32 KernelCount = CPU.AVX2 ? 3 : CPU.SSE2 ? 2 : 1;
+    u32 Sizes[] = {16, 256, 4096};
     
-    if      (Sextet <= 25)  Output = 'A' + Sextet;
-    else if (Sextet <= 51)  Output = 'a' + Sextet;
-    else if (Sextet <= 61)  Output = '0' + Sextet;
-    else if (Sextet == 62)  Output = '+';
-    else                    Output = '/';
+    u8 Messages[8][4096 + 72];
+    u8 *Sources[8];
+    u32 Lengths[8];
+    md5_result Results[8];
+    for (u32 Index = 0; Index < 8; Index++)
+    {
+        Sources[Index] = Messages[Index];
+        for (u32 Byte = 0; Byte < sizeof(Messages[0]); Byte++)
+            Messages[Index][Byte] = (u8)(Byte + Index);
+    }
     
-    Assert(Output);
-    return Output;
+    u64 BytesPerRun = 1 << 27;
+    for (u32 SizeIndex = 0; SizeIndex < ArrayCount(Sizes); SizeIndex++)
+    {
+        for (u32 Index = 0; Index < 8; Index++)
+            Lengths[Index] = Sizes[SizeIndex];
+        u32 Iterations = (u32)(BytesPerRun / (8*Sizes[SizeIndex]));
+        printf("MD5 of %u bytes:", Sizes[SizeIndex]);
+        for (u32 KernelIndex = 0; KernelIndex < KernelCount; KernelIndex++)
+        {
+            u32 volatile Sink = 0;  // so that the hashes can't be optimized away
+            clock_t Start = clock();
+            for (u32 Iteration = 0; Iteration < Iterations; Iteration++)
+            {
+                Kernels[KernelIndex].Many(Sources, Lengths, Results, 8);
+                Sink += Results[Iteration & 7].a;
+            }
+            f64 Seconds = (f64)(clock() - Start) / CLOCKS_PER_SEC;
+            printf("  %s %.2f", Kernels[KernelIndex].Name, (f64)BytesPerRun / (Seconds * 1e9));
+        }
+        printf(" GB/s\n");
+    }
 }
 
-internal char
-AsciiToSextet(char C)
+// NOTE(vincent): Base64 kernels decode or encode the start of Source, in whole groups (4 characters
+// for 3 bytes), and return how many bytes of Source they consumed. A decoder stops before the first
+// group with anything outside the 64 characters of the alphabet in it, '=' padding included, which
+// leaves the last group and the invalid input to FromBase64(). The SIMD decoders store a few junk
+// bytes past their output, but never past the 3 bytes per 4 characters of Source.
+// RFC 4648: https://www.rfc-editor.org/rfc/rfc4648
+// The SIMD kernels follow Wojciech Muła and Daniel Lemire, "Faster Base64 Encoding and Decoding
+// Using AVX2 Instructions": http://0x80.pl/articles/index.html#base64-algorithm-new
+#define BASE64_DECODE(name) u32 name(u8 *Source, u32 Length, u8 *Dest)
+typedef BASE64_DECODE(base64_decode);
+#define BASE64_ENCODE(name) u32 name(u8 *Source, u32 Length, u8 *Dest)
+typedef BASE64_ENCODE(base64_encode);
+
+inline u8
+Base64Sextet(u8 C)
 {
-    // NOTE(vincent): Takes an incoming base 64 ascii character and decodes it back.
-    // In case of an unexpected input, we make sure the answer is in [0,63].
-    char Result;
-    if      ('A' <= C && C <= 'Z')   Result = C - 'A';
-    else if ('a' <= C && C <= 'z')   Result = C - 'a' + 26;
-    else if ('0' <= C && C <= '9')   Result = C - '0' + 52;
-    else if (C == '+')               Result = 62;
-    else                             Result = 63;
-    
-    Assert(0 <= Result && Result <= 63);
-    return Result;
+    // NOTE(vincent): 0xFF for anything outside the alphabet.
+    static const u8 Sextets[256] =
+    {
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x3E, 0xFF, 0xFF, 0xFF, 0x3F,
+        0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E,
+        0x0F, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+        0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F, 0x30, 0x31, 0x32, 0x33, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    };
+    return Sextets[C];
 }
 
+inline u8
+Base64Character(u32 Sextet)
+{
+    static const char Alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    return (u8)Alphabet[Sextet & 63];
+}
 
+internal BASE64_DECODE(DecodeBase64Scalar)
+{
+    u32 Read = 0;
+    for (; Read + 4 <= Length; Read += 4)
+    {
+        u32 A = Base64Sextet(Source[Read]);
+        u32 B = Base64Sextet(Source[Read + 1]);
+        u32 C = Base64Sextet(Source[Read + 2]);
+        u32 D = Base64Sextet(Source[Read + 3]);
+        if ((A | B | C | D) & 0x80)
+            break;
+        u32 Triple = (A << 18) | (B << 12) | (C << 6) | D;
+        Dest[0] = (u8)(Triple >> 16);
+        Dest[1] = (u8)(Triple >> 8);
+        Dest[2] = (u8)Triple;
+        Dest += 3;
+    }
+    return Read;
+}
 
-internal void
-ToBase64(char *Source, char *Dest, u32 SourceLength)
+internal BASE64_ENCODE(EncodeBase64Scalar)
 {
-    // NOTE(vincent): This is untested, probably buggy and not actually useful for our use case.
-    // We are only using base 64 decoding so far, we don't need to encode in base64.
-    // I just wrote this as a way to learn how base 64 works. 
-    
-    u32 ByteOffset = 0;
-    u32 DestOffset = 0;
-    while (ByteOffset <= SourceLength-3)
+    u32 Read = 0;
+    for (; Read + 3 <= Length; Read += 3)
     {
-        u8 *Block = (u8 *)Source + ByteOffset;
-        u8 Sextets[4]; 
-        Sextets[0] = Block[0] >> 2;
-        Sextets[1] = ((Block[0] << 4) | (Block[1] >> 4)) & 63;
-        Sextets[2] = ((Block[1] << 2) | (Block[2] >> 6)) & 63;
-        Sextets[3] = Block[2] & 63;
-        
-        for (u32 SextetIndex = 0; SextetIndex < 4; SextetIndex++)
-        {
-            Dest[DestOffset] = SextetToAscii(Sextets[SextetIndex]);
-            DestOffset++;
-        }
-        
-        ByteOffset += 3;
+        u32 Triple = (Source[Read] << 16) | (Source[Read + 1] << 8) | Source[Read + 2];
+        Dest[0] = Base64Character(Triple >> 18);
+        Dest[1] = Base64Character(Triple >> 12);
+        Dest[2] = Base64Character(Triple >> 6);
+        Dest[3] = Base64Character(Triple);
+        Dest += 4;
     }
-    
-    if (ByteOffset < SourceLength)
+    return Read;
+}
+
+// NOTE(vincent): How the SIMD decoders tell the alphabet from the rest: a character is valid when the
+// bit its low nibble selects in the first table and the bit its high nibble selects in the second have
+// nothing in common. Then the high nibble, with '/' told apart from '+', picks what to add to the
+// character to get its sextet. The 4 sextets of a group are merged into 3 bytes with two multiply-adds
+// (6+6 bits into 12, 12+12 into 24), and a shuffle puts the bytes of the groups back to back.
+#if ARCH_X86
+TARGET_SSSE3 internal BASE64_DECODE(DecodeBase64SSSE3)
+{
+    __m128i LowNibbleBits = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                          0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    __m128i HighNibbleBits = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                           0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    __m128i Offsets = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m128i Slash = _mm_set1_epi8(0x2F);
+    __m128i Pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    u32 Read = 0;
+    for (; Read + 24 <= Length; Read += 16)  // 24: the 16-byte store stays within what Source decodes to
     {
-        u8 *Block = (u8 *)Source + ByteOffset;
-        
-        if (ByteOffset == SourceLength - 2)
-        {
-            // NOTE(vincent): Read two bytes from the source, get three sextets, add one '=' of padding.
-            char Sextets[3];
-            Sextets[0] = Block[0] >> 2;
-            Sextets[1] = ((Block[0] << 4) | (Block[1] >> 4)) & 63,
-            Sextets[2] = (Block[1] << 2) & 63;
-            
-            for (u32 SextetIndex = 0; SextetIndex < 3; SextetIndex++)
-            {
-                Dest[DestOffset] = SextetToAscii(Sextets[SextetIndex]);
-                DestOffset++;
-            }
-            Dest[DestOffset] = '=';
-            DestOffset++;
-        }
-        else 
-        {
-            Assert(ByteOffset == SourceLength - 1);
-            // NOTE(vincent): Read one byte from the source, get two sextets, add two '='.
-            char Sextets[2];
-            Sextets[0] = (Block[0] >> 2),
-            Sextets[1] = (Block[0] << 4) & 63;
-            
-            for (u32 SextetIndex = 0; SextetIndex < 2; SextetIndex++)
-            {
-                Dest[DestOffset] = SextetToAscii(Sextets[SextetIndex]);
-                DestOffset++;
-            }
-            Dest[DestOffset] = '=';
-            DestOffset++;
-            Dest[DestOffset] = '=';
-            DestOffset++;
-        }
-        
+        __m128i Chars = _mm_loadu_si128((__m128i *)(Source + Read));
+        __m128i HighNibbles = _mm_and_si128(_mm_srli_epi32(Chars, 4), Slash);  // 0x2F: pshufb only looks at the low nibble and bit 7
+        __m128i LowNibbles = _mm_and_si128(Chars, Slash);
+        __m128i Invalid = _mm_and_si128(_mm_shuffle_epi8(LowNibbleBits, LowNibbles), _mm_shuffle_epi8(HighNibbleBits, HighNibbles));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(Invalid, _mm_setzero_si128())) != 0xFFFF)
+            break;
+        __m128i Offset = _mm_shuffle_epi8(Offsets, _mm_add_epi8(_mm_cmpeq_epi8(Chars, Slash), HighNibbles));
+        __m128i Sextets = _mm_add_epi8(Chars, Offset);
+        __m128i Pairs = _mm_maddubs_epi16(Sextets, _mm_set1_epi32(0x01400140));
+        __m128i Triples = _mm_madd_epi16(Pairs, _mm_set1_epi32(0x00011000));
+        _mm_storeu_si128((__m128i *)(Dest + Read/4*3), _mm_shuffle_epi8(Triples, Pack));
     }
-    
+    return Read;
 }
 
+TARGET_AVX2 internal BASE64_DECODE(DecodeBase64AVX2)
+{
+    __m256i LowNibbleBits = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                             0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+                                             0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                             0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    __m256i HighNibbleBits = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                              0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                              0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                              0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    __m256i Offsets = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                       0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m256i Slash = _mm256_set1_epi8(0x2F);
+    __m256i Pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    __m256i Compact = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);  // the 12 bytes of each half, back to back
+    u32 Read = 0;
+    for (; Read + 44 <= Length; Read += 32)  // 44: the 32-byte store stays within what Source decodes to
+    {
+        __m256i Chars = _mm256_loadu_si256((__m256i *)(Source + Read));
+        __m256i HighNibbles = _mm256_and_si256(_mm256_srli_epi32(Chars, 4), Slash);
+        __m256i LowNibbles = _mm256_and_si256(Chars, Slash);
+        __m256i Invalid = _mm256_and_si256(_mm256_shuffle_epi8(LowNibbleBits, LowNibbles), _mm256_shuffle_epi8(HighNibbleBits, HighNibbles));
+        if ((u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(Invalid, _mm256_setzero_si256())) != 0xFFFFFFFF)
+            break;
+        __m256i Offset = _mm256_shuffle_epi8(Offsets, _mm256_add_epi8(_mm256_cmpeq_epi8(Chars, Slash), HighNibbles));
+        __m256i Sextets = _mm256_add_epi8(Chars, Offset);
+        __m256i Pairs = _mm256_maddubs_epi16(Sextets, _mm256_set1_epi32(0x01400140));
+        __m256i Triples = _mm256_madd_epi16(Pairs, _mm256_set1_epi32(0x00011000));
+        __m256i Bytes = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(Triples, Pack), Compact);
+        _mm256_storeu_si256((__m256i *)(Dest + Read/4*3), Bytes);
+    }
+    _mm256_zeroupper();
+    return Read + DecodeBase64SSSE3(Source + Read, Length - Read, Dest + Read/4*3);
+}
+
+// NOTE(vincent): The SIMD encoders spread each group of 3 bytes over the 4 bytes of a 32-bit lane,
+// cut out the sextets with two multiplies that shift by a different amount in each 16-bit half,
+// and turn the sextets into characters by adding an offset picked by which of the 5 ranges of the
+// alphabet they fall in.
+#define BASE64_ENCODE_GATHER 1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10
+#define BASE64_ENCODE_OFFSETS 65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0
+
+TARGET_SSSE3 internal BASE64_ENCODE(EncodeBase64SSSE3)
+{
+    __m128i Gather = _mm_setr_epi8(BASE64_ENCODE_GATHER);
+    __m128i Offsets = _mm_setr_epi8(BASE64_ENCODE_OFFSETS);
+    u32 Read = 0;
+    for (; Read + 16 <= Length; Read += 12)  // 12 bytes used out of the 16 we load
+    {
+        __m128i Bytes = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(Source + Read)), Gather);
+        __m128i High = _mm_mulhi_epu16(_mm_and_si128(Bytes, _mm_set1_epi32(0x0FC0FC00)), _mm_set1_epi32(0x04000040));
+        __m128i Low = _mm_mullo_epi16(_mm_and_si128(Bytes, _mm_set1_epi32(0x003F03F0)), _mm_set1_epi32(0x01000010));
+        __m128i Sextets = _mm_or_si128(High, Low);
+        // Range 0 (A-Z) gets index 0, the others 1 to 13: 1 for a-z, 2 to 11 for the digits, 12 for '+', 13 for '/'.
+        __m128i Index = _mm_sub_epi8(_mm_subs_epu8(Sextets, _mm_set1_epi8(51)), _mm_cmpgt_epi8(Sextets, _mm_set1_epi8(25)));
+        __m128i Chars = _mm_add_epi8(Sextets, _mm_shuffle_epi8(Offsets, Index));
+        _mm_storeu_si128((__m128i *)(Dest + Read/3*4), Chars);
+    }
+    return Read;
+}
+
+TARGET_AVX2 internal BASE64_ENCODE(EncodeBase64AVX2)
+{
+    __m256i Gather = _mm256_setr_epi8(BASE64_ENCODE_GATHER, BASE64_ENCODE_GATHER);
+    __m256i Offsets = _mm256_setr_epi8(BASE64_ENCODE_OFFSETS, BASE64_ENCODE_OFFSETS);
+    u32 Read = 0;
+    for (; Read + 28 <= Length; Read += 24)  // 12 bytes into each half
+    {
+        __m128i First = _mm_loadu_si128((__m128i *)(Source + Read));
+        __m128i Second = _mm_loadu_si128((__m128i *)(Source + Read + 12));
+        __m256i Bytes = _mm256_inserti128_si256(_mm256_castsi128_si256(First), Second, 1);
+        Bytes = _mm256_shuffle_epi8(Bytes, Gather);
+        __m256i High = _mm256_mulhi_epu16(_mm256_and_si256(Bytes, _mm256_set1_epi32(0x0FC0FC00)), _mm256_set1_epi32(0x04000040));
+        __m256i Low = _mm256_mullo_epi16(_mm256_and_si256(Bytes, _mm256_set1_epi32(0x003F03F0)), _mm256_set1_epi32(0x01000010));
+        __m256i Sextets = _mm256_or_si256(High, Low);
+        __m256i Index = _mm256_sub_epi8(_mm256_subs_epu8(Sextets, _mm256_set1_epi8(51)), _mm256_cmpgt_epi8(Sextets, _mm256_set1_epi8(25)));
+        __m256i Chars = _mm256_add_epi8(Sextets, _mm256_shuffle_epi8(Offsets, Index));
+        _mm256_storeu_si256((__m256i *)(Dest + Read/3*4), Chars);
+    }
+    _mm256_zeroupper();
+    return Read + EncodeBase64SSSE3(Source + Read, Length - Read, Dest + Read/3*4);
+}
+#endif
+
+internal base64_decode *
+SelectBase64Decode(cpu_features CPU)
+{
+#if ARCH_X86
+    base64_decode *Result = CPU.AVX2 ? DecodeBase64AVX2 : CPU.SSSE3 ? DecodeBase64SSSE3 : DecodeBase64Scalar;
+#else
+    base64_decode *Result = DecodeBase64Scalar;
+#endif
+    return Result;
+}
+
+internal base64_encode *
+SelectBase64Encode(cpu_features CPU)
+{
+#if ARCH_X86
+    base64_encode *Result = CPU.AVX2 ? EncodeBase64AVX2 : CPU.SSSE3 ? EncodeBase64SSSE3 : EncodeBase64Scalar;
+#else
+    base64_encode *Result = EncodeBase64Scalar;
+#endif
+    return Result;
+}
 
 internal string
-FromBase64(string Source, char *Dest)
+FromBase64(string Source, char *Dest, base64_decode *Decode)
 {
-    string Result;
-    Result.Base = Dest;
-    Result.Length = 0;
+    // NOTE(vincent): Dest needs room for 3 bytes per 4 characters of Source, rounded up.
+    // The result has a null Base if Source isn't base64: a character outside the alphabet, padding
+    // anywhere but at the end, or a last group of a single character. The last group may come
+    // without its padding.
+    u8 *In = (u8 *)Source.Base;
+    u8 *Out = (u8 *)Dest;
+    u32 Read = Decode(In, Source.Length, Out);
+    Read += DecodeBase64Scalar(In + Read, Source.Length - Read, Out + Read/4*3);
+    string Result = StringBaseLength(Dest, Read/4*3);
     
-    u32 ReadCount = 0;
-    while (ReadCount < Source.Length)
+    u32 Left = Source.Length - Read;
+    if (Left == 4 && In[Read + 3] == '=')
+        Left = (In[Read + 2] == '=') ? 2 : 3;
+    else if (Left >= 4)
+        Left = 1;  // an invalid character, or padding before the end
+    if (Left == 1)
     {
-        u32 ChunkSize = Minimum(4, Source.Length - ReadCount);
-        u8 *Chunk = (u8 *)Source.Base + ReadCount;
-        char *DestPtr = Result.Base + Result.Length;
-        
-        u32 PadFreeSize = 0;
-        char Decoded[4];
-        while (PadFreeSize < ChunkSize && Chunk[PadFreeSize] != '=')
+        Result.Base = 0;
+        Result.Length = 0;
+    }
+    else if (Left)
+    {
+        u32 A = Base64Sextet(In[Read]);
+        u32 B = Base64Sextet(In[Read + 1]);
+        u32 C = (Left == 3) ? Base64Sextet(In[Read + 2]) : 0;
+        if ((A | B | C) & 0x80)
         {
-            Decoded[PadFreeSize] = AsciiToSextet(Chunk[PadFreeSize]);
-            PadFreeSize++;
+            Result.Base = 0;
+            Result.Length = 0;
         }
-        // '=' padding normally never happens in the first byte of a chunk.
-        // However, the program should at least not crash if it is being fed something dumb.
-        // Basically, PadFreeSize could be 0 or 1, and at that point it probably doesn't matter
-        // what we write to the dest buffer, but we shouldn't crash.
-        
-        switch (PadFreeSize)
+        else
         {
-            case 4:
-            {
-                u8 OutputA = (Decoded[0] << 2) | (Decoded[1] >> 4);
-                u8 OutputB = (Decoded[1] << 4) | (Decoded[2] >> 2);
-                u8 OutputC = (Decoded[2] << 6) | Decoded[3];
-                DestPtr[0] = OutputA;
-                DestPtr[1] = OutputB;
-                DestPtr[2] = OutputC;
-                Result.Length += 3;
-            } break;
-            case 3:
-            {
-                u8 OutputA = (Decoded[0] << 2) | (Decoded[1] >> 4);
-                u8 OutputB = (Decoded[1] << 4) | (Decoded[2] >> 2);
-                DestPtr[0] = OutputA;
-                DestPtr[1] = OutputB;
-                Result.Length += 2;
-            } break;
-            case 2:
-            {
-                u8 OutputA = (Decoded[0] << 2) | (Decoded[1] >> 4);
-                DestPtr[0] = OutputA;
-                Result.Length += 1;
-            } break;
-            default:
-            {
-            }
+            u32 Triple = (A << 18) | (B << 12) | (C << 6);
+            Out[Result.Length++] = (u8)(Triple >> 16);
+            if (Left == 3)
+                Out[Result.Length++] = (u8)(Triple >> 8);
         }
-        ReadCount += ChunkSize;
     }
-    
     return Result;
 }
 
+internal string
+ToBase64(string Source, char *Dest, base64_encode *Encode)
+{
+    // NOTE(vincent): Dest needs room for 4 characters per 3 bytes of Source, rounded up.
+    // The last group is padded with '='.
+    u8 *In = (u8 *)Source.Base;
+    u8 *Out = (u8 *)Dest;
+    u32 Read = Encode(In, Source.Length, Out);
+    Read += EncodeBase64Scalar(In + Read, Source.Length - Read, Out + Read/3*4);
+    string Result = StringBaseLength(Dest, Read/3*4);
+    
+    u32 Left = Source.Length - Read;
+    if (Left)
+    {
+        u32 Triple = (In[Read] << 16) | ((Left == 2) ? (In[Read + 1] << 8) : 0);
+        Out[Result.Length++] = Base64Character(Triple >> 18);
+        Out[Result.Length++] = Base64Character(Triple >> 12);
+        Out[Result.Length++] = (Left == 2) ? Base64Character(Triple >> 6) : '=';
+        Out[Result.Length++] = '=';
+    }
+    return Result;
+}
 
 internal void
 TestFromBase64()
 {
+    cpu_features CPU = DetectCPUFeatures();
+#if ARCH_X86
+    base64_decode *Decoders[] = {DecodeBase64Scalar, DecodeBase64SSSE3, DecodeBase64AVX2};
+    base64_encode *Encoders[] = {EncodeBase64Scalar, EncodeBase64SSSE3, EncodeBase64AVX2};
+#else
+    base64_decode *Decoders[] = {DecodeBase64Scalar};
+    base64_encode *Encoders[] = {EncodeBase64Scalar};
+#endif
+    u32 KernelCount = CPU.AVX2 ? 3 : CPU.SSSE3 ? 2 : 1;
+    b32 Success = true;
     char Dest[1000] = {};
     
-    string UserUser = StringFromLiteral("user:user");
-    string Encoded = StringFromLiteral("dXNlcjp1c2Vy");
-    string Decoded = FromBase64(Encoded, Dest);
-    
-    Assert(StringsAreEqual(UserUser, Decoded));
-    
-    string Jojo = StringFromLiteral("jojo no kimyouna bouken");
-    string Encoded2 = StringFromLiteral("am9qbyBubyBraW15b3VuYSBib3VrZW4=");
-    string Decoded2 = FromBase64(Encoded2, Dest);
-    
-    Assert(StringsAreEqual(Jojo, Decoded2));
-    
+    struct base64_vector
+    {
+        const char *Plain;
+        const char *Encoded;
+    };
+    base64_vector Vectors[] =
+    {
+        {"user:user", "dXNlcjp1c2Vy"},
+        {"jojo no kimyouna bouken", "am9qbyBubyBraW15b3VuYSBib3VrZW4="},
+        {"", ""}, {"f", "Zg=="}, {"fo", "Zm8="}, {"foo", "Zm9v"}, {"foob", "Zm9vYg=="}, {"fooba", "Zm9vYmE="}, {"foobar", "Zm9vYmFy"},
+        {"The quick brown fox jumps over the lazy dog, twice: the quick brown fox jumps over the lazy dog.",
+         "VGhlIHF1aWNrIGJyb3duIGZveCBqdW1wcyBvdmVyIHRoZSBsYXp5IGRvZywgdHdpY2U6IHRoZSBxdWljayBicm93biBmb3gganVtcHMgb3ZlciB0aGUgbGF6eSBkb2cu"},
+    };
+    for (u32 KernelIndex = 0; KernelIndex < KernelCount; KernelIndex++)
+    {
+        for (u32 VectorIndex = 0; VectorIndex < ArrayCount(Vectors); VectorIndex++)
+        {
+            string Plain = StringFromLiteral(Vectors[VectorIndex].Plain);
+            string Encoded = StringFromLiteral(Vectors[VectorIndex].Encoded);
+            Success &= StringsAreEqual(FromBase64(Encoded, Dest, Decoders[KernelIndex]), Plain);
+            Success &= StringsAreEqual(ToBase64(Plain, Dest, Encoders[KernelIndex]), Encoded);
+        }
+        
+        // The padding may be left out, but nothing else goes.
+        Success &= StringsAreEqual(FromBase64(StringFromLiteral("Zm9vYmE"), Dest, Decoders[KernelIndex]), "fooba");
+        Success &= StringsAreEqual(FromBase64(StringFromLiteral("Zm9vYg"), Dest, Decoders[KernelIndex]), "foob");
+        const char *Invalid[] = {"Zm9vY", "Zg=", "Z===", "Zg==Zm9v", "Zm9v\r\n", "Zm 9v", "Zm9v-_==", "Zm9\xc3\xa9"};
+        for (u32 InvalidIndex = 0; InvalidIndex < ArrayCount(Invalid); InvalidIndex++)
+            Success &= (FromBase64(StringFromLiteral(Invalid[InvalidIndex]), Dest, Decoders[KernelIndex]).Base == 0);
+    }
     
-}
\ No newline at end of file
+    // NOTE(vincent): Randomized round trips, with every length up to a few SIMD blocks, so that the
+    // last groups fall everywhere relative to the 16 and 32 byte blocks. The encoders have to agree with
+    // each other and the decoders have to give the bytes back. Then one character of the encoding is
+    // made invalid, which every decoder has to notice, wherever it is.
+    u8 Plain[200];
+    char Encoded[ArrayCount(Plain)/3*4 + 4];
+    u32 Random = 0x12345678;
+    for (u32 Length = 0; Length <= ArrayCount(Plain); Length++)
+    {
+        for (u32 Byte = 0; Byte < Length; Byte++)
+        {
+            Random ^= Random << 13;
+            Random ^= Random >> 17;
+            Random ^= Random << 5;
+            Plain[Byte] = (u8)Random;
+        }
+        string PlainString = StringBaseLength((char *)Plain, Length);
+        string Expected = ToBase64(PlainString, Encoded, EncodeBase64Scalar);
+        for (u32 KernelIndex = 0; KernelIndex < KernelCount; KernelIndex++)
+        {
+            Success &= StringsAreEqual(ToBase64(PlainString, Dest, Encoders[KernelIndex]), Expected);
+            Success &= StringsAreEqual(FromBase64(Expected, Dest, Decoders[KernelIndex]), PlainString);
+        }
+        if (Expected.Length)
+        {
+            u32 Position = Random % Expected.Length;
+            char Saved = Encoded[Position];
+            Encoded[Position] = (Random & 1) ? '.' : (char)0x80;
+            for (u32 KernelIndex = 0; KernelIndex < KernelCount; KernelIndex++)
+                Success &= (FromBase64(Expected, Dest, Decoders[KernelIndex]).Base == 0);
+            Encoded[Position] = Saved;
+        }
+    }
+    Assert(Success);
+}
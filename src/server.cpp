@@ -1,7 +1,12 @@
 #include "server_config_loader.cpp"
-#include "server.h"
-#include "md5_hash.cpp"
+#include "server_file_cache.cpp"
+#include "server_work_queue.cpp"
 #include "server_http_parsing.cpp"
+#include "server_slab.cpp"
+#include "md5_hash.cpp"
+#include "server_htpasswd.cpp"
+#include "server_vhosts.cpp"
+#include "server.h"
 
 // TODO(vincent): profiling? I'm curious to see what's slow
 // TODO(vincent): the bonus feature
@@ -9,39 +14,87 @@
 internal initialize_server_memory_result
 InitializeServerMemory(server_memory *Memory, platform_work_queue *Queue, 
                        platform_add_entry *PlatformAddEntry, 
-                       platform_do_next_work_entry *PlatformDoNextWorkEntry)
+                       platform_do_next_work_entry *PlatformDoNextWorkEntry,
+                       platform_send_file *PlatformSendFile,
+                       platform_wait_on_address *PlatformWaitOnAddress,
+                       platform_wake_on_address *PlatformWakeOnAddress,
+                       platform_count_huge_pages *PlatformCountHugePages,
+                       platform_get_thread_node *PlatformGetThreadNode,
+                       platform_open_beneath *PlatformOpenBeneath,
+                       platform_stat_beneath *PlatformStatBeneath,
+                       platform_watch_connection *PlatformWatchConnection)
 {
 #if DEBUG
     TestMD5();
     TestFromBase64();
+    TestScanLine();
+    TestHTTPParser();
+    TestSlabNodes();
+    TestHtpasswdUsers();
+    TestVirtualHostNames();
 #endif
     
     // NOTE(vincent): Initialize server state.
     initialize_server_memory_result InitResult = {};
     
+    // NOTE(vincent): Memory->Storage is only reserved: the server arena commits what it pushes.
     server_state *State = (server_state *)Memory->Storage;
-    InitializeArena(&State->Arena, Memory->StorageSize - sizeof(server_state),
-                    (u8 *)Memory->Storage + sizeof(server_state));
+    if (!CommitMemory(State, sizeof(server_state)))
+    {
+        InvalidCodePath;
+    }
+    InitializeGrowableArena(&State->Arena, Memory->StorageSize - sizeof(server_state),
+                            (u8 *)Memory->Storage + sizeof(server_state), 0);
     
     State->Queue = Queue;
     Memory->PlatformAddEntry = PlatformAddEntry;
     Memory->PlatformDoNextWorkEntry = PlatformDoNextWorkEntry;
+    Memory->PlatformSendFile = PlatformSendFile;
+    Memory->PlatformWaitOnAddress = PlatformWaitOnAddress;
+    Memory->PlatformWakeOnAddress = PlatformWakeOnAddress;
+    Memory->PlatformCountHugePages = PlatformCountHugePages;
+    Memory->PlatformGetThreadNode = PlatformGetThreadNode;
+    Memory->PlatformWatchConnection = PlatformWatchConnection;
+    State->PlatformSendsFiles = (PlatformSendFile != 0);
+    State->VirtualHosts.PlatformOpenBeneath = PlatformOpenBeneath;
+    State->VirtualHosts.PlatformStatBeneath = PlatformStatBeneath;
+    State->CPU = DetectCPUFeatures();
+    State->ScanLine = SelectScanLine(State->CPU);
+    State->DecodeBase64 = SelectBase64Decode(State->CPU);
+    State->EncodeBase64 = SelectBase64Encode(State->CPU);
+    InitializeProtectionCache(&State->Protection, &State->Arena);
+#if RUN_BENCHMARKS
+    BenchmarkScanLine(State->CPU);
+    BenchmarkMD5(State->CPU);
+#endif
     
     // NOTE(vincent): Load config file
     parsed_config_file_result *Config = &State->Config;
     Assert(sizeof(DEFAULT_SERVER_PORT) <= ArrayCount(Config->PortString));
     Sprint(Config->PortString, DEFAULT_SERVER_PORT); // initializing to default server port number
+    Config->IdleTimeout = DEFAULT_IDLE_TIMEOUT;
+    Config->CacheSize = DEFAULT_FILE_CACHE_SIZE;
+    Config->MaxHeaderSize = DEFAULT_MAX_HEADER_SIZE;
+    Config->MaxConnections = DEFAULT_MAX_CONNECTIONS;
+    Config->ConnectionMemory = DEFAULT_CONNECTION_MEMORY;
+    Config->Backlog = DEFAULT_BACKLOG;
+    Config->ThreadCount = 0;  // the platform layer picks
+    Config->MaxThreadCount = 0;
+    Config->ThreadIdleTimeout = DEFAULT_THREAD_IDLE_TIMEOUT;
     InitResult.ParsingErrorCount = ParseConfigFile(Config, &State->Arena);
     InitResult.PortString = Config->PortString;
+    InitResult.Config = Config;
     
     // NOTE(vincent): Push string constants tightly and null-terminate them.
     // Note that sizeof() on a string literal counts the terminating null character,
     // and that should be a compile-time calculation.
-#define STRING_OK "HTTP/1.1 200 OK\r\n\r\n"
-#define STRING_BR "HTTP/1.1 400 Bad Request\r\n\r\n"
-#define STRING_NF "HTTP/1.1 404 Not Found\r\n\r\n"
-#define STRING_UN "HTTP/1.1 401 Unauthorized\r\nWWW-Authenticate: Basic realm=\"Access to the staging site\"\r\n\r\n"
-#define STRING_FB "HTTP/1.1 403 Forbidden\r\n\r\n"
+    // These are only the first lines of the responses: RespondToRequest() appends Content-Length,
+    // possibly Connection, and the empty line that ends the header.
+#define STRING_OK "HTTP/1.1 200 OK\r\n"
+#define STRING_BR "HTTP/1.1 400 Bad Request\r\n"
+#define STRING_NF "HTTP/1.1 404 Not Found\r\n"
+#define STRING_UN "HTTP/1.1 401 Unauthorized\r\nWWW-Authenticate: Basic realm=\"Access to the staging site\"\r\n"
+#define STRING_FB "HTTP/1.1 403 Forbidden\r\n"
     State->StringOK = PushArray(&State->Arena, sizeof(STRING_OK), char);
     State->StringBR = PushArray(&State->Arena, sizeof(STRING_BR), char);
     State->StringNF = PushArray(&State->Arena, sizeof(STRING_NF), char);
@@ -53,192 +106,1036 @@ InitializeServerMemory(server_memory *Memory, platform_work_queue *Queue,
     Sprint(State->StringUN, STRING_UN);
     Sprint(State->StringFB, STRING_FB);
     
-    // NOTE(vincent): task_with_memory and subarena initialization
-    u32 RemainingArenaSize = State->Arena.Size - State->Arena.Used;
-    Assert(RemainingArenaSize >= Megabytes(50));
-    u32 SubArenaSize = RemainingArenaSize / ArrayCount(State->Tasks);
-    for (u32 TaskIndex = 0; TaskIndex < ArrayCount(State->Tasks); TaskIndex++)
+    // NOTE(vincent): The 503 goes out before we even read the request, so it is complete as is.
+#define RESPONSE_503 "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\nRetry-After: 1\r\n\r\n"
+    State->Response503.Base = PushArray(&State->Arena, sizeof(RESPONSE_503), char);
+    State->Response503.Length = sizeof(RESPONSE_503) - 1;
+    Sprint(State->Response503.Base, RESPONSE_503);
+    
+    // NOTE(vincent): The slot and slab free lists index their arrays with 16 bits.
+    if (Config->MaxConnections == 0 || Config->MaxConnections > INDEX_STACK_MAX)
+    {
+        Config->MaxConnections = Config->MaxConnections ? INDEX_STACK_MAX : 1;
+        printf("Max connections set to %u\n", Config->MaxConnections);
+    }
+    
+    // NOTE(vincent): The biggest ReceiveBuffer is a 64 KB block, see GrowReceiveBuffer().
+    if (Kilobytes(Config->MaxHeaderSize) > 65536)
     {
-        task_with_memory *Task = State->Tasks + TaskIndex;
-        Task->BeingUsed = false;
-        Task->Index = TaskIndex;
-        SubArena(&Task->Arena, &State->Arena, SubArenaSize);
+        Config->MaxHeaderSize = 64;
+        printf("Max request header size set to %u KB\n", Config->MaxHeaderSize);
     }
     
     return InitResult;
 }
 
-internal task_with_memory *
-BeginTaskWithMemory(server_state *State)
+internal void
+InitializeServerFileCache(server_memory *Memory, void *CacheMemory, size_t CacheSize)
+{
+    // NOTE(vincent): The platform layer calls this once it allocated Config->CacheSize megabytes,
+    // before any connection comes in. A null CacheMemory leaves the cache disabled.
+    server_state *State = (server_state *)Memory->Storage;
+    InitializeFileCache(&State->FileCache, CacheMemory, CacheSize);
+}
+
+internal b32
+AddVirtualHost(server_memory *Memory, char *Name, s64 Directory)
+{
+    // NOTE(vincent): The platform layer calls this for every directory under the root, with its own handle
+    // on it, before any connection comes in. False if the name is taken already, whatever its case:
+    // the platform layer keeps the handle then.
+    server_state *State = (server_state *)Memory->Storage;
+    virtual_hosts *Hosts = &State->VirtualHosts;
+    string DiskName = StringFromLiteral(Name);
+    string Lowered = StringBaseLength(PushArray(&State->Arena, DiskName.Length + 1, char), DiskName.Length);
+    for (u32 Index = 0; Index < DiskName.Length; Index++)
+        Lowered.Base[Index] = ToLowerCase(DiskName.Base[Index]);
+    Lowered.Base[Lowered.Length] = 0;
+    if (FindVirtualHost(Hosts, Lowered))
+        return false;
+    
+    char *Root = State->Config.Root;
+    u32 RootLength = StringLength(Root);
+    virtual_host *Host = PushStruct(&State->Arena, virtual_host);
+    Host->Name = Lowered;
+    Host->Hash = HashPath(Lowered);
+    Host->Path = StringBaseLength(PushArray(&State->Arena, RootLength + 1 + DiskName.Length + 1, char),
+                                  RootLength + 1 + DiskName.Length);
+    SprintNoNull(Host->Path.Base, Root);
+    SprintNoNull(Host->Path.Base + RootLength, "/");
+    Sprint(Host->Path.Base + RootLength + 1, Name);
+    Host->Directory = Directory;
+    virtual_host **Bucket = &Hosts->Buckets[Host->Hash & (VIRTUAL_HOST_BUCKET_COUNT - 1)];
+    Host->NextInBucket = *Bucket;
+    *Bucket = Host;
+    Hosts->Count++;
+    return true;
+}
+
+internal void
+AddMemoryRegion(server_memory *Memory, char *Name, void *Base, size_t Size, huge_page_backing Backing)
 {
-    // NOTE(vincent): Linear scan for an available task_with_memory in the server state.
-    task_with_memory *FoundTask = 0;
-    for (u32 TaskIndex = 0; TaskIndex < ArrayCount(State->Tasks); TaskIndex++)
+    // NOTE(vincent): The platform layer tells us about each big block it allocated, so that we can
+    // report how much of it is backed by huge pages.
+    server_state *State = (server_state *)Memory->Storage;
+    Assert(State->RegionCount < MEMORY_REGION_MAX);
+    memory_region *Region = State->Regions + State->RegionCount++;
+    Region->Name = Name;
+    Region->Base = Base;
+    Region->Size = Size;
+    Region->Backing = Backing;
+}
+
+internal u32
+SprintMemoryRegions(char *Dest, server_memory *Memory)
+{
+    // NOTE(vincent): One line per region: what we asked for, and how many kilobytes of it
+    // the OS actually backs with huge pages right now. Transparent huge pages come and go
+    // as the kernel sees fit, so this is only worth anything as a live counter.
+    server_state *State = (server_state *)Memory->Storage;
+    u32 Length = 0;
+    if (Memory->PlatformCountHugePages)
     {
-        task_with_memory *Task = State->Tasks + TaskIndex;
-        if (Task->BeingUsed == false)
+        char *BackingNames[] = {"4 KB pages", "transparent huge pages", "explicit huge pages"};
+        Length += Sprint(Dest + Length, "Huge pages:\n");
+        for (u32 RegionIndex = 0; RegionIndex < State->RegionCount; RegionIndex++)
         {
-            FoundTask = Task;
-            Task->BeingUsed = true;
-            Task->TempMemory = BeginTemporaryMemory(&Task->Arena);
-            break;
+            memory_region *Region = State->Regions + RegionIndex;
+            size_t HugeSize = Memory->PlatformCountHugePages(Region->Base, Region->Size);
+            Length += Sprint(Dest + Length, "  ");
+            Length += Sprint(Dest + Length, Region->Name);
+            Length += Sprint(Dest + Length, " (");
+            Length += Sprint(Dest + Length, BackingNames[Region->Backing]);
+            Length += Sprint(Dest + Length, "): ");
+            Length += SprintUnsigned(Dest + Length, HugeSize / 1024);
+            Length += Sprint(Dest + Length, " KB of ");
+            Length += SprintUnsigned(Dest + Length, Region->Size / 1024);
+            Length += Sprint(Dest + Length, " KB in huge pages\n");
         }
     }
-    return FoundTask;
+    return Length;
 }
 
-inline void
-EndTaskWithMemory(task_with_memory *Task)
+#define RECEIVE_BUFFER_CLASS SlabClass_4K       // grows a class at a time up to Config->MaxHeaderSize for bigger request headers
+#define RECEIVE_BUFFER_MAX_CLASS SlabClass_64K
+#define SEND_BUFFER_CLASS SlabClass_64K          // the response header, and then the file in chunks of that size
+#define PRINT_BUFFER_SIZE 8192
+#define RESPONSE_HEADER_MAX 512   // SendBuffer room we want before we append the response to a pipelined request
+#define SEND_FILE_MIN_SIZE Kilobytes(16)  // smaller files are copied to SendBuffer, where pipelined responses can join them
+#define MAX_SEND_LENGTH Megabytes(1)      // how much of a cached body we hand to one send()
+#define REQUEST_LINE_PRINT_MAX 1024       // how much of the first line of a request goes to the log
+#define CONNECTION_ARENA_RESERVE 1048576  // address space of the slot arena of a connection, a multiple of MEMORY_COMMIT_GRANULARITY
+#define CONNECTION_ARENA_RETAIN 65536     // what a slot arena keeps committed after a request that needed more
+#define SLAB_REPORT_INTERVAL 1024         // requests between two prints of the connection memory occupancy
+#define QUEUE_FULL_SPIN_COUNT 1024        // tries to add to a full work queue before the accepting thread sleeps or rejects
+
+#ifdef MSG_MORE
+#define SEND_FLAG_MORE MSG_MORE
+#else
+#define SEND_FLAG_MORE 0  // NOTE(vincent): Windows has no such flag, we just lose the coalescing
+#endif
+
+
+inline u32
+ConnectionSlabCount(parsed_config_file_result *Config)
 {
-    EndTemporaryMemory(Task->TempMemory);
-    //CompletePreviousWritesBeforeFutureWrites; // TODO(vincent): not sure why this would be warranted
-    Task->BeingUsed = false;
+    size_t SlabCount = Megabytes((size_t)Config->ConnectionMemory) / SLAB_SIZE;
+    if (SlabCount > INDEX_STACK_MAX)
+        SlabCount = INDEX_STACK_MAX;
+    return (u32)SlabCount;
 }
 
-internal string
-DecodeAuthString(memory_arena *Arena, string AuthString)
+internal size_t
+ConnectionSlotsMemorySize(server_memory *Memory)
 {
-    // We want to do the following transformation:
-    // base64(username:password) -> username:password -> username:md5(password)
-    // where the md5 part is a printable 32-byte ascii version of the md5 hash.
+    // NOTE(vincent): How much the platform layer has to allocate for InitializeConnectionSlots().
+    server_state *State = (server_state *)Memory->Storage;
+    u32 SlotCount = State->Config.MaxConnections;
+    u32 SlabCount = ConnectionSlabCount(&State->Config);
+    size_t Result = (size_t)SlabCount*SLAB_SIZE + SlabDepotStorageSize(SlabCount);
+    Result += SlotCount*(sizeof(connection) + sizeof(u32) + (size_t)CONNECTION_ARENA_RESERVE);
+    Result += 2*SlabCount*sizeof(u32) + MEMORY_COMMIT_GRANULARITY;
+    return Result;
+}
+
+internal void
+InitializeConnectionSlots(server_memory *Memory, void *SlotsMemory, size_t SlotsMemorySize, u32 NodeCount)
+{
+    // NOTE(vincent): The platform layer calls this with ConnectionSlotsMemorySize() bytes of reserved
+    // address space, before any connection comes in. The slabs go first, where the alignment we get
+    // is a slab alignment, and the slot arenas last, which are growable: we commit everything
+    // but them, and of that, only the connection records are written to now.
+    // NodeCount is how many NUMA nodes the slabs are split between, 1 to not split them.
+    server_state *State = (server_state *)Memory->Storage;
+    connection_slots *Slots = &State->Slots;
+    Assert(SlotsMemorySize >= ConnectionSlotsMemorySize(Memory));
+    u8 *At = (u8 *)SlotsMemory;
     
-    char *Dest = PushArray(Arena, AuthString.Length + 72, char);
+    u32 SlabCount = ConnectionSlabCount(&State->Config);
+    u8 *SlabBase = At;
+    At += (size_t)SlabCount*SLAB_SIZE;
     
-    string Plain = FromBase64(AuthString, Dest);  // this should be less bytes than the source
+    Slots->Count = State->Config.MaxConnections;
+    Slots->Connections = (connection *)At;
+    At += Slots->Count*sizeof(connection);
+    u8 **DepotStorage = (u8 **)At;
+    At += SlabDepotStorageSize(SlabCount);
+    u32 volatile *NextFreeSlot = (u32 volatile *)At;
+    At += Slots->Count*sizeof(u32);
+    u32 volatile *NextFreeSlab = (u32 volatile *)At;
+    At += SlabCount*sizeof(u32);
+    u32 *DepotBlockCounts = (u32 *)At;
+    At += SlabCount*sizeof(u32);
+    At = (u8 *)(((uintptr_t)At + MEMORY_COMMIT_GRANULARITY - 1) & ~((uintptr_t)MEMORY_COMMIT_GRANULARITY - 1));
+    if (!CommitMemory(SlotsMemory, At - (u8 *)SlotsMemory))
+    {
+        InvalidCodePath;
+    }
     
-#if 0
-    printf("Plain : ");
-    PrintString(Plain);
-    printf("\n");
-    Assert(StringsAreEqual(Plain, "user:user"));
-#endif
+    for (u32 SlotIndex = 0; SlotIndex < Slots->Count; SlotIndex++)
+    {
+        connection *Connection = Slots->Connections + SlotIndex;
+        Connection->Slots = Slots;
+        Connection->SlotIndex = SlotIndex;
+        Connection->Socket = INVALID_SOCKET;
+        Connection->State = ConnectionState_Closing;
+        Connection->FilePipe[0] = -1;
+        Connection->FilePipe[1] = -1;
+        InitializeGrowableArena(&Connection->Arena, CONNECTION_ARENA_RESERVE, At, CONNECTION_ARENA_RETAIN);
+        At += CONNECTION_ARENA_RESERVE;
+    }
+    Assert(At <= (u8 *)SlotsMemory + SlotsMemorySize);
     
-    string PasswordPart = StringSuffixAfter(Plain, ':');
+    InitializeIndexStack(&Slots->FreeSlots, NextFreeSlot, Slots->Count);
+    InitializeSlabAllocator(&Slots->Slab, SlabBase, SlabCount, NodeCount, NextFreeSlab, DepotStorage, DepotBlockCounts);
+    Slots->Slab.DecommitFreeSlabs = !State->Config.HugePages;  // it would split the huge pages
+    Slots->Memory = Memory;
+    Slots->InUseCount = 0;
+    Slots->WaiterCount = 0;
+    Slots->QueueWaiterCount = 0;
+    Slots->QueueTakeCount = 0;
+    Slots->RequestCount = 0;
+}
+
+internal connection *
+AcquireConnectionSlot(connection_slots *Slots)
+{
+    // NOTE(vincent): Returns 0 right away if every slot is taken.
+    connection *Result = 0;
+    u32 SlotIndex;
+    if (PopIndex(&Slots->FreeSlots, &SlotIndex))
+    {
+        Result = Slots->Connections + SlotIndex;
+        AtomicAddU32(&Slots->InUseCount, 1);
+    }
+    return Result;
+}
+
+internal connection *
+WaitForConnectionSlot(server_memory *Memory)
+{
+    // NOTE(vincent): Sleeps until ReleaseConnectionSlot() gives a slot back, instead of spinning.
+    // We count ourselves as a waiter before we look at the free list one last time, and
+    // ReleaseConnectionSlot() looks at the waiter count after it pushed the slot, with a full fence
+    // on both sides. So either we see the slot it pushed, or it sees us and wakes us up. And if it
+    // pushed between our look and our sleep, the top of the stack changed and the wait returns right away.
+    server_state *State = (server_state *)Memory->Storage;
+    connection_slots *Slots = &State->Slots;
+    connection *Connection = AcquireConnectionSlot(Slots);
+    while (!Connection)
+    {
+        AtomicAddU32(&Slots->WaiterCount, 1);
+        AtomicFence();
+        u32 Top = AtomicLoadU32(&Slots->FreeSlots.Top);
+        if (IndexStackIsEmpty(Top))
+            Memory->PlatformWaitOnAddress(&Slots->FreeSlots.Top, Top);
+        AtomicAddU32(&Slots->WaiterCount, (u32)-1);
+        Connection = AcquireConnectionSlot(Slots);
+    }
+    return Connection;
+}
+
+internal void
+ReleaseConnectionSlot(server_memory *Memory, connection *Connection)
+{
+    // NOTE(vincent): The connection must be closed, so that its blocks went back already.
+    connection_slots *Slots = Connection->Slots;
+    Assert(Connection->Socket == INVALID_SOCKET);
+    Assert(!Connection->ReceiveBuffer && !Connection->SendBuffer);
+    AtomicAddU32(&Slots->InUseCount, (u32)-1);
+    PushIndex(&Slots->FreeSlots, Connection->SlotIndex);
     
-#if 0
-    printf("PasswordPart (%d) : ", PasswordPart.Length);
-    PrintString(PasswordPart);
-    Assert(StringsAreEqual(PasswordPart, "user"));
-    printf("\n");
+    AtomicFence();
+    if (AtomicLoadU32(&Slots->WaiterCount))
+        Memory->PlatformWakeOnAddress(&Slots->FreeSlots.Top);
+}
+
+internal u32
+SprintConnectionMemory(char *Dest, connection_slots *Slots)
+{
+    // NOTE(vincent): How many connection records are in use, and the occupancy of every slab class.
+    u32 Length = 0;
+    Length += Sprint(Dest + Length, "Connection memory:\n  Connection records: ");
+    Length += SprintInt(Dest + Length, AtomicLoadU32(&Slots->InUseCount));
+    Length += Sprint(Dest + Length, " in use out of ");
+    Length += SprintInt(Dest + Length, Slots->Count);
+    Length += Sprint(Dest + Length, "\n");
+    Length += SprintSlabOccupancy(Dest + Length, &Slots->Slab);
+    return Length;
+}
+
+internal b32
+TakeSendBuffer(connection *Connection)
+{
+    // NOTE(vincent): Returns false if the slab allocator has no block left.
+    if (!Connection->SendBuffer)
+    {
+        u8 *Block = SlabAllocate(&Connection->Slots->Slab, Connection->Cache, SEND_BUFFER_CLASS);
+        if (!Block)
+            return false;
+        Connection->SendBuffer = (char *)Block;
+        Connection->SendBufferSize = SlabBlockSize(SEND_BUFFER_CLASS);
+        Connection->SendLength = 0;
+        Connection->SentCount = 0;
+    }
+    return true;
+}
+
+internal void
+GiveBackSendBuffer(connection *Connection)
+{
+    // NOTE(vincent): Only once SendBuffer is drained.
+    if (Connection->SendBuffer)
+    {
+        Assert(Connection->SendLength == 0);
+        SlabFree(&Connection->Slots->Slab, Connection->Cache, SEND_BUFFER_CLASS, (u8 *)Connection->SendBuffer);
+        Connection->SendBuffer = 0;
+        Connection->SendBufferSize = 0;
+    }
+}
+
+
+
+internal void
+BeginRequest(connection *Connection)
+{
+    // NOTE(vincent): Everything pushed for one request (paths, .htpasswd, ...) goes to the slot arena,
+    // in RequestMemory once RespondToRequest() opens it, and is thrown away by EndRequest(), while
+    // the print buffer pushed by OpenConnection() lives as long as the connection.
+    // ReceiveBuffer and SendBuffer are left alone, as they may hold pipelined requests and responses.
+    Connection->RequestIsOpen = true;
+    Connection->State = ConnectionState_Receiving;
+    Connection->KeepAlive = false;
+    Connection->RequestLength = 0;
+    Connection->ResponseLength = 0;
+    Connection->File = 0;
+    Connection->SendFileDirectly = false;
+    Connection->CachedFile = 0;
+    Connection->Body = 0;
+    Connection->BodyRemaining = 0;
+    Connection->FileOffset = 0;
+    Connection->FileRemaining = 0;
+    
+    string *ToPrint = &Connection->ToPrint;
+    ToPrint->Length = 0;
+    ToPrint->Length += Sprint(ToPrint->Base + ToPrint->Length, "\n\nServer: got connection from ");
+    ToPrint->Length += Sprint(ToPrint->Base + ToPrint->Length, Connection->AddressString);
+    ToPrint->Length += Sprint(ToPrint->Base + ToPrint->Length, " ");
+    if (Connection->RequestCount > 0)
+    {
+        ToPrint->Length += Sprint(ToPrint->Base + ToPrint->Length, "(request ");
+        ToPrint->Length += SprintInt(ToPrint->Base + ToPrint->Length, Connection->RequestCount + 1);
+        ToPrint->Length += Sprint(ToPrint->Base + ToPrint->Length, " on this connection) ");
+    }
+}
+
+internal void
+EndRequest(connection *Connection)
+{
+    if (!Connection->RequestIsOpen)
+        return;
+    Connection->RequestIsOpen = false;
+    
+    if (Connection->File)
+    {
+        fclose(Connection->File);
+        Connection->File = 0;
+    }
+    if (Connection->CachedFile)
+    {
+        ReleaseCachedFile(Connection->CachedFile);
+        Connection->CachedFile = 0;
+    }
+    
+    // NOTE(vincent): A keep-alive connection that closes while waiting for its next request
+    // has nothing worth printing.
+    if (Connection->RequestLength > 0 || Connection->ReceivedCount > Connection->RequestStart)
+    {
+        string *ToPrint = &Connection->ToPrint;
+#if 1
+        ToPrint->Length += Sprint(ToPrint->Base + ToPrint->Length, "Response size: ");
+        ToPrint->Length += SprintUnsigned(ToPrint->Base + ToPrint->Length, Connection->ResponseLength);
+        ToPrint->Length += Sprint(ToPrint->Base + ToPrint->Length, " Arena used: ");
+        ToPrint->Length += SprintInt(ToPrint->Base + ToPrint->Length, Connection->Arena.Used);
+        ToPrint->Length += Sprint(ToPrint->Base + ToPrint->Length, " Arena committed: ");
+        ToPrint->Length += SprintInt(ToPrint->Base + ToPrint->Length, Connection->Arena.Committed);
+        ToPrint->Length += Sprint(ToPrint->Base + ToPrint->Length, "\n");
 #endif
+        u32 RequestCount = AtomicAddU32(&Connection->Slots->RequestCount, 1) + 1;
+        if (RequestCount % SLAB_REPORT_INTERVAL == 0)
+        {
+            ToPrint->Length += SprintConnectionMemory(ToPrint->Base + ToPrint->Length, Connection->Slots);
+            ToPrint->Length += SprintMemoryRegions(ToPrint->Base + ToPrint->Length, Connection->Slots->Memory);
+        }
+        Assert(ToPrint->Length < Connection->PrintBufferSize);
+        Assert(ToPrint->Base[ToPrint->Length] == 0);
+        puts(ToPrint->Base);
+        Connection->RequestCount++;
+    }
+    
+    // NOTE(vincent): A request that pushed more than CONNECTION_ARENA_RETAIN decommits the rest here.
+    if (Connection->RequestMemory.Arena)
+    {
+        EndTemporaryMemory(Connection->RequestMemory);
+        Connection->RequestMemory.Arena = 0;
+    }
+}
+
+internal b32
+OpenConnection(connection *Connection, SOCKET ClientSocket, struct sockaddr *IncomingAddress)
+{
+    // NOTE(vincent): IncomingAddress is expected to point to a sockaddr_storage filled by accept().
+    // Deep copy it so that the platform layer can reuse its own storage for the next accept().
+    // Returns false, with the connection left closed, if the slab allocator has no block
+    // left for ReceiveBuffer: the caller turns the client away.
+    // Connection->Cache must be set already.
+    u8 *ReceiveBlock = SlabAllocate(&Connection->Slots->Slab, Connection->Cache, RECEIVE_BUFFER_CLASS);
+    if (!ReceiveBlock)
+        return false;
     
-    md5_result Hash = MD5((u8 *)PasswordPart.Base, PasswordPart.Length); // requires up to 72 bytes of padding
+    Connection->Socket = ClientSocket;
+    Connection->Address = *(struct sockaddr_storage *)IncomingAddress;
+    Connection->RequestCount = 0;
     
+    memory_arena *Arena = &Connection->Arena;
+    Connection->TempMemory = BeginTemporaryMemory(Arena);
     
-    PrintMD5NoNull(PasswordPart.Base, Hash); // overwrites 32 bytes
+    // NOTE(vincent): No SendBuffer until there is a request to answer, see RespondToRequest().
+    Connection->SendBuffer = 0;
+    Connection->SendBufferSize = 0;
+    Connection->SendLength = 0;
+    Connection->SentCount = 0;
+    Connection->RequestMemory.Arena = 0;
     
-    string DecodedString = StringBaseLength(Dest, Plain.Length - PasswordPart.Length + 32);
+    Connection->PrintBufferSize = PRINT_BUFFER_SIZE;
+    Connection->ToPrint = StringBaseLength(PushArray(Arena, Connection->PrintBufferSize, char), 0);
     
-#if 0
-    printf("DecodedString : ");
-    PrintString(DecodedString);
-    Assert(StringsAreEqual(DecodedString, "user:ee11cbb19052e40b07aac0ca060c23ee"));
-    printf("\n");
-#endif
+    Connection->ReceiveClass = RECEIVE_BUFFER_CLASS;
+    Connection->ReceiveBufferSize = SlabBlockSize(Connection->ReceiveClass);
+    Connection->ReceiveBuffer = (char *)ReceiveBlock;
+    Connection->ReceivedCount = 0;
+    Connection->RequestStart = 0;
+    BeginHTTPParser(&Connection->Parser, 0);
     
+    inet_ntop(IncomingAddress->sa_family, GetInternetAddress(IncomingAddress),
+              Connection->AddressString, INET6_ADDRSTRLEN);
     
-    return DecodedString;
+    BeginRequest(Connection);
+    return true;
 }
 
-
-enum access_result
-{
-    AccessResult_Unauthorized,
-    AccessResult_Forbidden,
-    AccessResult_Granted,
-};
-internal access_result
-LoadHtpasswd(memory_arena *Arena, string CompletePath, u32 RootLength, string AuthString)
+internal void
+RespondToRequest(server_state *State, connection *Connection)
 {
-    access_result Result = AccessResult_Granted;
-    
-    string Scratch = StringBaseLength(PushArray(Arena, CompletePath.Length + 10, char), 0);
-    AppendString(&Scratch, CompletePath);
-    push_read_entire_file ReadResult = {};
+    // NOTE(vincent): Turns the request at ReceiveBuffer + RequestStart into a response header appended 
+    // to SendBuffer, and possibly an opened file to stream after it.
+    string *ToPrint = &Connection->ToPrint;
+    http_parser *Parser = &Connection->Parser;
+    Assert(Parser->Start == Connection->RequestStart);
+    if (Parser->State == HttpParse_Complete || Parser->State == HttpParse_Error)
+        Connection->RequestLength = HTTPRequestLength(Parser);
+    else
+        Connection->RequestLength = Connection->ReceivedCount - Connection->RequestStart;
+    char *ReceiveBuffer = Connection->ReceiveBuffer + Connection->RequestStart;
+    u32 BytesReceived = Connection->RequestLength;
     
-    while (!ReadResult.Memory && TruncateStringUntil(&Scratch, '/') && Scratch.Length >= RootLength)
+    // NOTE(vincent): Without a block for SendBuffer, we can't build a response: the connection gets
+    // the 503 as its body, which is sent from where it is, without SendBuffer, and then it closes.
+    if (!TakeSendBuffer(Connection))
     {
-        AppendStringLiteralAndNull(&Scratch, ".htpasswd");
+        ToPrint->Length += Sprint(ToPrint->Base + ToPrint->Length, "No connection memory left for the response: 503\n");
+        ToPrint->Length += SprintConnectionMemory(ToPrint->Base + ToPrint->Length, Connection->Slots);
+        Connection->KeepAlive = false;
+        Connection->Body = State->Response503.Base;
+        Connection->BodyRemaining = State->Response503.Length;
+        Connection->ResponseLength = State->Response503.Length;
+        Connection->State = ConnectionState_Sending;
+        BeginHTTPParser(&Connection->Parser, Connection->RequestStart + Connection->RequestLength);
+        return;
+    }
+    memory_arena *Arena = &Connection->Arena;
+    Connection->RequestMemory = BeginTemporaryMemory(Arena);
+    Assert(Connection->SendBufferSize - Connection->SendLength >= RESPONSE_HEADER_MAX);
+    
+    parsed_config_file_result *Config = &State->Config;
+    char *Root = Config->Root;
+    
+    char *Header = 0;
+    size_t ContentLength = 0;
+    
 #if 1
-        printf(Scratch.Base);
-        printf("\n");
+    // NOTE(vincent): Printing the bytes received in plain ascii, and in readable hexadecimal.
+    // If you enable this, make sure PRINT_BUFFER_SIZE is big enough!
+    ToPrint->Length += Sprint(ToPrint->Base + ToPrint->Length, "BytesReceived: ");
+    ToPrint->Length += SprintInt(ToPrint->Base + ToPrint->Length, BytesReceived);
+    ToPrint->Length += Sprint(ToPrint->Base + ToPrint->Length, "\n");
+#if 0
+    ToPrint->Length += SprintBounded(ToPrint->Base + ToPrint->Length, ReceiveBuffer, BytesReceived);
+    ToPrint->Length += BinaryToHexadecimal(ToPrint->Base + ToPrint->Length, ReceiveBuffer,
+                                           BytesReceived);
+    ToPrint->Length += Sprint(ToPrint->Base + ToPrint->Length, "\n");
+#endif
 #endif
-        ReadResult = PushReadEntireFile(Arena, Scratch.Base);
-        TruncateStringUntil(&Scratch, '/');
-    }
     
-    if (ReadResult.Memory)
+    // NOTE(vincent): A request that ParseHTTPRequest() didn't see the end of (too big a header) 
+    // or that it gave up on gets a 400, like one without a Host field. So does one for a site we don't
+    // have, or whose path climbs with "..", before we go anywhere near the file system.
+    http_request Request = Parser->Request;
+    b32 RequestIsValid = (Parser->State == HttpParse_Complete && Request.IsValid);
+    virtual_hosts *Hosts = &State->VirtualHosts;
+    virtual_host *Site = 0;
+    string SitePath = {};  // the directory of the site, which CompletePath starts with
+    if (RequestIsValid)
     {
-#if 0
-        printf("PROTECTED\n");
+        string HostName = NormalizeHostName(Request.Host, PushArray(Arena, Request.Host.Length + 1, char));
+        if (HostName.Base && Hosts->PlatformOpenBeneath)
+        {
+            Site = FindVirtualHost(Hosts, HostName);
+            if (Site)
+                SitePath = Site->Path;
+        }
+        else if (HostName.Base)
+        {
+            // NOTE(vincent): No table: root, slash, host.
+            u32 RootLength = StringLength(Root);
+            SitePath = StringBaseLength(PushArray(Arena, RootLength + 1 + HostName.Length + 1, char),
+                                        RootLength + 1 + HostName.Length);
+            SprintNoNull(SitePath.Base, Root);
+            SprintNoNull(SitePath.Base + RootLength, "/");
+            Sprint(SitePath.Base + RootLength + 1, HostName);
+        }
+        RequestIsValid = (SitePath.Base && !PathClimbs(Request.RequestPath));
+    }
+    if (RequestIsValid)
+    {
+#if 1
+        ToPrint->Length += Sprint(ToPrint->Base + ToPrint->Length, "Isolated Request AuthString: ");
+        ToPrint->Length += Sprint(ToPrint->Base + ToPrint->Length, Request.AuthString);
+        ToPrint->Length += Sprint(ToPrint->Base + ToPrint->Length, "\n");
+        
+        ToPrint->Length += Sprint(ToPrint->Base + ToPrint->Length, "Isolated Host string: ");
+        ToPrint->Length += Sprint(ToPrint->Base + ToPrint->Length, Request.Host);
+        ToPrint->Length += Sprint(ToPrint->Base + ToPrint->Length, "\n");
 #endif
-        // NOTE(vincent): File is protected
-        // Unauthorized if no auth string given (rule: zero is initialization), forbidden otherwise.
         
-        Result = AuthString.Base == 0 ? AccessResult_Unauthorized : AccessResult_Forbidden;
-        if (ReadResult.Success && AuthString.Base)
+        // TODO(vincent): maybe use Request.HttpVersion?
+        
+        // NOTE(vincent): Concatenate the site directory and Request.Path into the arena. The file cache and
+        // the protection cache know files by that path. The file itself, and the stat() calls on what is
+        // in the site, go from the site's handle.
+        u32 RootLength = StringLength(Root);
+        u32 CompletePathLength = SitePath.Length + Request.RequestPath.Length;
+        string CompletePath = StringBaseLength(PushArray(Arena, CompletePathLength + 2, char),
+                                               CompletePathLength);
+        SprintNoNull(CompletePath.Base, SitePath);
+        Sprint(CompletePath.Base + SitePath.Length, Request.RequestPath);
+        site_directory SiteDirectory = {};
+        if (Site)
         {
-            string DecodedAuthString = DecodeAuthString(Arena, AuthString);
-#if 0
-            PrintString(DecodedAuthString);
-            printf(" DECODED\n");
-#endif
-            // NOTE(vincent): Compare htpasswd entries with the decoded auth string as you parse the file
-            // and see whether there is a match.
-            
-            b32 InEntry = false;
-            string LastEntry;
-            
-            LastEntry.Base = ReadResult.Memory;
-            LastEntry.Length = 0;
-            for (u32 Byte = 0; Byte < ReadResult.Size; Byte++)
+            SiteDirectory.OpenBeneath = Hosts->PlatformOpenBeneath;
+            SiteDirectory.StatBeneath = Hosts->PlatformStatBeneath;
+            SiteDirectory.Handle = Site->Directory;
+            SiteDirectory.PathLength = SitePath.Length;
+        }
+        // NOTE(vincent): Check for Htpasswd file and get access result
+        access_result AccessResult = 
+            CheckAccess(&State->Protection, Arena, CompletePath, RootLength, &SiteDirectory,
+                        Request.AuthString, State->DecodeBase64);
+        
+        
+        switch (AccessResult)
+        {
+            case AccessResult_Unauthorized:
             {
-                char *C = ReadResult.Memory + Byte;
-                if (!InEntry && !IsWhitespace(*C))
-                {
-                    InEntry = true;
-                    LastEntry.Base = C;
-                }
-                else if (InEntry && IsWhitespace(*C))
+                //ToPrint->Length += Sprint(ToPrint->Base + ToPrint->Length, "RESULT: UNAUTHORIZED\n");
+                Header = State->StringUN;
+            } break;
+            case AccessResult_Forbidden:
+            {
+                //ToPrint->Length += Sprint(ToPrint->Base + ToPrint->Length, "RESULT: FORBIDDEN\n");
+                Header = State->StringFB;
+            } break;
+            case AccessResult_Granted:
+            {
+                //ToPrint->Length += Sprint(ToPrint->Base + ToPrint->Length, "RESULT: GRANTED\n");
+                
+                // NOTE(vincent): Files we already have in the cache are sent from there. Otherwise 
+                // we open the file and try to cache it. Files the cache can't take are streamed:
+                // their content is only read when it is time to send it, one SendBuffer at a time
+                // (or not at all, see SendFileDirectly), so the file size is not bounded by the arena.
+                file_cache_entry *CachedFile = AcquireCachedFile(&State->FileCache, CompletePath, &SiteDirectory);
+                opened_file File = {};
+                if (!CachedFile)
                 {
-                    InEntry = false;
-                    LastEntry.Length = (u32)(C - LastEntry.Base);
-                    if (StringsAreEqual(LastEntry, DecodedAuthString))
+                    File = OpenSitePath(&SiteDirectory, CompletePath);
+                    if (File.Handle)
                     {
-#if 0
-                        printf("SUCCESSFUL\n");
-#endif
-                        // NOTE(vincent): Successful authentication
-                        Result = AccessResult_Granted;
-                        break;
+                        CachedFile = CacheFile(&State->FileCache, CompletePath, File.Handle, File.Size);
+                        if (CachedFile)
+                        {
+                            fclose(File.Handle);
+                            File.Handle = 0;
+                        }
                     }
                 }
-            }
-            printf("Forbidden by %s\n", Scratch.Base);
+                
+                if (CachedFile)
+                {
+                    // 200 OK
+                    Header = State->StringOK;
+                    Connection->CachedFile = CachedFile;
+                    Connection->Body = CachedFile->Content;
+                    Connection->BodyRemaining = CachedFile->Size;
+                    ContentLength = CachedFile->Size;
+                }
+                else if (File.Handle)
+                {
+                    // 200 OK
+                    Header = State->StringOK;
+                    Connection->File = File.Handle;
+                    Connection->FileRemaining = File.Size;
+                    Connection->SendFileDirectly = State->PlatformSendsFiles && File.Size >= SEND_FILE_MIN_SIZE;
+                    ContentLength = File.Size;
+                }
+                else
+                {
+                    // 404 Not Found
+                    Header = State->StringNF;
+                }
+            } break;
         }
-        else
+    } // END if (Request.IsValid)
+    else
+    {
+        // 400 Bad Request
+        Header = State->StringBR;
+    }
+    
+    // The first line of the request, or its beginning if that doesn't fit in the log.
+    string FirstLine = StringPrefixUntil(StringBaseLength(ReceiveBuffer, BytesReceived), '\r');
+    ToPrint->Length += SprintBounded(ToPrint->Base + ToPrint->Length, FirstLine.Base, 
+                                     Minimum(FirstLine.Length, (u32)REQUEST_LINE_PRINT_MAX));
+    ToPrint->Length += Sprint(ToPrint->Base + ToPrint->Length, "\n");
+    
+    // NOTE(vincent): We can only keep the connection open if the client knows where our response ends,
+    // hence the Content-Length on every response. After a bad request we don't trust the framing
+    // of what follows, so we close. Same after a request with a body, since we don't read bodies: that
+    // includes any Transfer-Encoding, even next to a Content-Length, which a proxy in front of us may
+    // have read differently (RFC 9112, 6.3).
+    Connection->KeepAlive = RequestIsValid && Request.KeepAlive && Request.ContentLength == 0 &&
+        !Request.HasTransferEncoding;
+    
+    char *SendBuffer = Connection->SendBuffer + Connection->SendLength;
+    u32 HeaderLength = SprintNoNull(SendBuffer, Header);
+    HeaderLength += SprintNoNull(SendBuffer + HeaderLength, "Content-Length: ");
+    HeaderLength += SprintUnsigned(SendBuffer + HeaderLength, ContentLength);
+    HeaderLength += SprintNoNull(SendBuffer + HeaderLength, "\r\n");
+    if (!Connection->KeepAlive)
+        HeaderLength += SprintNoNull(SendBuffer + HeaderLength, "Connection: close\r\n");
+    else if (Request.HttpVersion == HttpVersion_10)
+        HeaderLength += SprintNoNull(SendBuffer + HeaderLength, "Connection: keep-alive\r\n");
+    HeaderLength += SprintNoNull(SendBuffer + HeaderLength, "\r\n");
+    Assert(HeaderLength <= RESPONSE_HEADER_MAX);
+    
+    Connection->SendLength += HeaderLength;
+    
+    // NOTE(vincent): A small cached body is copied after its header, where the responses 
+    // to pipelined requests can join it. Bigger ones are sent straight from the cache.
+    u32 Room = Connection->SendBufferSize - Connection->SendLength;
+    if (Connection->BodyRemaining && Connection->BodyRemaining < SEND_FILE_MIN_SIZE && 
+        Connection->BodyRemaining <= Room)
+    {
+        memcpy(Connection->SendBuffer + Connection->SendLength, Connection->Body, Connection->BodyRemaining);
+        Connection->SendLength += (u32)Connection->BodyRemaining;
+        Connection->BodyRemaining = 0;
+    }
+    Connection->ResponseLength = HeaderLength + ContentLength;
+    Connection->State = ConnectionState_Sending;
+    
+    // The parser moves on to the next request, which pipelining clients may have sent already.
+    BeginHTTPParser(&Connection->Parser, Connection->RequestStart + Connection->RequestLength);
+}
+
+internal b32
+ParseReceivedBytes(server_state *State, connection *Connection)
+{
+    // NOTE(vincent): Feeds the parser the bytes it hasn't seen yet. Returns whether it is done
+    // with the request, in which case the request can be answered.
+    http_parse_state ParseState = 
+        ParseHTTPRequest(&Connection->Parser, Connection->ReceiveBuffer, Connection->ReceivedCount, 
+                         State->ScanLine);
+    return (ParseState == HttpParse_Complete || ParseState == HttpParse_Error);
+}
+
+internal void
+MoveReceiveBuffer(connection *Connection, char *NewBuffer, slab_class NewClass, u32 NewSize)
+{
+    // NOTE(vincent): The parser has to follow the bytes to their new block.
+    Assert(Connection->State == ConnectionState_Receiving);
+    Assert(Connection->ReceivedCount <= NewSize);
+    memcpy(NewBuffer, Connection->ReceiveBuffer, Connection->ReceivedCount);
+    RebaseHTTPParser(&Connection->Parser, Connection->ReceiveBuffer, NewBuffer);
+    SlabFree(&Connection->Slots->Slab, Connection->Cache, Connection->ReceiveClass, (u8 *)Connection->ReceiveBuffer);
+    Connection->ReceiveBuffer = NewBuffer;
+    Connection->ReceiveClass = NewClass;
+    Connection->ReceiveBufferSize = NewSize;
+}
+
+internal b32
+GrowReceiveBuffer(connection *Connection, u32 MaxSize)
+{
+    // NOTE(vincent): Moves ReceiveBuffer to a block of the next size class, up to MaxSize, for a 
+    // request header that doesn't fit. Returns false when it can't grow any further, or when 
+    // the slab allocator has no block left.
+    b32 Result = false;
+    if (Connection->ReceiveClass < RECEIVE_BUFFER_MAX_CLASS)
+    {
+        slab_class NewClass = (slab_class)(Connection->ReceiveClass + 1);
+        u32 NewSize = Minimum(SlabBlockSize(NewClass), MaxSize);
+        if (NewSize > Connection->ReceiveBufferSize)
         {
-            // TODO(vincent): protected but not properly loaded.
-            // Not sure whether we should do anything here.
+            u8 *NewBlock = SlabAllocate(&Connection->Slots->Slab, Connection->Cache, NewClass);
+            if (NewBlock)
+            {
+                MoveReceiveBuffer(Connection, (char *)NewBlock, NewClass, NewSize);
+                Result = true;
+            }
         }
     }
+    return Result;
+}
+
+internal void
+ShrinkReceiveBuffer(connection *Connection)
+{
+    // NOTE(vincent): Moves what is left in a big ReceiveBuffer back to a small block, if it fits.
+    // Not while a response is built from it: the parsed strings point into it.
+    u32 SmallSize = SlabBlockSize(RECEIVE_BUFFER_CLASS);
+    if (Connection->ReceiveClass != RECEIVE_BUFFER_CLASS && Connection->ReceivedCount <= SmallSize)
+    {
+        u8 *NewBlock = SlabAllocate(&Connection->Slots->Slab, Connection->Cache, RECEIVE_BUFFER_CLASS);
+        if (NewBlock)
+            MoveReceiveBuffer(Connection, (char *)NewBlock, RECEIVE_BUFFER_CLASS, SmallSize);
+    }
+}
+
+internal void
+StartNextRequest(server_state *State, connection *Connection)
+{
+    // NOTE(vincent): Called once the response to the current request is entirely in SendBuffer.
+    // Pipelining clients may have sent the next requests already, in which case we answer 
+    // right away. Otherwise the partial bytes we have are moved to the start of ReceiveBuffer
+    // and we go back to receiving.
+    EndRequest(Connection);
+    if (!Connection->KeepAlive)
+    {
+        Connection->State = ConnectionState_Closing;
+        return;
+    }
+    
+    Connection->RequestStart += Connection->RequestLength;
+    BeginRequest(Connection);
+    
+    Assert(Connection->Parser.Start == Connection->RequestStart);
+    if (ParseReceivedBytes(State, Connection))
+        RespondToRequest(State, Connection);
     else
     {
-#if 0
-        printf("NOT PROTECTED\n");
-#endif
+        u32 LeftoverCount = Connection->ReceivedCount - Connection->RequestStart;
+        memmove(Connection->ReceiveBuffer, Connection->ReceiveBuffer + Connection->RequestStart, LeftoverCount);
+        MoveHTTPParser(&Connection->Parser, Connection->RequestStart);
+        Connection->ReceivedCount = LeftoverCount;
+        Connection->RequestStart = 0;
+        
+        // NOTE(vincent): A connection waiting for its next request holds on to its slot
+        // and a small ReceiveBuffer only.
+        ShrinkReceiveBuffer(Connection);
+        if (Connection->SendLength == 0)
+            GiveBackSendBuffer(Connection);
+    }
+}
+
+internal b32
+PipelineNextRequest(server_state *State, connection *Connection)
+{
+    // NOTE(vincent): If the current response is complete in SendBuffer, and the next request is 
+    // already in ReceiveBuffer, append its response too, so that one send() carries both.
+    // The parser is already on the next request (see the end of RespondToRequest()), and it 
+    // remembers where it stopped, so asking again after every send doesn't rescan anything.
+    b32 Result = false;
+    if (Connection->State == ConnectionState_Sending && Connection->KeepAlive && 
+        Connection->FileRemaining == 0 && Connection->BodyRemaining == 0 &&
+        Connection->SendBufferSize - Connection->SendLength >= RESPONSE_HEADER_MAX &&
+        ParseReceivedBytes(State, Connection))
+    {
+        StartNextRequest(State, Connection);
+        Result = true;
+    }
+    return Result;
+}
+
+internal void
+ConnectionReceived(server_memory *Memory, connection *Connection, u32 BytesReceived)
+{
+    // NOTE(vincent): The platform layer calls this after it wrote BytesReceived more bytes
+    // at ReceiveBuffer + ReceivedCount.
+    server_state *State = (server_state *)Memory->Storage;
+    Assert(Connection->State == ConnectionState_Receiving);
+    Assert(Connection->ReceivedCount + BytesReceived <= Connection->ReceiveBufferSize);
+    
+    Assert(Connection->RequestStart == 0);
+    Connection->ReceivedCount += BytesReceived;
+    
+    // A full buffer that can't grow any more without the end of the header is answered with a 400.
+    if (ParseReceivedBytes(State, Connection) ||
+        (Connection->ReceivedCount == Connection->ReceiveBufferSize &&
+         !GrowReceiveBuffer(Connection, (u32)Kilobytes(State->Config.MaxHeaderSize))))
+    {
+        RespondToRequest(State, Connection);
+    }
+}
+
+internal u32
+NextFileChunkSize(server_memory *Memory, connection *Connection)
+{
+    // NOTE(vincent): How many bytes of the file should be read next, at Connection->FileOffset, 
+    // into SendBuffer + SendLength. Zero when SendBuffer is full, or when the file is done.
+    // A response that is complete in SendBuffer is followed by the responses to the pipelined
+    // requests we already received, as long as they fit.
+    server_state *State = (server_state *)Memory->Storage;
+    while (PipelineNextRequest(State, Connection));
+    
+    u32 Result = 0;
+    u32 Room = Connection->SendBufferSize - Connection->SendLength;
+    if (Connection->FileRemaining > 0 && !Connection->SendFileDirectly)
+        Result = (u32)Minimum((size_t)Room, Connection->FileRemaining);
+    return Result;
+}
+
+internal size_t
+NextFileBytesToSend(connection *Connection)
+{
+    // NOTE(vincent): How many bytes of the file the platform layer should send straight from File,
+    // at FileOffset, with PlatformSendFile() or the like. Only once SendBuffer is drained, 
+    // since the response header has to go first.
+    size_t Result = 0;
+    if (Connection->SendFileDirectly && Connection->SendLength == 0)
+        Result = Connection->FileRemaining;
+    return Result;
+}
+
+inline b32
+FileFollows(connection *Connection)
+{
+    // NOTE(vincent): Whether a body will be sent right after what SendBuffer holds, from the file
+    // or from the cache, in which case the platform layer can tell the kernel to wait for it (MSG_MORE)
+    // instead of pushing the header out in a packet of its own.
+    return (Connection->SendFileDirectly && Connection->FileRemaining > 0) || Connection->BodyRemaining > 0;
+}
+
+inline void
+ConnectionFileSent(connection *Connection, size_t BytesSent)
+{
+    if (BytesSent > 0)
+    {
+        Assert(BytesSent <= Connection->FileRemaining);
+        Connection->FileOffset += BytesSent;
+        Connection->FileRemaining -= BytesSent;
+    }
+    else
+    {
+        // NOTE(vincent): The file got shorter since we measured it. Like a short read, 
+        // this cuts the response and the connection can't be kept alive.
+        Connection->FileRemaining = 0;
+        Connection->KeepAlive = false;
+    }
+}
+
+internal void
+ConnectionFileRead(connection *Connection, u32 ChunkSize, u32 BytesRead)
+{
+    // NOTE(vincent): The platform layer may read the chunk itself (e.g. through io_uring) 
+    // and report here. Otherwise NextBytesToSend() does it with fread().
+    if (BytesRead == ChunkSize)
+    {
+        Connection->SendLength += ChunkSize;
+        Connection->FileOffset += ChunkSize;
+        Connection->FileRemaining -= ChunkSize;
+    }
+    else
+    {
+        // NOTE(vincent): The header is already out, so all we can do is cut the response short.
+        // The client can't tell where it ends anymore, so this connection can't be kept alive.
+        Connection->FileRemaining = 0;
+        Connection->KeepAlive = false;
+    }
+}
+
+internal string
+NextBytesToSend(server_memory *Memory, connection *Connection)
+{
+    // NOTE(vincent): Returns what is left to send from SendBuffer, after filling it with as much
+    // of the file, and of the responses to pipelined requests, as fits. Once SendBuffer is drained,
+    // returns what is left of a cached body, straight from the cache memory. An empty string means 
+    // either that the platform layer has to send the file itself (see NextFileBytesToSend()),
+    // or that the response is complete: the connection then answers the next request 
+    // if we already have it, waits for it, or is marked as closing.
+    Assert(Connection->State == ConnectionState_Sending);
+    server_state *State = (server_state *)Memory->Storage;
+    for (;;)
+    {
+        u32 ChunkSize = NextFileChunkSize(Memory, Connection);
+        if (!ChunkSize)
+            break;
+        size_t BytesRead = fread(Connection->SendBuffer + Connection->SendLength, 1, ChunkSize,
+                                 Connection->File);
+        ConnectionFileRead(Connection, ChunkSize, (u32)BytesRead);
     }
     
+    string Result = StringBaseLength(Connection->SendBuffer + Connection->SentCount,
+                                     Connection->SendLength - Connection->SentCount);
+    if (Result.Length == 0 && Connection->BodyRemaining)
+        Result = StringBaseLength(Connection->Body, (u32)Minimum(Connection->BodyRemaining, (size_t)MAX_SEND_LENGTH));
+    if (Result.Length == 0 && Connection->FileRemaining == 0)
+        StartNextRequest(State, Connection);
     return Result;
 }
 
+inline void
+ConnectionSent(connection *Connection, u32 BytesSent)
+{
+    // NOTE(vincent): NextBytesToSend() only hands out the cached body once SendBuffer is empty.
+    if (Connection->SendLength == 0)
+    {
+        Assert(BytesSent <= Connection->BodyRemaining);
+        Connection->Body += BytesSent;
+        Connection->BodyRemaining -= BytesSent;
+        return;
+    }
+    
+    Assert(Connection->SentCount + BytesSent <= Connection->SendLength);
+    Connection->SentCount += BytesSent;
+    if (Connection->SentCount == Connection->SendLength)
+    {
+        // NOTE(vincent): Everything went out, the next chunk of the file can use the whole buffer.
+        Connection->SentCount = 0;
+        Connection->SendLength = 0;
+    }
+}
+
+internal void
+CloseConnection(connection *Connection)
+{
+    // NOTE(vincent): Does nothing if the last response completed, as it already went through 
+    // EndRequest(). Otherwise the connection broke or timed out in the middle of a request.
+    EndRequest(Connection);
+    
+    ShutdownConnection(Connection->Socket);
+    Connection->Socket = INVALID_SOCKET;
+    Connection->State = ConnectionState_Closing;
+    
+    slab_allocator *Slab = &Connection->Slots->Slab;
+    SlabFree(Slab, Connection->Cache, Connection->ReceiveClass, (u8 *)Connection->ReceiveBuffer);
+    Connection->ReceiveBuffer = 0;
+    Connection->ReceiveBufferSize = 0;
+    if (Connection->SendBuffer)
+    {
+        SlabFree(Slab, Connection->Cache, SEND_BUFFER_CLASS, (u8 *)Connection->SendBuffer);
+        Connection->SendBuffer = 0;
+        Connection->SendBufferSize = 0;
+    }
+    EndTemporaryMemory(Connection->TempMemory);
+}
+
+
+// NOTE(vincent): Connection pools are for platform layers that multiplex many connections 
+// per thread. Each event loop takes up to MaxCount slots, its share of Config->MaxConnections,
+// and keeps the connections it has open in a list, for its idle sweeps.
+internal connection_pool
+BeginConnectionPool(server_memory *Memory, u32 LoopCount)
+{
+    server_state *State = (server_state *)Memory->Storage;
+    connection_pool Pool = {};
+    Pool.Memory = Memory;
+    Pool.Slots = &State->Slots;
+    Pool.MaxCount = (State->Slots.Count + LoopCount - 1) / LoopCount;
+    return Pool;
+}
+
+inline b32
+ConnectionPoolHasRoom(connection_pool *Pool)
+{
+    b32 Result = (Pool->Count < Pool->MaxCount && 
+                  !IndexStackIsEmpty(AtomicLoadU32(&Pool->Slots->FreeSlots.Top)));
+    return Result;
+}
+
+inline connection *
+AcquireConnection(connection_pool *Pool)
+{
+    connection *Result = 0;
+    if (Pool->Count < Pool->MaxCount)
+        Result = AcquireConnectionSlot(Pool->Slots);
+    if (Result)
+    {
+        Result->Previous = 0;
+        Result->Next = Pool->First;
+        if (Pool->First)
+            Pool->First->Previous = Result;
+        Pool->First = Result;
+        Pool->Count++;
+        Result->Cache = &Pool->Cache;
+    }
+    return Result;
+}
+
+inline void
+ReleaseConnection(connection_pool *Pool, connection *Connection)
+{
+    if (Connection->Previous)
+        Connection->Previous->Next = Connection->Next;
+    else
+        Pool->First = Connection->Next;
+    if (Connection->Next)
+        Connection->Next->Previous = Connection->Previous;
+    Connection->Next = Connection->Previous = 0;
+    Pool->Count--;
+    ReleaseConnectionSlot(Pool->Memory, Connection);
+}
+
+
+#ifdef MSG_DONTWAIT
+#define RECEIVE_FLAG_DONTWAIT MSG_DONTWAIT
+#define ReceiveWouldBlock() (errno == EAGAIN || errno == EWOULDBLOCK)
+#else
+#define RECEIVE_FLAG_DONTWAIT 0  // NOTE(vincent): Windows has no such flag, see RejectConnection()
+#define ReceiveWouldBlock() false
+#endif
 
 struct receive_and_send_work
 {
-    struct sockaddr IncomingAddress;
-    SOCKET ClientSocket;
-    server_state *State;
-    task_with_memory *Task;
+    server_memory *Memory;
+    connection *Connection;
 };
 
 
@@ -248,202 +1145,217 @@ struct receive_and_send_work
 internal 
 PLATFORM_WORK_QUEUE_CALLBACK(ReceiveAndSend)
 {
+    // NOTE(vincent): Blocking version of the connection loop. An entry runs one step of its connection,
+    // a recv() or a send(), then adds itself back to the queue for the next one: a worker's entries go to
+    // its own deque in stealing mode, where idle workers steal them, so a long response doesn't stay
+    // with the worker that started it. We only take the next step here when the queue is full.
+    // When there is nothing to read, the connection goes to PlatformWatchConnection() instead of the queue,
+    // and comes back through ResumeWatchedConnection() once the client sends something: an idle keep-alive
+    // connection holds no worker. Without that function, recv() blocks until the client sends its next
+    // request, closes, or stays quiet for longer than the idle timeout, a receive timeout on the socket.
     receive_and_send_work *Work = (receive_and_send_work *)Data;
-    SOCKET ClientSocket = Work->ClientSocket;
-    struct sockaddr *IncomingAddress = &Work->IncomingAddress;
-    
-    memory_arena *Arena = &Work->Task->Arena;
-    
-    char *StringOK = Work->State->StringOK;
-    char *StringBR = Work->State->StringBR;
-    char *StringNF = Work->State->StringNF;
-    char *StringUN = Work->State->StringUN;
-    char *StringFB = Work->State->StringFB;
-    parsed_config_file_result *Config = &Work->State->Config;
-    char *Root = Config->Root;
-    
-    char *AddressString = PushArray(Arena, INET6_ADDRSTRLEN, char);
-    inet_ntop(IncomingAddress->sa_family, GetInternetAddress(IncomingAddress),
-              AddressString, INET6_ADDRSTRLEN);
+    server_memory *Memory = Work->Memory;
+    connection *Connection = Work->Connection;
+    SOCKET ClientSocket = Connection->Socket;
     
-    u32 PrintBufferSize = 8192;//1024;
-    char *PrintBuffer = PushArray(Arena, PrintBufferSize, char);
-    string ToPrint;
-    ToPrint.Base = PrintBuffer;
-    ToPrint.Length = 0;
+    // NOTE(vincent): The magazines live on this thread's stack and take blocks from its NUMA node.
+    // They go back to the depots before the entry does to the queue, since any worker may take it.
+    slab_cache Cache = {};
+    if (Memory->PlatformGetThreadNode)
+        Cache.Node = Memory->PlatformGetThreadNode(Queue);
+    Connection->Cache = &Cache;
     
-    ToPrint.Length += Sprint(PrintBuffer + ToPrint.Length, "\n\nServer: got connection from ");
-    ToPrint.Length += Sprint(PrintBuffer + ToPrint.Length, AddressString);
-    ToPrint.Length += Sprint(PrintBuffer + ToPrint.Length, " ");
-    u32 ReceiveBufferSize = 8192;  // 8*1024 bytes
-    
-    u32 LengthToSend = 0;
-    char *SendBuffer = 0;
-    
-    char *ReceiveBuffer = PushArray(Arena, ReceiveBufferSize, char);
-    int BytesReceived = recv(ClientSocket, ReceiveBuffer, ReceiveBufferSize, 0);
+    // NOTE(vincent): Our entry left the queue, which may have made room for the accepting thread,
+    // if it sleeps in AddConnectionEntry(). The fence orders the queue's release of our entry before
+    // the look at the waiter count: either the sleeper's last try sees the room, or we see the sleeper.
+    connection_slots *Slots = Connection->Slots;
+    AtomicFence();
+    if (AtomicLoadU32(&Slots->QueueWaiterCount))
+    {
+        AtomicAddU32(&Slots->QueueTakeCount, 1);
+        Memory->PlatformWakeOnAddress(&Slots->QueueTakeCount);
+    }
     
-    if (HandleReceiveError(BytesReceived, ClientSocket))
+    while (Connection->State != ConnectionState_Closing)
     {
-#if 1
-        // NOTE(vincent): Printing the bytes received in plain ascii, and in readable hexadecimal.
-        // If you enable this, make sure PrintBufferSize is big enough!
-        ToPrint.Length += Sprint(PrintBuffer + ToPrint.Length, "BytesReceived: ");
-        ToPrint.Length += SprintInt(PrintBuffer + ToPrint.Length, BytesReceived);
-        ToPrint.Length += Sprint(PrintBuffer + ToPrint.Length, "\n");
-#if 0
-        ToPrint.Length += SprintBounded(PrintBuffer + ToPrint.Length, ReceiveBuffer, BytesReceived);
-        ToPrint.Length += BinaryToHexadecimal(PrintBuffer + ToPrint.Length, ReceiveBuffer,
-                                              BytesReceived);
-        ToPrint.Length += Sprint(PrintBuffer + ToPrint.Length, "\n");
-#endif
-#endif
-        
-        http_request Request = ParseHTTPRequest(ReceiveBuffer, BytesReceived);
-        if (Request.IsValid)
+        if (Connection->State == ConnectionState_Receiving)
         {
-#if 1
-            ToPrint.Length += Sprint(PrintBuffer + ToPrint.Length, "Isolated Request AuthString: ");
-            ToPrint.Length += Sprint(PrintBuffer + ToPrint.Length, Request.AuthString);
-            ToPrint.Length += Sprint(PrintBuffer + ToPrint.Length, "\n");
-            
-            ToPrint.Length += Sprint(PrintBuffer + ToPrint.Length, "Isolated Host string: ");
-            ToPrint.Length += Sprint(PrintBuffer + ToPrint.Length, Request.Host);
-            ToPrint.Length += Sprint(PrintBuffer + ToPrint.Length, "\n");
-#endif
-            
-            // TODO(vincent): maybe use Request.HttpVersion?
-            
-            // NOTE(vincent): Concatenate Root, Request.Host and Request.Path into the arena
-#if 1
-            // order of concatenation: root, slash, host, path
-            u32 RootLength = StringLength(Root);
-            u32 RequestLength = Request.RequestPath.Length;
-            u32 HostLength = Request.Host.Length;
-            u32 CompletePathLength = RootLength + 1 + HostLength + RequestLength;
-            string CompletePath = StringBaseLength(PushArray(Arena, CompletePathLength + 2, char),
-                                                   CompletePathLength);
-            SprintNoNull(CompletePath.Base, Root);
-            SprintNoNull(CompletePath.Base + RootLength, "/");
-            SprintNoNull(CompletePath.Base + RootLength + 1, Request.Host);
-            Sprint(CompletePath.Base + RootLength + 1 + HostLength, Request.RequestPath);
-#else
-            // order of concatenation: root, path
-            u32 RootLength = StringLength(Root);
-            u32 RequestLength = Request.RequestPath.Length;
-            u32 CompletePathLength = RootLength + RequestLength;
-            string CompletePath = StringBaseLength(PushArray(Arena, CompletePathLength + 1, char),
-                                                   CompletePathLength);
-            SprintNoNull(CompletePath.Base, Root);
-            Sprint(CompletePath.Base + RootLength, Request.RequestPath);
-#endif
-            // NOTE(vincent): Check for Htpasswd file and get access result
-            access_result AccessResult = 
-                LoadHtpasswd(Arena, CompletePath, RootLength, Request.AuthString);
-            
-            
-            switch (AccessResult)
+            u32 Room = Connection->ReceiveBufferSize - Connection->ReceivedCount;
+            int Flags = Memory->PlatformWatchConnection ? RECEIVE_FLAG_DONTWAIT : 0;
+            int BytesReceived = recv(ClientSocket, Connection->ReceiveBuffer + Connection->ReceivedCount,
+                                     Room, Flags);
+            if (BytesReceived < 0 && Flags && ReceiveWouldBlock())
             {
-                case AccessResult_Unauthorized:
-                {
-                    //ToPrint.Length += Sprint(PrintBuffer + ToPrint.Length, "RESULT: UNAUTHORIZED\n");
-                    LengthToSend = sizeof(STRING_UN) - 1;
-                    SendBuffer = PushArray(Arena, LengthToSend, char);
-                    SprintNoNull(SendBuffer, StringUN);
-                } break;
-                case AccessResult_Forbidden:
-                {
-                    //ToPrint.Length += Sprint(PrintBuffer + ToPrint.Length, "RESULT: FORBIDDEN\n");
-                    LengthToSend = sizeof(STRING_FB) - 1;
-                    SendBuffer = PushArray(Arena, LengthToSend, char);
-                    SprintNoNull(SendBuffer, StringFB);
-                } break;
-                case AccessResult_Granted:
-                {
-                    //ToPrint.Length += Sprint(PrintBuffer + ToPrint.Length, "RESULT: GRANTED\n");
-                    SendBuffer = PushArray(Arena, sizeof(STRING_OK)-1, char);
-                    SprintNoNull(SendBuffer, StringOK);
-                    
-                    // NOTE(vincent): Try to load the file
-                    push_read_entire_file ReadFileResult =
-                        PushReadEntireFile(Arena, CompletePath.Base);
-                    
-                    if (ReadFileResult.Success)
-                    {
-                        // 200 OK
-                        LengthToSend = (sizeof(STRING_OK) - 1) + (u32)ReadFileResult.Size;
-                    }
-                    else
-                    {
-                        // 404 Not Found
-                        LengthToSend = sizeof(STRING_NF) - 1;
-                        SprintNoNull(SendBuffer, StringNF);
-                    }
-                } break;
+                Connection->Cache = 0;
+                FlushSlabCache(&Connection->Slots->Slab, &Cache);
+                if (Memory->PlatformWatchConnection(Queue, Connection, Work))
+                    return;  // the connection isn't ours anymore
+                Connection->Cache = &Cache;
+                Connection->State = ConnectionState_Closing;
             }
-        } // END if (Request.IsValid)
+            else if (!HandleReceiveError(BytesReceived, ClientSocket) || BytesReceived == 0)
+                Connection->State = ConnectionState_Closing;
+            else
+                ConnectionReceived(Memory, Connection, BytesReceived);
+        }
         else
         {
-            // 400 Bad Request
-            LengthToSend = sizeof(STRING_BR) - 1;
-            SendBuffer = PushArray(Arena, LengthToSend, char);
-            SprintNoNull(SendBuffer, StringBR);
+            size_t FileBytes = NextFileBytesToSend(Connection);
+            if (FileBytes)
+            {
+                s64 BytesSent = Memory->PlatformSendFile(ClientSocket, Connection->File,
+                                                         Connection->FileOffset, FileBytes);
+                if (!HandleSendError((int)BytesSent, ClientSocket))
+                    Connection->State = ConnectionState_Closing;
+                else
+                    ConnectionFileSent(Connection, (size_t)BytesSent);
+            }
+            else
+            {
+                string ToSend = NextBytesToSend(Memory, Connection);
+                if (ToSend.Length)
+                {
+                    int Flags = FileFollows(Connection) ? SEND_FLAG_MORE : 0;
+                    int BytesSent = send(ClientSocket, ToSend.Base, ToSend.Length, Flags);
+                    if (!HandleSendError(BytesSent, ClientSocket))
+                        Connection->State = ConnectionState_Closing;
+                    else
+                        ConnectionSent(Connection, BytesSent);
+                }
+            }
         }
         
-        ToPrint.Length +=
-            SprintUntilDelimiter(PrintBuffer + ToPrint.Length, ReceiveBuffer, '\r');
-        ToPrint.Length += Sprint(PrintBuffer + ToPrint.Length, "\n");
-    } // END if (HandleReceiveError(BytesReceived))
-    
+        if (Connection->State != ConnectionState_Closing)
+        {
+            Connection->Cache = 0;
+            FlushSlabCache(&Connection->Slots->Slab, &Cache);
+            if (Memory->PlatformAddEntry(Queue, ReceiveAndSend, Work))
+                return;  // the connection isn't ours anymore
+            Connection->Cache = &Cache;
+        }
+    }
     
-    int BytesSent = send(ClientSocket, SendBuffer, LengthToSend, 0);
-    if (HandleSendError(BytesSent, ClientSocket))
+    // NOTE(vincent): Work lived in the slot arena, which CloseConnection() pops.
+    CloseConnection(Connection);
+    Connection->Cache = 0;
+    FlushSlabCache(&Connection->Slots->Slab, &Cache);
+    ReleaseConnectionSlot(Memory, Connection);
+}
+
+internal void
+SendResponse503(server_state *State, SOCKET ClientSocket)
+{
+    // NOTE(vincent): We answer with a 503 without reading the request nor touching the disk. Closing
+    // a socket with unread bytes makes the kernel send a reset, which may get to the client before
+    // our response does, so we first read what already arrived, if we can do so without blocking.
+    send(ClientSocket, State->Response503.Base, State->Response503.Length, 0);
+    if (RECEIVE_FLAG_DONTWAIT)
     {
-#if 1
-        ToPrint.Length += Sprint(PrintBuffer + ToPrint.Length, "BytesSent: ");
-        ToPrint.Length += SprintInt(PrintBuffer + ToPrint.Length, BytesSent);
-        u32 AddressOffset = (u32)((u8 *)SendBuffer - Arena->Base);
-        ToPrint.Length += Sprint(PrintBuffer + ToPrint.Length," AddressOffset: ");
-        ToPrint.Length += SprintInt(PrintBuffer + ToPrint.Length, AddressOffset);
-        ToPrint.Length += Sprint(PrintBuffer + ToPrint.Length," Arena size: ");
-        ToPrint.Length += SprintInt(PrintBuffer + ToPrint.Length, Arena->Size);
-        ToPrint.Length += Sprint(PrintBuffer + ToPrint.Length,"\n");
-#endif
+        char Discard[4096];
+        for (u32 Attempt = 0; Attempt < 4; Attempt++)
+        {
+            if (recv(ClientSocket, Discard, sizeof(Discard), RECEIVE_FLAG_DONTWAIT) <= 0)
+                break;
+        }
     }
-    
-    Assert(ToPrint.Length < PrintBufferSize);
-    Assert(ToPrint.Base[ToPrint.Length] == 0);
-    puts(ToPrint.Base);
-    
+}
+
+internal void
+RejectConnection(server_state *State, SOCKET ClientSocket)
+{
+    // NOTE(vincent): Every connection slot is taken, or there is no memory for the connection.
+    SendResponse503(State, ClientSocket);
     ShutdownConnection(ClientSocket);
+}
+
+internal b32
+AddConnectionEntry(server_memory *Memory, platform_work_queue *Queue, receive_and_send_work *Work)
+{
+    // NOTE(vincent): For the accepting thread, which never serves a connection itself: it would stop
+    // accepting for as long as the connection lasts, up to the idle timeout. A full queue is overload
+    // like a lack of slots, and gets the same policy, after a short spin since the ring may only be full
+    // while the workers are between two entries. Returns false for the 503 policy. The queue policy
+    // sleeps until ReceiveAndSend() takes an entry, as WaitForConnectionSlot() does until a slot frees up,
+    // and new connections wait in the listening socket's backlog meanwhile.
+    server_state *State = (server_state *)Memory->Storage;
+    connection_slots *Slots = &State->Slots;
+    for (u32 Spin = 0; Spin < QUEUE_FULL_SPIN_COUNT; Spin++)
+    {
+        if (Memory->PlatformAddEntry(Queue, ReceiveAndSend, Work))
+            return true;
+        SpinPause();
+    }
+    if (State->Config.Overload == OverloadPolicy_Reject)
+        return false;
     
-    EndTaskWithMemory(Work->Task);
+    b32 Added = false;
+    while (!Added)
+    {
+        AtomicAddU32(&Slots->QueueWaiterCount, 1);
+        AtomicFence();
+        u32 TakeCount = AtomicLoadU32(&Slots->QueueTakeCount);
+        Added = Memory->PlatformAddEntry(Queue, ReceiveAndSend, Work);
+        if (!Added)
+            Memory->PlatformWaitOnAddress(&Slots->QueueTakeCount, TakeCount);
+        AtomicAddU32(&Slots->QueueWaiterCount, (u32)-1);
+    }
+    return true;
 }
 
 internal void
 PrepareHandshaking(server_memory *Memory, struct sockaddr *IncomingAddress, SOCKET ClientSocket, platform_work_queue *Queue)
 {
     server_state *State = (server_state *)Memory->Storage;
-    task_with_memory *Task = 0;
-    
-    while (!Task)
-        Task = BeginTaskWithMemory(State);
-    
-    Assert(Task);  // TODO(vincent): why is this firing when we don't spinlock?
-    Assert(Task->Arena.TempCount == 1);
-    Assert(Task->Arena.Used == 0);
+    connection *Connection = AcquireConnectionSlot(&State->Slots);
+    if (!Connection)
+    {
+        if (State->Config.Overload == OverloadPolicy_Reject)
+        {
+            RejectConnection(State, ClientSocket);
+            return;
+        }
+        // NOTE(vincent): We stop accepting until a slot frees up. Meanwhile, new connections wait 
+        // in the listening socket's backlog.
+        Connection = WaitForConnectionSlot(Memory);
+    }
     
-    receive_and_send_work *Work = PushStruct(&Task->Arena, receive_and_send_work);
-    Work->IncomingAddress = *IncomingAddress; // deep copy so that other threads don't mutate what we use
+    Assert(Connection->Arena.TempCount == 0);
+    Connection->Cache = 0;  // the main thread takes ReceiveBuffer straight from the depot
+    if (!OpenConnection(Connection, ClientSocket, IncomingAddress))
+    {
+        RejectConnection(State, ClientSocket);
+        ReleaseConnectionSlot(Memory, Connection);
+        return;
+    }
     
-    Work->ClientSocket = ClientSocket;
-    Work->Task = Task;
-    Work->State = State;
-    Memory->PlatformAddEntry(Queue, ReceiveAndSend, Work);
+    receive_and_send_work *Work = PushStruct(&Connection->Arena, receive_and_send_work);
+    Work->Memory = Memory;
+    Work->Connection = Connection;
     
-    // NOTE(vincent): Not necessarily a good idea to have the main thread do work 
-    // instead of producing work entries, but this is a way you could do it:
-    if (Task->Index == ArrayCount(State->Tasks)-1)
-        Memory->PlatformDoNextWorkEntry(Queue);
+    if (!AddConnectionEntry(Memory, Queue, Work))
+    {
+        SendResponse503(State, ClientSocket);
+        CloseConnection(Connection);
+        ReleaseConnectionSlot(Memory, Connection);
+        return;
+    }
     
+    // NOTE(vincent): The main thread doesn't pick up queue work itself, even when it just took the last
+    // slot: it would stop accepting for as long as that connection lasts, and with it the overload policy.
+}
+
+internal void
+ResumeWatchedConnection(server_memory *Memory, platform_work_queue *Queue, void *Data)
+{
+    // NOTE(vincent): For the platform layer, once the socket of a connection that ReceiveAndSend() handed
+    // to PlatformWatchConnection() is readable. The next request of a keep-alive connection goes through
+    // the same overload policy as a new connection when the queue is full.
+    receive_and_send_work *Work = (receive_and_send_work *)Data;
+    connection *Connection = Work->Connection;
+    if (!AddConnectionEntry(Memory, Queue, Work))
+    {
+        SendResponse503((server_state *)Memory->Storage, Connection->Socket);
+        CloseConnection(Connection);
+        ReleaseConnectionSlot(Memory, Connection);
+    }
 }
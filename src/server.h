@@ -1,12 +1,123 @@
 
-struct task_with_memory
+struct connection_slots;
+
+enum connection_state
 {
-    b32 BeingUsed;
-    memory_arena Arena;
+    ConnectionState_Receiving,  // waiting for the end of the request header
+    ConnectionState_Sending,    // flushing the response
+    ConnectionState_Closing,    // last response flushed or connection broken, ready for CloseConnection()
+};
+
+// NOTE(vincent): A connection is driven by the platform layer, which moves bytes in and out of it
+// with whatever socket API it likes (blocking recv/send, epoll, ...), while server.cpp decides
+// what those bytes mean. A connection lives in a slot of connection_slots, with a growable arena of
+// its own for the print buffer and what one request pushes. Its buffers are blocks of the slab 
+// allocator: an idle keep-alive connection holds on to a 4 KB ReceiveBuffer, which grows a size class
+// at a time for big request headers. SendBuffer is a block it takes while it responds, and gives 
+// back once the response is out.
+struct connection
+{
+    SOCKET Socket;
+    struct sockaddr_storage Address;
+    char AddressString[INET6_ADDRSTRLEN];
+    connection_state State;
+    b32 KeepAlive;          // whether to wait for another request once the response is sent
+    u32 RequestCount;
+    
+    // NOTE(vincent): Platform layer state, server.cpp doesn't touch it.
+    u64 LastActivity;       // platform clock, in milliseconds, for the idle timeout
+    int FilePipe[2];        // io_uring layer: file bodies are spliced to the socket through this pipe
+    u32 FilePipeSize;
+    u32 FilePipeCount;      // bytes in the pipe, not out to the socket yet
+    u32 volatile Watched;   // work queue modes: the platform layer waits for the socket to be readable...
+    void *WatchData;        // ...to hand this to ResumeWatchedConnection()
+    
+    connection_slots *Slots;
+    u32 SlotIndex;
+    memory_arena Arena;     // the slot arena, growable
     temporary_memory TempMemory;
-    u32 Index;
+    temporary_memory RequestMemory;  // open while RequestMemory.Arena is set
+    b32 RequestIsOpen;
+    slab_cache *Cache;      // the magazines of the thread that drives the connection, or 0
+    
+    char *ReceiveBuffer;    // a block of ReceiveClass
+    slab_class ReceiveClass;
+    u32 ReceiveBufferSize;
+    u32 ReceivedCount;
+    u32 RequestStart;       // where the current request starts in ReceiveBuffer, after the pipelined ones
+    u32 RequestLength;      // its header length, CRLFCRLF included, or 0 while it is incomplete
+    http_parser Parser;     // where we are in the request at RequestStart, or the next one once it is answered
+    
+    char *SendBuffer;       // response headers and chunks of files, possibly of several pipelined requests, or 0
+    u32 SendBufferSize;
+    u32 SendLength;
+    u32 SentCount;
+    size_t ResponseLength;  // header and body of the current response, for the log
+    FILE *File;             // response body, streamed SendBufferSize bytes at a time...
+    b32 SendFileDirectly;   // ...or sent straight from the file by the platform layer
+    file_cache_entry *CachedFile;  // or the response body comes from the file cache
+    char *Body;             // what is left of it to send
+    size_t BodyRemaining;
+    size_t FileOffset;      // how much of the file went through SendBuffer so far
+    size_t FileRemaining;
+    
+    string ToPrint;
+    u32 PrintBufferSize;
+    
+    connection *Next;       // in the connection_pool of an event loop
+    connection *Previous;
+};
+
+// NOTE(vincent): The connection slots and the slabs of their buffers, shared by every thread.
+// The platform layer allocates them once the config is parsed (see ConnectionSlotsMemorySize()),
+// and the OS only commits the pages we touch: slots and slabs that were never used cost nothing.
+// The slabs are one block (Slab.Base), for platform layers that want to register it with the OS
+// (e.g. io_uring fixed buffers).
+struct connection_slots
+{
+    connection *Connections;
+    u32 Count;
+    index_stack FreeSlots;
+    u32 volatile InUseCount;
+    u32 volatile WaiterCount;  // how many threads sleep in WaitForConnectionSlot()
+    u32 volatile QueueWaiterCount;  // how many threads sleep in AddConnectionEntry(), on a full work queue
+    u32 volatile QueueTakeCount;    // the futex they sleep on, which ReceiveAndSend() moves to wake them
+    u32 volatile RequestCount; // for the occupancy report, every SLAB_REPORT_INTERVAL requests
+    slab_allocator Slab;
+    server_memory *Memory;
+};
+
+// NOTE(vincent): The connections of one event loop, which takes slots from connection_slots
+// as they come in, up to its share of them.
+struct connection_pool
+{
+    server_memory *Memory;
+    connection_slots *Slots;
+    connection *First;
+    u32 Count;
+    u32 MaxCount;
+    slab_cache Cache;       // the connections of an event loop share its thread's magazines
+};
+
+// NOTE(vincent): The big blocks the platform layer gets from the OS, and the page size it got them with,
+// for the huge page counters (see SprintMemoryRegions()).
+enum huge_page_backing
+{
+    HugePageBacking_None,
+    HugePageBacking_Transparent,  // the OS backs what it can with huge pages, as they get touched (Linux: MADV_HUGEPAGE)
+    HugePageBacking_Explicit,     // huge pages set aside by the OS beforehand (Linux: MAP_HUGETLB)
+};
+
+struct memory_region
+{
+    char *Name;
+    void *Base;
+    size_t Size;
+    huge_page_backing Backing;
 };
 
+#define MEMORY_REGION_MAX 4
+
 struct server_state
 {
     memory_arena Arena;
@@ -18,7 +129,18 @@ struct server_state
     char *StringNF;
     char *StringUN;
     char *StringFB;
-    task_with_memory Tasks[NUMBER_OF_THREADS];
+    string Response503;     // a whole response, sent as is to the connections we turn away
+    b32 PlatformSendsFiles;
+    cpu_features CPU;
+    scan_line *ScanLine;    // the widest line scanner the CPU runs, for ParseHTTPRequest()
+    base64_decode *DecodeBase64;  // the widest base64 kernels the CPU runs, for FromBase64() and ToBase64()
+    base64_encode *EncodeBase64;
+    file_cache FileCache;
+    protection_cache Protection;  // which .htpasswd protects which directory
+    virtual_hosts VirtualHosts;   // the sites under the root, by host name
+    connection_slots Slots;
     platform_work_queue *Queue;
+    memory_region Regions[MEMORY_REGION_MAX];
+    u32 RegionCount;
 };
 
@@ -170,6 +170,62 @@ ScanIdentifier(push_read_entire_file Source, scanner_location *Scanner,
         //printf("ScanIdentifier root: (%u, %u)\n", Scanner->Row, Scanner->Column);
         AddToken(Source, Scanner, Tokens, TokenHint(ConfigTokenType_Root, 0));
     }
+    else if (StringsAreEqual(Identifier, "mode"))
+    {
+        AddToken(Source, Scanner, Tokens, TokenHint(ConfigTokenType_Mode, 0));
+    }
+    else if (StringsAreEqual(Identifier, "idle_timeout"))
+    {
+        AddToken(Source, Scanner, Tokens, TokenHint(ConfigTokenType_IdleTimeout, 0));
+    }
+    else if (StringsAreEqual(Identifier, "cache_size"))
+    {
+        AddToken(Source, Scanner, Tokens, TokenHint(ConfigTokenType_CacheSize, 0));
+    }
+    else if (StringsAreEqual(Identifier, "max_header_size"))
+    {
+        AddToken(Source, Scanner, Tokens, TokenHint(ConfigTokenType_MaxHeaderSize, 0));
+    }
+    else if (StringsAreEqual(Identifier, "overload"))
+    {
+        AddToken(Source, Scanner, Tokens, TokenHint(ConfigTokenType_Overload, 0));
+    }
+    else if (StringsAreEqual(Identifier, "max_connections"))
+    {
+        AddToken(Source, Scanner, Tokens, TokenHint(ConfigTokenType_MaxConnections, 0));
+    }
+    else if (StringsAreEqual(Identifier, "connection_memory"))
+    {
+        AddToken(Source, Scanner, Tokens, TokenHint(ConfigTokenType_ConnectionMemory, 0));
+    }
+    else if (StringsAreEqual(Identifier, "huge_pages"))
+    {
+        AddToken(Source, Scanner, Tokens, TokenHint(ConfigTokenType_HugePages, 0));
+    }
+    else if (StringsAreEqual(Identifier, "backlog"))
+    {
+        AddToken(Source, Scanner, Tokens, TokenHint(ConfigTokenType_Backlog, 0));
+    }
+    else if (StringsAreEqual(Identifier, "listen"))
+    {
+        AddToken(Source, Scanner, Tokens, TokenHint(ConfigTokenType_Listen, 0));
+    }
+    else if (StringsAreEqual(Identifier, "pin_threads"))
+    {
+        AddToken(Source, Scanner, Tokens, TokenHint(ConfigTokenType_PinThreads, 0));
+    }
+    else if (StringsAreEqual(Identifier, "threads"))
+    {
+        AddToken(Source, Scanner, Tokens, TokenHint(ConfigTokenType_Threads, 0));
+    }
+    else if (StringsAreEqual(Identifier, "max_threads"))
+    {
+        AddToken(Source, Scanner, Tokens, TokenHint(ConfigTokenType_MaxThreads, 0));
+    }
+    else if (StringsAreEqual(Identifier, "thread_idle_timeout"))
+    {
+        AddToken(Source, Scanner, Tokens, TokenHint(ConfigTokenType_ThreadIdleTimeout, 0));
+    }
     else
     {
         fprintf(stderr, "Unknown identifier (%u, %u)\n", Scanner->Row, Scanner->Column);
@@ -272,6 +328,20 @@ ParseConfigFile(parsed_config_file_result *Result, memory_arena *Arena)
             case ConfigTokenType_Integer: printf("Integer (%u,%u): %u\n", T.Row, T.Column, T.Value); break;
             case ConfigTokenType_Port: printf("Port (%u,%u)\n", T.Row, T.Column); break;
             case ConfigTokenType_Root: printf("Root (%u,%u)\n", T.Row, T.Column); break;
+            case ConfigTokenType_Mode: printf("Mode (%u,%u)\n", T.Row, T.Column); break;
+            case ConfigTokenType_IdleTimeout: printf("IdleTimeout (%u,%u)\n", T.Row, T.Column); break;
+            case ConfigTokenType_CacheSize: printf("CacheSize (%u,%u)\n", T.Row, T.Column); break;
+            case ConfigTokenType_MaxHeaderSize: printf("MaxHeaderSize (%u,%u)\n", T.Row, T.Column); break;
+            case ConfigTokenType_Overload: printf("Overload (%u,%u)\n", T.Row, T.Column); break;
+            case ConfigTokenType_MaxConnections: printf("MaxConnections (%u,%u)\n", T.Row, T.Column); break;
+            case ConfigTokenType_ConnectionMemory: printf("ConnectionMemory (%u,%u)\n", T.Row, T.Column); break;
+            case ConfigTokenType_HugePages: printf("HugePages (%u,%u)\n", T.Row, T.Column); break;
+            case ConfigTokenType_Backlog: printf("Backlog (%u,%u)\n", T.Row, T.Column); break;
+            case ConfigTokenType_Listen: printf("Listen (%u,%u)\n", T.Row, T.Column); break;
+            case ConfigTokenType_PinThreads: printf("PinThreads (%u,%u)\n", T.Row, T.Column); break;
+            case ConfigTokenType_Threads: printf("Threads (%u,%u)\n", T.Row, T.Column); break;
+            case ConfigTokenType_MaxThreads: printf("MaxThreads (%u,%u)\n", T.Row, T.Column); break;
+            case ConfigTokenType_ThreadIdleTimeout: printf("ThreadIdleTimeout (%u,%u)\n", T.Row, T.Column); break;
             default: InvalidCodePath;
         }
     }
@@ -312,6 +382,73 @@ ParseConfigFile(parsed_config_file_result *Result, memory_arena *Arena)
                     
                     Result->RootSet = true;
                 }
+                else if (LastType == ConfigTokenType_Mode)
+                {
+                    if (StringsAreEqual(T.Lexeme, "event_loop"))
+                        Result->Mode = ServerMode_EventLoop;
+                    else if (StringsAreEqual(T.Lexeme, "queue"))
+                        Result->Mode = ServerMode_WorkQueue;
+                    else if (StringsAreEqual(T.Lexeme, "stealing"))
+                        Result->Mode = ServerMode_WorkStealing;
+                    else
+                    {
+                        fprintf(stderr, "Unknown mode (%u, %u), expected \"event_loop\", \"queue\" or \"stealing\"\n",
+                                T.Row, T.Column);
+                        Scanner.ErrorCount++;
+                    }
+                }
+                else if (LastType == ConfigTokenType_Overload)
+                {
+                    if (StringsAreEqual(T.Lexeme, "queue"))
+                        Result->Overload = OverloadPolicy_Queue;
+                    else if (StringsAreEqual(T.Lexeme, "503"))
+                        Result->Overload = OverloadPolicy_Reject;
+                    else
+                    {
+                        fprintf(stderr, "Unknown overload policy (%u, %u), expected \"queue\" or \"503\"\n",
+                                T.Row, T.Column);
+                        Scanner.ErrorCount++;
+                    }
+                }
+                else if (LastType == ConfigTokenType_HugePages)
+                {
+                    if (StringsAreEqual(T.Lexeme, "on"))
+                        Result->HugePages = true;
+                    else if (StringsAreEqual(T.Lexeme, "off"))
+                        Result->HugePages = false;
+                    else
+                    {
+                        fprintf(stderr, "Unknown huge_pages value (%u, %u), expected \"on\" or \"off\"\n",
+                                T.Row, T.Column);
+                        Scanner.ErrorCount++;
+                    }
+                }
+                else if (LastType == ConfigTokenType_Listen)
+                {
+                    if (StringsAreEqual(T.Lexeme, "shared"))
+                        Result->ReusePort = false;
+                    else if (StringsAreEqual(T.Lexeme, "reuseport"))
+                        Result->ReusePort = true;
+                    else
+                    {
+                        fprintf(stderr, "Unknown listen value (%u, %u), expected \"shared\" or \"reuseport\"\n",
+                                T.Row, T.Column);
+                        Scanner.ErrorCount++;
+                    }
+                }
+                else if (LastType == ConfigTokenType_PinThreads)
+                {
+                    if (StringsAreEqual(T.Lexeme, "on"))
+                        Result->PinThreads = true;
+                    else if (StringsAreEqual(T.Lexeme, "off"))
+                        Result->PinThreads = false;
+                    else
+                    {
+                        fprintf(stderr, "Unknown pin_threads value (%u, %u), expected \"on\" or \"off\"\n",
+                                T.Row, T.Column);
+                        Scanner.ErrorCount++;
+                    }
+                }
                 break;
                 
                 case ConfigTokenType_Integer: 
@@ -320,10 +457,60 @@ ParseConfigFile(parsed_config_file_result *Result, memory_arena *Arena)
                     Result->Port = T.Value;
                     Result->PortSet = true;
                 }
+                else if (LastType == ConfigTokenType_IdleTimeout)
+                {
+                    Result->IdleTimeout = T.Value;
+                }
+                else if (LastType == ConfigTokenType_CacheSize)
+                {
+                    Result->CacheSize = T.Value;
+                }
+                else if (LastType == ConfigTokenType_MaxHeaderSize)
+                {
+                    Result->MaxHeaderSize = T.Value;
+                }
+                else if (LastType == ConfigTokenType_MaxConnections)
+                {
+                    Result->MaxConnections = T.Value;
+                }
+                else if (LastType == ConfigTokenType_ConnectionMemory)
+                {
+                    Result->ConnectionMemory = T.Value;
+                }
+                else if (LastType == ConfigTokenType_Backlog)
+                {
+                    Result->Backlog = T.Value;
+                }
+                else if (LastType == ConfigTokenType_Threads)
+                {
+                    Result->ThreadCount = T.Value;
+                }
+                else if (LastType == ConfigTokenType_MaxThreads)
+                {
+                    Result->MaxThreadCount = T.Value;
+                }
+                else if (LastType == ConfigTokenType_ThreadIdleTimeout)
+                {
+                    Result->ThreadIdleTimeout = T.Value;
+                }
                 break;
                 
                 case ConfigTokenType_Port:
-                case ConfigTokenType_Root: LastType = T.Type; 
+                case ConfigTokenType_Root:
+                case ConfigTokenType_Mode:
+                case ConfigTokenType_IdleTimeout:
+                case ConfigTokenType_CacheSize:
+                case ConfigTokenType_MaxHeaderSize:
+                case ConfigTokenType_Overload:
+                case ConfigTokenType_MaxConnections:
+                case ConfigTokenType_ConnectionMemory:
+                case ConfigTokenType_HugePages:
+                case ConfigTokenType_Backlog:
+                case ConfigTokenType_Listen:
+                case ConfigTokenType_PinThreads:
+                case ConfigTokenType_Threads:
+                case ConfigTokenType_MaxThreads:
+                case ConfigTokenType_ThreadIdleTimeout: LastType = T.Type; 
                 break;
                 
                 default: InvalidCodePath;
@@ -341,6 +528,26 @@ ParseConfigFile(parsed_config_file_result *Result, memory_arena *Arena)
             printf("Parsed and set root: %s\n", Result->Root);
         else
             printf("Didn't set the root\n");
+        char *ModeNames[] = {"event_loop", "queue", "stealing"};
+        printf("Server mode: %s\n", ModeNames[Result->Mode]);
+        printf("Idle timeout: %u seconds\n", Result->IdleTimeout);
+        printf("File cache: %u MB\n", Result->CacheSize);
+        printf("Max request header size: %u KB\n", Result->MaxHeaderSize);
+        printf("Overload: %s\n", Result->Overload == OverloadPolicy_Queue ? "queue" : "503");
+        printf("Max connections: %u\n", Result->MaxConnections);
+        printf("Connection memory: %u MB\n", Result->ConnectionMemory);
+        printf("Huge pages: %s\n", Result->HugePages ? "on" : "off");
+        printf("Backlog: %u\n", Result->Backlog);
+        printf("Listen: %s\n", Result->ReusePort ? "reuseport" : "shared");
+        printf("Pin threads: %s\n", Result->PinThreads ? "on" : "off");
+        if (Result->ThreadCount)
+            printf("Threads: %u\n", Result->ThreadCount);
+        else
+            printf("Threads: one per CPU\n");
+        if (Result->MaxThreadCount)
+            printf("Max threads: %u, idle ones leave after %u seconds\n", Result->MaxThreadCount, Result->ThreadIdleTimeout);
+        else
+            printf("Max threads: fixed pool\n");
     }
     
     EndTemporaryMemory(TempMem);
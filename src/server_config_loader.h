@@ -1,9 +1,36 @@
 
+enum server_mode
+{
+    ServerMode_EventLoop,  // default: each worker multiplexes many non-blocking connections
+    ServerMode_WorkQueue,  // one blocking connection per work queue entry
+    ServerMode_WorkStealing,  // same, but each worker has a deque of its own and steals from the others
+};
+
+enum overload_policy
+{
+    OverloadPolicy_Queue,   // default: stop accepting until a slot frees up, the kernel queues connections
+    OverloadPolicy_Reject,  // answer new connections with a 503 right away
+};
+
 struct parsed_config_file_result
 {
     u32 Port;
     char PortString[6];   // the actual port used by Windows and Linux, it looks like
     char Root[65535];
+    server_mode Mode;
+    overload_policy Overload;  // what the work queue modes do when every connection slot is taken
+    u32 IdleTimeout;      // seconds a persistent connection may stay silent before we close it
+    u32 CacheSize;        // megabytes of file contents kept in memory, 0 to disable the cache
+    u32 MaxHeaderSize;    // kilobytes a request header may grow to
+    u32 MaxConnections;   // connection slots, shared by all the workers
+    u32 ConnectionMemory; // megabytes of slabs for the receive and send buffers
+    b32 HugePages;        // back the server arena, the file cache and the slabs with 2 MB pages
+    u32 Backlog;          // connections the kernel queues on a listening socket before we accept them
+    b32 ReusePort;        // event loop mode: every thread has its own SO_REUSEPORT listening socket
+    b32 PinThreads;       // pin every thread to a CPU, and give it memory of its NUMA node
+    u32 ThreadCount;      // threads, the main thread included; 0 for one per CPU
+    u32 MaxThreadCount;   // work queue modes: the pool grows up to that many threads under load; 0 for a fixed pool
+    u32 ThreadIdleTimeout; // seconds a worker above ThreadCount may stay idle before it exits
     b32 PortSet;
     b32 RootSet;
 };
@@ -15,6 +42,20 @@ enum config_token_type
     ConfigTokenType_Integer,
     ConfigTokenType_Port,
     ConfigTokenType_Root,
+    ConfigTokenType_Mode,
+    ConfigTokenType_IdleTimeout,
+    ConfigTokenType_CacheSize,
+    ConfigTokenType_MaxHeaderSize,
+    ConfigTokenType_Overload,
+    ConfigTokenType_MaxConnections,
+    ConfigTokenType_ConnectionMemory,
+    ConfigTokenType_HugePages,
+    ConfigTokenType_Backlog,
+    ConfigTokenType_Listen,
+    ConfigTokenType_PinThreads,
+    ConfigTokenType_Threads,
+    ConfigTokenType_MaxThreads,
+    ConfigTokenType_ThreadIdleTimeout,
     ConfigTokenType_Invalid,
 };
 
@@ -29,7 +70,7 @@ struct config_token
 
 struct parsed_config_tokens
 {
-    config_token Tokens[32];
+    config_token Tokens[64];
     u32 Count;
 };
 
@@ -0,0 +1,365 @@
+// NOTE(vincent): Process-wide cache of file contents, shared by every thread.
+// Files are keyed by their complete path (root, host and request path), so a hit costs a hash lookup
+// and no system call: the response body is sent straight from the cache memory.
+// The platform layer allocates that memory, whose size comes from the config file (cache_size).
+// Within it, blocks are allocated first-fit from a free list, and a freed block is merged with its
+// free neighbours. When there is no room left, we evict the least recently used files that aren't
+// being sent at the moment.
+// Everything happens under one ticket mutex, except reading files from disk and checking
+// whether they changed.
+
+#define FILE_CACHE_BUCKET_COUNT 4096  // must be a power of two
+#define FILE_CACHE_ALIGNMENT 64
+#define FILE_CACHE_CHECK_PERIOD 2     // seconds between two checks that a cached file didn't change on disk
+
+struct cache_block
+{
+    // NOTE(vincent): Boundary tags: every block knows its size and the size of the block right before it
+    // in memory, so that a freed block can find both its neighbours.
+    size_t Size;            // header included
+    size_t PreviousSize;    // 0 for the first block
+    b32 IsFree;
+    cache_block *NextFree;  // only meaningful for free blocks
+    cache_block *PreviousFree;
+};
+
+struct file_cache;
+struct file_cache_entry
+{
+    file_cache *Cache;
+    cache_block *Block;     // the entry, its path and the file content all live in that block
+    file_cache_entry *NextInBucket;
+    file_cache_entry *Next;      // LRU list, towards the least recently used
+    file_cache_entry *Previous;  // towards the most recently used
+
+    u32 Hash;
+    string Path;            // null-terminated
+    char *Content;
+    size_t Size;
+
+    u32 UserCount;          // connections sending this file right now
+    b32 Removed;            // out of the table already, the last user frees the block
+    time_t ModifiedTime;
+    time_t CheckedTime;
+};
+
+struct file_cache
+{
+    ticket_mutex Mutex;
+    u8 *Base;               // null when the cache is disabled
+    size_t Size;
+    size_t MaxFileSize;
+    cache_block *FirstFree;
+    file_cache_entry *Buckets[FILE_CACHE_BUCKET_COUNT];
+    file_cache_entry Sentinel;  // Sentinel.Next is the most recently used file, Sentinel.Previous the least
+
+    size_t UsedBytes;
+    u32 FileCount;
+    u64 Hits;
+    u64 Misses;
+    u64 Evictions;
+};
+
+inline size_t
+AlignSize(size_t Size, size_t Alignment)
+{
+    return (Size + Alignment - 1) & ~(Alignment - 1);
+}
+
+internal u32
+HashPath(string Path)
+{
+    // NOTE(vincent): FNV-1a
+    u32 Hash = 2166136261u;
+    for (u32 Index = 0; Index < Path.Length; Index++)
+    {
+        Hash ^= (u8)Path.Base[Index];
+        Hash *= 16777619u;
+    }
+    return Hash;
+}
+
+inline cache_block *
+NextBlockInMemory(file_cache *Cache, cache_block *Block)
+{
+    u8 *Next = (u8 *)Block + Block->Size;
+    return Next < Cache->Base + Cache->Size ? (cache_block *)Next : 0;
+}
+
+internal void
+LinkFreeBlock(file_cache *Cache, cache_block *Block)
+{
+    Block->IsFree = true;
+    Block->PreviousFree = 0;
+    Block->NextFree = Cache->FirstFree;
+    if (Cache->FirstFree)
+        Cache->FirstFree->PreviousFree = Block;
+    Cache->FirstFree = Block;
+}
+
+internal void
+UnlinkFreeBlock(file_cache *Cache, cache_block *Block)
+{
+    if (Block->PreviousFree)
+        Block->PreviousFree->NextFree = Block->NextFree;
+    else
+        Cache->FirstFree = Block->NextFree;
+    if (Block->NextFree)
+        Block->NextFree->PreviousFree = Block->PreviousFree;
+    Block->IsFree = false;
+}
+
+internal cache_block *
+AllocateCacheBlock(file_cache *Cache, size_t Size)
+{
+    // NOTE(vincent): Size is a multiple of FILE_CACHE_ALIGNMENT, so the rest of a split block
+    // always has room for its header.
+    cache_block *Block = Cache->FirstFree;
+    while (Block && Block->Size < Size)
+        Block = Block->NextFree;
+
+    if (Block)
+    {
+        UnlinkFreeBlock(Cache, Block);
+        if (Block->Size > Size)
+        {
+            cache_block *Rest = (cache_block *)((u8 *)Block + Size);
+            Rest->Size = Block->Size - Size;
+            Rest->PreviousSize = Size;
+            Block->Size = Size;
+            cache_block *Next = NextBlockInMemory(Cache, Rest);
+            if (Next)
+                Next->PreviousSize = Rest->Size;
+            LinkFreeBlock(Cache, Rest);
+        }
+        Cache->UsedBytes += Block->Size;
+    }
+    return Block;
+}
+
+internal void
+FreeCacheBlock(file_cache *Cache, cache_block *Block)
+{
+    Cache->UsedBytes -= Block->Size;
+
+    cache_block *Next = NextBlockInMemory(Cache, Block);
+    if (Next && Next->IsFree)
+    {
+        UnlinkFreeBlock(Cache, Next);
+        Block->Size += Next->Size;
+    }
+    if (Block->PreviousSize)
+    {
+        cache_block *Previous = (cache_block *)((u8 *)Block - Block->PreviousSize);
+        if (Previous->IsFree)
+        {
+            UnlinkFreeBlock(Cache, Previous);
+            Previous->Size += Block->Size;
+            Block = Previous;
+        }
+    }
+    Next = NextBlockInMemory(Cache, Block);
+    if (Next)
+        Next->PreviousSize = Block->Size;
+    LinkFreeBlock(Cache, Block);
+}
+
+inline void
+UnlinkRecentEntry(file_cache_entry *Entry)
+{
+    Entry->Previous->Next = Entry->Next;
+    Entry->Next->Previous = Entry->Previous;
+}
+
+inline void
+LinkMostRecentEntry(file_cache *Cache, file_cache_entry *Entry)
+{
+    Entry->Next = Cache->Sentinel.Next;
+    Entry->Previous = &Cache->Sentinel;
+    Entry->Next->Previous = Entry;
+    Cache->Sentinel.Next = Entry;
+}
+
+internal file_cache_entry *
+FindCachedFile(file_cache *Cache, u32 Hash, string Path)
+{
+    file_cache_entry *Entry = Cache->Buckets[Hash & (FILE_CACHE_BUCKET_COUNT - 1)];
+    while (Entry && !(Entry->Hash == Hash && StringsAreEqual(Entry->Path, Path)))
+        Entry = Entry->NextInBucket;
+    return Entry;
+}
+
+internal void
+RemoveCachedFile(file_cache *Cache, file_cache_entry *Entry)
+{
+    // NOTE(vincent): Takes the entry out of the table and the LRU list. Its memory is only freed
+    // once no connection is sending it anymore.
+    file_cache_entry **Link = &Cache->Buckets[Entry->Hash & (FILE_CACHE_BUCKET_COUNT - 1)];
+    while (*Link != Entry)
+        Link = &(*Link)->NextInBucket;
+    *Link = Entry->NextInBucket;
+    UnlinkRecentEntry(Entry);
+
+    Entry->Removed = true;
+    Cache->FileCount--;
+    if (Entry->UserCount == 0)
+        FreeCacheBlock(Cache, Entry->Block);
+}
+
+internal cache_block *
+AllocateCacheBlockEvicting(file_cache *Cache, size_t Size)
+{
+    cache_block *Block = AllocateCacheBlock(Cache, Size);
+    file_cache_entry *Candidate = Cache->Sentinel.Previous;
+    while (!Block && Candidate != &Cache->Sentinel)
+    {
+        file_cache_entry *MoreRecent = Candidate->Previous;
+        if (Candidate->UserCount == 0)
+        {
+            RemoveCachedFile(Cache, Candidate);
+            Cache->Evictions++;
+            Block = AllocateCacheBlock(Cache, Size);
+        }
+        Candidate = MoreRecent;
+    }
+    return Block;
+}
+
+internal void
+InitializeFileCache(file_cache *Cache, void *Memory, size_t Size)
+{
+    // NOTE(vincent): Memory is expected to be aligned on FILE_CACHE_ALIGNMENT (pages are).
+    // A null Memory leaves the cache disabled.
+    Cache->Sentinel.Next = &Cache->Sentinel;
+    Cache->Sentinel.Previous = &Cache->Sentinel;
+    Cache->Size = Size & ~(size_t)(FILE_CACHE_ALIGNMENT - 1);
+    if (!Memory || Cache->Size < FILE_CACHE_ALIGNMENT)
+        return;
+
+    Cache->Base = (u8 *)Memory;
+    Cache->MaxFileSize = Cache->Size / 4;
+    cache_block *Block = (cache_block *)Cache->Base;
+    Block->Size = Cache->Size;
+    Block->PreviousSize = 0;
+    LinkFreeBlock(Cache, Block);
+}
+
+internal void
+ReleaseCachedFile(file_cache_entry *Entry)
+{
+    file_cache *Cache = Entry->Cache;
+    BeginTicketMutex(&Cache->Mutex);
+    Assert(Entry->UserCount > 0);
+    Entry->UserCount--;
+    if (Entry->Removed && Entry->UserCount == 0)
+        FreeCacheBlock(Cache, Entry->Block);
+    EndTicketMutex(&Cache->Mutex);
+}
+
+internal file_cache_entry *
+AcquireCachedFile(file_cache *Cache, string Path, site_directory *Site)
+{
+    // NOTE(vincent): Returns the cached file, which stays valid until ReleaseCachedFile(),
+    // or 0 if we don't have it. Path must be null-terminated. Site is where to stat it from.
+    if (!Cache->Base)
+        return 0;
+
+    u32 Hash = HashPath(Path);
+    BeginTicketMutex(&Cache->Mutex);
+    file_cache_entry *Entry = FindCachedFile(Cache, Hash, Path);
+    if (Entry)
+    {
+        Entry->UserCount++;
+        UnlinkRecentEntry(Entry);
+        LinkMostRecentEntry(Cache, Entry);
+        Cache->Hits++;
+    }
+    else
+        Cache->Misses++;
+    EndTicketMutex(&Cache->Mutex);
+
+    // NOTE(vincent): Every FILE_CACHE_CHECK_PERIOD seconds, a hit costs a stat() to make sure
+    // the file didn't change on disk. Two threads may both check, which is harmless.
+    time_t Now = time(0);
+    if (Entry && Now - Entry->CheckedTime >= FILE_CACHE_CHECK_PERIOD)
+    {
+        struct stat FileStatus;
+        if (StatSitePath(Site, Entry->Path, &FileStatus) &&
+            FileStatus.st_mtime == Entry->ModifiedTime && (size_t)FileStatus.st_size == Entry->Size)
+        {
+            Entry->CheckedTime = Now;
+        }
+        else
+        {
+            BeginTicketMutex(&Cache->Mutex);
+            if (!Entry->Removed)
+                RemoveCachedFile(Cache, Entry);
+            EndTicketMutex(&Cache->Mutex);
+            ReleaseCachedFile(Entry);
+            Entry = 0;
+        }
+    }
+    return Entry;
+}
+
+internal file_cache_entry *
+CacheFile(file_cache *Cache, string Path, FILE *File, size_t Size)
+{
+    // NOTE(vincent): Reads the opened File into the cache and returns the new entry, acquired.
+    // Returns 0 if the file doesn't fit, in which case File is left at its start
+    // for the caller to stream it.
+    struct stat FileStatus;
+    if (!Cache->Base || Size > Cache->MaxFileSize || fstat(fileno(File), &FileStatus) != 0)
+        return 0;
+
+    size_t HeaderSize = AlignSize(sizeof(cache_block) + sizeof(file_cache_entry) + Path.Length + 1,
+                                  FILE_CACHE_ALIGNMENT);
+    size_t BlockSize = HeaderSize + AlignSize(Size, FILE_CACHE_ALIGNMENT);
+
+    BeginTicketMutex(&Cache->Mutex);
+    cache_block *Block = AllocateCacheBlockEvicting(Cache, BlockSize);
+    EndTicketMutex(&Cache->Mutex);
+    if (!Block)
+        return 0;
+
+    // NOTE(vincent): The block isn't in the LRU list yet, so nobody can evict it while we read.
+    file_cache_entry *Entry = (file_cache_entry *)(Block + 1);
+    Entry->Cache = Cache;
+    Entry->Block = Block;
+    Entry->Hash = HashPath(Path);
+    Entry->Path = StringBaseLength((char *)(Entry + 1), Path.Length);
+    Sprint(Entry->Path.Base, Path);
+    Entry->Content = (char *)Block + HeaderSize;
+    Entry->Size = Size;
+    Entry->UserCount = 1;
+    Entry->Removed = false;
+    Entry->ModifiedTime = FileStatus.st_mtime;
+    Entry->CheckedTime = time(0);
+
+    size_t BytesRead = fread(Entry->Content, 1, Size, File);
+
+    BeginTicketMutex(&Cache->Mutex);
+    if (BytesRead == Size)
+    {
+        // NOTE(vincent): Another thread may have cached the same file in the meantime. Ours is fresher.
+        file_cache_entry *Existing = FindCachedFile(Cache, Entry->Hash, Path);
+        if (Existing)
+            RemoveCachedFile(Cache, Existing);
+
+        file_cache_entry **Bucket = &Cache->Buckets[Entry->Hash & (FILE_CACHE_BUCKET_COUNT - 1)];
+        Entry->NextInBucket = *Bucket;
+        *Bucket = Entry;
+        LinkMostRecentEntry(Cache, Entry);
+        Cache->FileCount++;
+    }
+    else
+    {
+        FreeCacheBlock(Cache, Block);
+        Entry = 0;
+    }
+    EndTicketMutex(&Cache->Mutex);
+
+    if (!Entry)
+        fseek(File, 0, SEEK_SET);
+    return Entry;
+}
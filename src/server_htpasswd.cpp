@@ -0,0 +1,561 @@
+// NOTE(vincent): Basic authentication with .htpasswd files, and the process-wide cache of which
+// .htpasswd protects which directory, shared by every thread.
+//
+// A .htpasswd protects the directory it is in and every directory below it, down to the next
+// .htpasswd. Finding the one that governs a request means looking in its directory and in every
+// directory above it, up to the root. We used to do that for every request, with an fopen() per level.
+// Now the first request in a directory walks up with stat(), and the cache remembers the directory
+// along with the .htpasswd that governs it, or none. The requests after it don't touch the file
+// system at all until PROTECTION_CHECK_PERIOD seconds went by. Then the next request walks again,
+// and the .htpasswd is read again: adding, editing or removing one takes effect within that period.
+// A .htpasswd is kept once, however many directories it governs.
+//
+// Directories and .htpasswd contents live in the cache's own growable arena and are never freed one
+// by one: when the arena is full, or there are PROTECTION_MAX_DIRECTORIES directories, we empty the
+// whole cache and start over. Only directories that exist get in, so that requests for made-up paths
+// can't fill it up. Everything happens under one ticket mutex, except walking and reading files.
+//
+// Each .htpasswd is parsed once, when it is loaded, into a hash table keyed by user name. And since
+// browsers send the same Authorization header with every request, a bounded table remembers what
+// we answered to the last tokens we saw (Credentials): a repeat costs a lookup, without decoding the
+// base64 nor hashing the password. It is direct-mapped: a token takes the slot of whichever token was
+// there before. Every load of a .htpasswd gets a new Version, which the slots are checked against,
+// so a token whose .htpasswd changed, or went away with a flush, is checked again.
+
+#define PROTECTION_BUCKET_COUNT 1024         // must be a power of two
+#define PROTECTION_MAX_DIRECTORIES 16384
+#define PROTECTION_CACHE_RESERVE Megabytes(64)  // address space of the arena, committed as it fills up
+#define PROTECTION_CHECK_PERIOD 2            // seconds between two walks for the same directory
+#define CREDENTIAL_CACHE_SIZE 4096           // must be a power of two
+#define CREDENTIAL_TOKEN_MAX 120             // longer Authorization tokens aren't remembered
+
+enum access_result
+{
+    AccessResult_Unauthorized,
+    AccessResult_Forbidden,
+    AccessResult_Granted,
+};
+
+struct htpasswd_user
+{
+    htpasswd_user *NextInBucket;
+    u32 Hash;
+    string Name;          // Name and Password point into the content of the file
+    string Password;      // the MD5 of the password, in hexadecimal
+};
+
+struct htpasswd_file
+{
+    htpasswd_file *Next;
+    string Path;          // null-terminated
+    b32 Loaded;           // false if the file is there but we couldn't read it: nobody gets in
+    char *Content;        // replaced when the file changed on disk, along with the table
+    u32 Size;
+    time_t ModifiedTime;
+    u32 Version;          // unique to this load of the file
+    htpasswd_user **Buckets;
+    u32 BucketMask;
+    u32 UserCount;
+};
+
+struct credential_entry
+{
+    u32 Version;          // of the .htpasswd file that answered, 0 for an empty slot
+    u32 Hash;
+    access_result Result;
+    u32 TokenLength;
+    char Token[CREDENTIAL_TOKEN_MAX];
+};
+
+struct protected_directory
+{
+    protected_directory *NextInBucket;
+    u32 Hash;
+    string Path;              // with its trailing slash
+    htpasswd_file *Htpasswd;  // 0 when no .htpasswd governs it
+    time_t CheckedTime;
+};
+
+struct protection_cache
+{
+    ticket_mutex Mutex;
+    memory_arena Arena;
+    protected_directory *Buckets[PROTECTION_BUCKET_COUNT];
+    htpasswd_file *Files;
+    u32 DirectoryCount;
+    u32 NextVersion;
+    credential_entry *Credentials;  // CREDENTIAL_CACHE_SIZE of them, outside the arena: flushes keep them
+    u64 Hits;
+    u64 Walks;
+    u64 CredentialHits;
+    u32 Flushes;
+};
+
+// NOTE(vincent): What a walk found, in the request arena.
+struct htpasswd_walk
+{
+    b32 DirectoryExists;
+    b32 Found;
+    string Path;          // of the .htpasswd, null-terminated
+    push_read_entire_file File;
+    time_t ModifiedTime;
+};
+
+internal void
+InitializeProtectionCache(protection_cache *Cache, memory_arena *Arena)
+{
+    // NOTE(vincent): Arena is the server arena, which gives zeroed memory: every credential slot starts empty.
+    void *Memory = ReserveMemory(0, PROTECTION_CACHE_RESERVE);
+    if (!Memory)
+    {
+        InvalidCodePath;
+    }
+    InitializeGrowableArena(&Cache->Arena, PROTECTION_CACHE_RESERVE, Memory, 0);
+    Cache->Credentials = PushArray(Arena, CREDENTIAL_CACHE_SIZE, credential_entry);
+}
+
+internal string
+DecodeAuthString(memory_arena *Arena, string AuthString, base64_decode *DecodeBase64)
+{
+    // We want to do the following transformation:
+    // base64(username:password) -> username:password -> username:md5(password)
+    // where the md5 part is a printable 32-byte ascii version of the md5 hash.
+    // An auth string that isn't base64 decodes to an empty string, which matches no user.
+
+    char *Dest = PushArray(Arena, AuthString.Length + 72, char);
+
+    string Plain = FromBase64(AuthString, Dest, DecodeBase64);  // this should be less bytes than the source
+    if (!Plain.Base)
+        return StringBaseLength(Dest, 0);
+
+#if 0
+    printf("Plain : ");
+    PrintString(Plain);
+    printf("\n");
+    Assert(StringsAreEqual(Plain, "user:user"));
+#endif
+
+    string PasswordPart = StringSuffixAfter(Plain, ':');
+
+#if 0
+    printf("PasswordPart (%d) : ", PasswordPart.Length);
+    PrintString(PasswordPart);
+    Assert(StringsAreEqual(PasswordPart, "user"));
+    printf("\n");
+#endif
+
+    md5_result Hash = MD5((u8 *)PasswordPart.Base, PasswordPart.Length); // requires up to 72 bytes of padding
+
+
+    PrintMD5NoNull(PasswordPart.Base, Hash); // overwrites 32 bytes
+
+    string DecodedString = StringBaseLength(Dest, Plain.Length - PasswordPart.Length + 32);
+
+#if 0
+    printf("DecodedString : ");
+    PrintString(DecodedString);
+    Assert(StringsAreEqual(DecodedString, "user:ee11cbb19052e40b07aac0ca060c23ee"));
+    printf("\n");
+#endif
+
+
+    return DecodedString;
+}
+
+internal access_result
+MatchHtpasswd(char *Content, u32 Size, string DecodedAuthString)
+{
+    // NOTE(vincent): Compare htpasswd entries with the decoded auth string as you parse the file
+    // and see whether there is a match. Entries are separated by whitespace.
+    access_result Result = AccessResult_Forbidden;
+    b32 InEntry = false;
+    string LastEntry;
+    LastEntry.Base = Content;
+    LastEntry.Length = 0;
+    for (u32 Byte = 0; Byte <= Size; Byte++)
+    {
+        char *C = Content + Byte;
+        b32 AtEnd = (Byte == Size);  // the last entry may not end with a newline
+        if (!AtEnd && !InEntry && !IsWhitespace(*C))
+        {
+            InEntry = true;
+            LastEntry.Base = C;
+        }
+        else if (InEntry && (AtEnd || IsWhitespace(*C)))
+        {
+            InEntry = false;
+            LastEntry.Length = (u32)(C - LastEntry.Base);
+            if (StringsAreEqual(LastEntry, DecodedAuthString))
+            {
+                // NOTE(vincent): Successful authentication
+                Result = AccessResult_Granted;
+                break;
+            }
+        }
+    }
+    return Result;
+}
+
+internal htpasswd_walk
+WalkForHtpasswd(memory_arena *Arena, string Directory, u32 RootLength, site_directory *Site)
+{
+    // NOTE(vincent): Looks for a .htpasswd in Directory, then in every directory above it whose path
+    // is at least RootLength long, and reads the first one it finds. Within the site, paths are looked up
+    // from its handle, so a .htpasswd that is a symlink out of the site can't be read, and protects with
+    // nobody allowed in.
+    htpasswd_walk Walk = {};
+    string Scratch = StringBaseLength(PushArray(Arena, Directory.Length + 10, char), 0);
+    AppendString(&Scratch, Directory);
+
+    // The trailing slash goes away for the stat(): Windows doesn't take it.
+    Scratch.Base[Scratch.Length - 1] = 0;
+    struct stat Status;
+    Walk.DirectoryExists = (StatSitePath(Site, StringBaseLength(Scratch.Base, Scratch.Length - 1), &Status) &&
+                            (Status.st_mode & S_IFMT) == S_IFDIR);
+    Scratch.Base[Scratch.Length - 1] = '/';
+
+    for (;;)
+    {
+        AppendStringLiteralAndNull(&Scratch, ".htpasswd");
+        if (StatSitePath(Site, Scratch, &Status))
+        {
+            Walk.Found = true;
+            Walk.Path = Scratch;
+            Walk.ModifiedTime = Status.st_mtime;
+            Walk.File = PushReadOpenedFile(Arena, OpenSitePath(Site, Scratch));
+            break;
+        }
+        TruncateStringUntil(&Scratch, '/');
+        if (!TruncateStringUntil(&Scratch, '/') || Scratch.Length < RootLength)
+            break;
+    }
+    return Walk;
+}
+
+inline void *
+PushProtectionBytes(protection_cache *Cache, size_t Size)
+{
+    // NOTE(vincent): Everything in the arena stays 8-byte aligned, so that structs can follow strings.
+    return PushSize_(&Cache->Arena, (u32)AlignSize(Size, 8));
+}
+
+internal u32
+CountHtpasswdEntries(char *Content, u32 Size)
+{
+    u32 Count = 0;
+    b32 InEntry = false;
+    for (u32 Byte = 0; Byte < Size; Byte++)
+    {
+        b32 Space = IsWhitespace(Content[Byte]);
+        Count += (!InEntry && !Space);
+        InEntry = !Space;
+    }
+    return Count;
+}
+
+internal u32
+HtpasswdTableSize(u32 EntryCount)
+{
+    // NOTE(vincent): Bytes the table of a file with that many entries takes in the arena.
+    u32 BucketCount = 1;
+    while (BucketCount < EntryCount)
+        BucketCount *= 2;
+    return (u32)(AlignSize(BucketCount*sizeof(htpasswd_user *), 8) + EntryCount*AlignSize(sizeof(htpasswd_user), 8));
+}
+
+internal void
+IndexHtpasswdUsers(protection_cache *Cache, htpasswd_file *File, u32 EntryCount)
+{
+    // NOTE(vincent): The table has a bucket per entry, rounded up to a power of two, so chains stay short.
+    // Entries without a ':' can't match anything and are left out. A user listed twice keeps both
+    // entries, and either password gets in.
+    u32 BucketCount = 1;
+    while (BucketCount < EntryCount)
+        BucketCount *= 2;
+    File->Buckets = (htpasswd_user **)PushProtectionBytes(Cache, BucketCount*sizeof(htpasswd_user *));
+    for (u32 Bucket = 0; Bucket < BucketCount; Bucket++)
+        File->Buckets[Bucket] = 0;
+    File->BucketMask = BucketCount - 1;
+    File->UserCount = 0;
+
+    char *At = File->Content;
+    char *End = File->Content + File->Size;
+    while (At < End)
+    {
+        while (At < End && IsWhitespace(*At))
+            At++;
+        string Entry = StringBaseLength(At, 0);
+        while (At < End && !IsWhitespace(*At))
+            At++;
+        Entry.Length = (u32)(At - Entry.Base);
+        string Name = StringPrefixUntil(Entry, ':');
+        if (Name.Length == Entry.Length)
+            continue;
+
+        htpasswd_user *User = (htpasswd_user *)PushProtectionBytes(Cache, sizeof(htpasswd_user));
+        User->Name = Name;
+        User->Password = StringFromOffset(Entry, Name.Length + 1);
+        User->Hash = HashPath(User->Name);
+        htpasswd_user **Bucket = &File->Buckets[User->Hash & File->BucketMask];
+        User->NextInBucket = *Bucket;
+        *Bucket = User;
+        File->UserCount++;
+    }
+}
+
+internal access_result
+FindHtpasswdUser(htpasswd_file *File, string DecodedAuthString)
+{
+    // NOTE(vincent): DecodedAuthString is user:md5(password), see DecodeAuthString().
+    access_result Result = AccessResult_Forbidden;
+    string Name = StringPrefixUntil(DecodedAuthString, ':');
+    if (Name.Length == DecodedAuthString.Length)
+        return Result;
+    string Password = StringFromOffset(DecodedAuthString, Name.Length + 1);
+    u32 Hash = HashPath(Name);
+    for (htpasswd_user *User = File->Buckets[Hash & File->BucketMask]; User; User = User->NextInBucket)
+    {
+        if (User->Hash == Hash && StringsAreEqual(User->Name, Name) && StringsAreEqual(User->Password, Password))
+        {
+            Result = AccessResult_Granted;
+            break;
+        }
+    }
+    return Result;
+}
+
+internal credential_entry *
+CredentialSlot(protection_cache *Cache, htpasswd_file *File, u32 TokenHash)
+{
+    // NOTE(vincent): Under the mutex. Returns the slot of that token for that file, which holds
+    // the answer if its Version is the file's, or is the one to overwrite otherwise.
+    u32 Slot = (TokenHash ^ (File->Version * 0x9E3779B9u)) & (CREDENTIAL_CACHE_SIZE - 1);
+    return Cache->Credentials + Slot;
+}
+
+inline b32
+CredentialMatches(credential_entry *Entry, htpasswd_file *File, u32 TokenHash, string Token)
+{
+    return Entry->Version == File->Version && Entry->Hash == TokenHash &&
+        Entry->TokenLength == Token.Length && StringsAreEqual(StringBaseLength(Entry->Token, Entry->TokenLength), Token);
+}
+
+internal protected_directory *
+FindProtectedDirectory(protection_cache *Cache, u32 Hash, string Path)
+{
+    protected_directory *Directory = Cache->Buckets[Hash & (PROTECTION_BUCKET_COUNT - 1)];
+    while (Directory && !(Directory->Hash == Hash && StringsAreEqual(Directory->Path, Path)))
+        Directory = Directory->NextInBucket;
+    return Directory;
+}
+
+internal void
+FlushProtectionCache(protection_cache *Cache)
+{
+    // NOTE(vincent): Under the mutex. Nothing outside it holds pointers into the arena.
+    Cache->Arena.Used = 0;
+    DecommitArena(&Cache->Arena);
+    for (u32 Bucket = 0; Bucket < PROTECTION_BUCKET_COUNT; Bucket++)
+        Cache->Buckets[Bucket] = 0;
+    Cache->Files = 0;
+    Cache->DirectoryCount = 0;
+    Cache->Flushes++;
+}
+
+internal b32
+StoreProtectedDirectory(protection_cache *Cache, u32 Hash, string Path, htpasswd_walk *Walk, time_t Now)
+{
+    // NOTE(vincent): Under the mutex. Returns false if it doesn't fit, even in an empty cache.
+    for (u32 Attempt = 0; Attempt < 2; Attempt++)
+    {
+        htpasswd_file *File = 0;
+        b32 Reload = false;
+        if (Walk->Found)
+        {
+            File = Cache->Files;
+            while (File && !StringsAreEqual(File->Path, Walk->Path))
+                File = File->Next;
+            Reload = !File || File->ModifiedTime != Walk->ModifiedTime || File->Size != Walk->File.Size ||
+                File->Loaded != Walk->File.Success;
+        }
+        protected_directory *Directory = FindProtectedDirectory(Cache, Hash, Path);
+
+        size_t Needed = 0;
+        if (!Directory)
+            Needed += AlignSize(sizeof(protected_directory), 8) + AlignSize(Path.Length + 1, 8);
+        if (Walk->Found && !File)
+            Needed += AlignSize(sizeof(htpasswd_file), 8) + AlignSize(Walk->Path.Length + 1, 8);
+        u32 EntryCount = 0;
+        if (Reload && Walk->File.Success)
+        {
+            EntryCount = CountHtpasswdEntries(Walk->File.Memory, (u32)Walk->File.Size);
+            Needed += AlignSize(Walk->File.Size, 8) + HtpasswdTableSize(EntryCount);
+        }
+        if (Cache->Arena.Size - Cache->Arena.Used < Needed ||
+            (!Directory && Cache->DirectoryCount >= PROTECTION_MAX_DIRECTORIES))
+        {
+            FlushProtectionCache(Cache);
+            continue;
+        }
+
+        if (Walk->Found && !File)
+        {
+            File = (htpasswd_file *)PushProtectionBytes(Cache, sizeof(htpasswd_file));
+            File->Path = StringBaseLength((char *)PushProtectionBytes(Cache, Walk->Path.Length + 1), Walk->Path.Length);
+            Sprint(File->Path.Base, Walk->Path);
+            File->Next = Cache->Files;
+            Cache->Files = File;
+        }
+        if (Reload)
+        {
+            // NOTE(vincent): The old content stays in the arena until the next flush.
+            File->Loaded = Walk->File.Success;
+            File->Size = 0;
+            File->Content = 0;
+            File->Buckets = 0;
+            File->UserCount = 0;
+            if (Walk->File.Success)
+            {
+                File->Size = (u32)Walk->File.Size;
+                File->Content = (char *)PushProtectionBytes(Cache, File->Size);
+                memcpy(File->Content, Walk->File.Memory, File->Size);
+                IndexHtpasswdUsers(Cache, File, EntryCount);
+            }
+            File->ModifiedTime = Walk->ModifiedTime;
+            File->Version = ++Cache->NextVersion;
+            if (File->Version == 0)
+                File->Version = ++Cache->NextVersion;  // 0 marks the empty credential slots
+        }
+        if (!Directory)
+        {
+            Directory = (protected_directory *)PushProtectionBytes(Cache, sizeof(protected_directory));
+            Directory->Hash = Hash;
+            Directory->Path = StringBaseLength((char *)PushProtectionBytes(Cache, Path.Length + 1), Path.Length);
+            Sprint(Directory->Path.Base, Path);
+            protected_directory **Bucket = &Cache->Buckets[Hash & (PROTECTION_BUCKET_COUNT - 1)];
+            Directory->NextInBucket = *Bucket;
+            *Bucket = Directory;
+            Cache->DirectoryCount++;
+        }
+        Directory->Htpasswd = File;
+        Directory->CheckedTime = Now;
+        return true;
+    }
+    return false;
+}
+
+internal access_result
+CheckAccess(protection_cache *Cache, memory_arena *Arena, string CompletePath, u32 RootLength, site_directory *Site,
+            string AuthString, base64_decode *DecodeBase64)
+{
+    // NOTE(vincent): Unauthorized if the file is protected and no auth string was given (rule: zero is
+    // initialization), forbidden if the one given doesn't match. The auth string is decoded, and its
+    // password hashed, outside the mutex and only if the credential cache doesn't know the answer: we
+    // look up the directory again afterwards.
+    string Directory = CompletePath;
+    TruncateStringUntil(&Directory, '/');
+    u32 Hash = HashPath(Directory);
+    u32 TokenHash = AuthString.Base ? HashPath(AuthString) : 0;
+    b32 Remember = AuthString.Length <= CREDENTIAL_TOKEN_MAX;
+    string DecodedAuthString = {};
+    time_t Now = time(0);
+
+    for (u32 Attempt = 0; Attempt < 2; Attempt++)
+    {
+        b32 Decode = false;
+        BeginTicketMutex(&Cache->Mutex);
+        protected_directory *Cached = FindProtectedDirectory(Cache, Hash, Directory);
+        if (Cached && Now - Cached->CheckedTime < PROTECTION_CHECK_PERIOD)
+        {
+            access_result Result = AccessResult_Granted;
+            htpasswd_file *File = Cached->Htpasswd;
+            if (File && !AuthString.Base)
+                Result = AccessResult_Unauthorized;
+            else if (File && !File->Loaded)
+                Result = AccessResult_Forbidden;
+            else if (File)
+            {
+                credential_entry *Credential = CredentialSlot(Cache, File, TokenHash);
+                if (Remember && CredentialMatches(Credential, File, TokenHash, AuthString))
+                {
+                    Result = Credential->Result;
+                    Cache->CredentialHits++;
+                }
+                else if (!DecodedAuthString.Base)
+                    Decode = true;
+                else
+                {
+                    Result = FindHtpasswdUser(File, DecodedAuthString);
+                    if (Remember)
+                    {
+                        Credential->Version = File->Version;
+                        Credential->Hash = TokenHash;
+                        Credential->Result = Result;
+                        Credential->TokenLength = AuthString.Length;
+                        memcpy(Credential->Token, AuthString.Base, AuthString.Length);
+                    }
+                }
+            }
+            if (!Decode)
+                Cache->Hits++;
+            EndTicketMutex(&Cache->Mutex);
+
+            if (!Decode)
+                return Result;
+            DecodedAuthString = DecodeAuthString(Arena, AuthString, DecodeBase64);
+            continue;
+        }
+        Cache->Walks++;
+        EndTicketMutex(&Cache->Mutex);
+        break;
+    }
+
+    // NOTE(vincent): Not in the cache, or not anymore: we walk, remember what we found if the directory
+    // exists, and answer from the walk.
+    htpasswd_walk Walk = WalkForHtpasswd(Arena, Directory, RootLength, Site);
+    if (Walk.DirectoryExists)
+    {
+        BeginTicketMutex(&Cache->Mutex);
+        StoreProtectedDirectory(Cache, Hash, Directory, &Walk, Now);
+        EndTicketMutex(&Cache->Mutex);
+    }
+    if (!Walk.Found)
+        return AccessResult_Granted;
+    if (!AuthString.Base)
+        return AccessResult_Unauthorized;
+    if (!Walk.File.Success)
+        return AccessResult_Forbidden;
+    if (!DecodedAuthString.Base)
+        DecodedAuthString = DecodeAuthString(Arena, AuthString, DecodeBase64);
+    return MatchHtpasswd(Walk.File.Memory, (u32)Walk.File.Size, DecodedAuthString);
+}
+
+internal void
+TestHtpasswdUsers()
+{
+    // NOTE(vincent): Entries may be separated by any whitespace, the last one may not end with a
+    // newline, the ones without ':' are skipped, and a user listed twice gets in with either password.
+    char Content[] = "alice:0cc175b9c0f1b6a831c399e269772661\r\nbob:92eb5ffee6ae2fec3ad71c777531578f \tjunk\n"
+        "alice:4a8a08f09d37b73795649038408b5f33\n:e1671797c52e15f763380b45e841ec32\ncarol:";
+    u64 Storage[256];
+    protection_cache Cache = {};
+    InitializeArena(&Cache.Arena, sizeof(Storage), Storage);
+    htpasswd_file File = {};
+    File.Content = Content;
+    File.Size = sizeof(Content) - 1;
+    u32 EntryCount = CountHtpasswdEntries(File.Content, File.Size);
+    IndexHtpasswdUsers(&Cache, &File, EntryCount);
+    b32 Success = (EntryCount == 6 && File.UserCount == 5 && File.BucketMask == 7);
+    Success &= (Cache.Arena.Used <= HtpasswdTableSize(EntryCount));
+    
+    Success &= (FindHtpasswdUser(&File, StringFromLiteral("alice:0cc175b9c0f1b6a831c399e269772661")) == AccessResult_Granted);
+    Success &= (FindHtpasswdUser(&File, StringFromLiteral("alice:4a8a08f09d37b73795649038408b5f33")) == AccessResult_Granted);
+    Success &= (FindHtpasswdUser(&File, StringFromLiteral("bob:92eb5ffee6ae2fec3ad71c777531578f")) == AccessResult_Granted);
+    Success &= (FindHtpasswdUser(&File, StringFromLiteral(":e1671797c52e15f763380b45e841ec32")) == AccessResult_Granted);
+    Success &= (FindHtpasswdUser(&File, StringFromLiteral("bob:0cc175b9c0f1b6a831c399e269772661")) == AccessResult_Forbidden);
+    Success &= (FindHtpasswdUser(&File, StringFromLiteral("alice:0cc175b9c0f1b6a831c399e26977266")) == AccessResult_Forbidden);
+    Success &= (FindHtpasswdUser(&File, StringFromLiteral("carol:")) == AccessResult_Granted);
+    Success &= (FindHtpasswdUser(&File, StringFromLiteral("junk")) == AccessResult_Forbidden);
+    Success &= (FindHtpasswdUser(&File, StringFromLiteral("dave:0cc175b9c0f1b6a831c399e269772661")) == AccessResult_Forbidden);
+    Assert(Success);
+}
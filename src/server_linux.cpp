@@ -5,236 +5,339 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <signal.h>
-#include <pthread.h>  // NOTE(vincent):  Compile and link with -pthread. semaphore.h also needs it.
-#include <semaphore.h>
+#include <pthread.h>  // NOTE(vincent):  Compile and link with -pthread.
 #include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
+#include <linux/openat2.h>
 #include "common.h"
-#define BACKLOG 10         // how many pending connections the queue will hold
+#define EVENT_LOOP_MAX_EVENTS 64      // how many epoll events a worker takes per epoll_wait()
+#define EVENT_LOOP_ACCEPTS_PER_WAKEUP 16  // so one worker doesn't swallow a whole burst of connections
+#define EVENT_LOOP_TIMER_PERIOD 1000  // milliseconds between two sweeps for idle connections
 
 #define INVALID_SOCKET -1  // this helps for platform-independent code compatibility with Windows
 typedef int SOCKET;        // same
 #include "server.cpp"
+#include "server_linux_common.cpp"
 
 
-struct platform_work_queue
+// NOTE(vincent): Event loop mode. Every thread (the main thread included) owns an epoll instance
+// and a pool of connections, up to its share of the connection slots. The listening socket is non-blocking and registered in 
+// every epoll instance with EPOLLEXCLUSIVE, so the kernel wakes one worker per incoming connection,
+// and that worker serves the connection until it closes. Client sockets are non-blocking and
+// edge-triggered: we read or write until EAGAIN, then wait for the next edge.
+// Keep-alive connections that see no event for IdleTimeout seconds are closed by a periodic sweep.
+struct alignas(LINUX_PAGE_SIZE) linux_event_loop
 {
-    u32 volatile NextEntryToWrite;
-    u32 volatile NextEntryToRead;
-    sem_t SemaphoreHandle;
-    platform_work_queue_entry Entries[256];
+    int EpollHandle;
+    SOCKET ListenSocket;      // shared by all the loops, or, with listen:"reuseport", our own
+    s32 CPU;                  // the CPU the loop's thread pins itself to, -1 if none
+    b32 Listening;            // false while the pool is exhausted, so that other workers accept instead
+                              // (with listen:"reuseport", connections wait in our backlog)
+    server_memory *Memory;
+    connection_pool Pool;
+    u64 IdleTimeout;          // in milliseconds
+    u64 LastSweep;
 };
 
 internal void
-LinuxAddEntry(platform_work_queue *Queue, platform_work_queue_callback *Callback, void *Data)
+LinuxSetListening(linux_event_loop *Loop, b32 Listening)
 {
-    u32 NewNextEntryToWrite = (Queue->NextEntryToWrite + 1) % ArrayCount(Queue->Entries);
-    Assert(NewNextEntryToWrite != Queue->NextEntryToWrite);
-    
-    if (NewNextEntryToWrite != Queue->NextEntryToRead)
+    if (Loop->Listening != Listening)
     {
-        platform_work_queue_entry *Entry = Queue->Entries + Queue->NextEntryToWrite;
-        Entry->Callback = Callback;
-        Entry->Data = Data;
-        // TODO(vincent): compiler write barrier here?
-        Queue->NextEntryToWrite = NewNextEntryToWrite;
-        // increase semaphore count so that a thread blocked by sem_wait() can wake up
-        sem_post(&Queue->SemaphoreHandle);
+        struct epoll_event Event = {};
+        Event.events = EPOLLIN | EPOLLEXCLUSIVE;
+        Event.data.ptr = 0;  // NOTE(vincent): connections are never null, so null means the listener
+        int Operation = Listening ? EPOLL_CTL_ADD : EPOLL_CTL_DEL;
+        if (epoll_ctl(Loop->EpollHandle, Operation, Loop->ListenSocket, &Event) == -1)
+            perror("epoll_ctl() on the listening socket failed");
+        else
+            Loop->Listening = Listening;
     }
 }
 
-internal b32
-LinuxDoNextWorkQueueEntry(platform_work_queue *Queue)
+internal void
+LinuxCloseConnection(linux_event_loop *Loop, connection *Connection)
 {
-    b32 WeShouldSleep = false;
-    u32 OriginalNextEntryToRead = Queue->NextEntryToRead;
-    u32 NewNextEntryToRead = (OriginalNextEntryToRead + 1) % ArrayCount(Queue->Entries);
-    if (OriginalNextEntryToRead != Queue->NextEntryToWrite)
-    {
-        // That __sync function is a GCC thing. Might also work on LLVM.
-        u32 Index = __sync_val_compare_and_swap(&Queue->NextEntryToRead, OriginalNextEntryToRead, 
-                                                NewNextEntryToRead);
-        if (Index == OriginalNextEntryToRead)
-        {
-            platform_work_queue_entry Entry = Queue->Entries[Index];
-            Entry.Callback(Queue, Entry.Data);
-        }
-    }
-    else
-    {
-        WeShouldSleep = true;
-    }
-    
-    return WeShouldSleep;
+    // NOTE(vincent): close() also removes the socket from the epoll set.
+    CloseConnection(Connection);
+    ReleaseConnection(&Loop->Pool, Connection);
+    LinuxSetListening(Loop, true);
 }
 
-internal void *
-ThreadProc(void *Arg)
+internal void
+LinuxServiceConnection(linux_event_loop *Loop, connection *Connection, u32 Events)
 {
-    platform_work_queue *Queue = (platform_work_queue *)Arg;
-    for (;;)
+    SOCKET ClientSocket = Connection->Socket;
+    Connection->LastActivity = LinuxGetMilliseconds();
+    if (Events & EPOLLERR)
+        Connection->State = ConnectionState_Closing;
+    
+    // NOTE(vincent): A keep-alive connection goes back to receiving once its response is sent,
+    // and the next request may already be waiting in the socket, so we loop until EAGAIN.
+    while (Connection->State != ConnectionState_Closing)
     {
-        if (LinuxDoNextWorkQueueEntry(Queue))
+        while (Connection->State == ConnectionState_Receiving)
         {
-            sem_wait(&Queue->SemaphoreHandle);  // decrement
+            u32 Room = Connection->ReceiveBufferSize - Connection->ReceivedCount;
+            ssize_t BytesReceived = recv(ClientSocket, Connection->ReceiveBuffer + Connection->ReceivedCount,
+                                         Room, 0);
+            if (BytesReceived > 0)
+                ConnectionReceived(Loop->Memory, Connection, (u32)BytesReceived);
+            else if (BytesReceived == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return;  // wait for the next EPOLLIN edge
+            else if (BytesReceived == -1 && errno == EINTR)
+                continue;
+            else
+            {
+                HandleReceiveError((int)BytesReceived, ClientSocket);
+                Connection->State = ConnectionState_Closing;
+            }
+        }
+        
+        while (Connection->State == ConnectionState_Sending)
+        {
+            size_t FileBytes = NextFileBytesToSend(Connection);
+            if (FileBytes)
+            {
+                s64 BytesSent = LinuxSendFile(ClientSocket, Connection->File, Connection->FileOffset, FileBytes);
+                if (BytesSent >= 0)
+                    ConnectionFileSent(Connection, (size_t)BytesSent);
+                else if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return;  // wait for the next EPOLLOUT edge
+                else if (errno != EINTR)
+                {
+                    HandleSendError((int)BytesSent, ClientSocket);
+                    Connection->State = ConnectionState_Closing;
+                }
+                continue;
+            }
+            
+            string ToSend = NextBytesToSend(Loop->Memory, Connection);
+            if (ToSend.Length)
+            {
+                int Flags = MSG_NOSIGNAL | (FileFollows(Connection) ? MSG_MORE : 0);
+                ssize_t BytesSent = send(ClientSocket, ToSend.Base, ToSend.Length, Flags);
+                if (BytesSent >= 0)
+                    ConnectionSent(Connection, (u32)BytesSent);
+                else if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return;  // wait for the next EPOLLOUT edge
+                else if (errno == EINTR)
+                    continue;
+                else
+                {
+                    HandleSendError((int)BytesSent, ClientSocket);
+                    Connection->State = ConnectionState_Closing;
+                }
+            }
         }
     }
+    
+    LinuxCloseConnection(Loop, Connection);
 }
 
 internal void
-LinuxMakeQueue(platform_work_queue *Queue, u32 ThreadCount)
+LinuxCloseIdleConnections(linux_event_loop *Loop)
 {
-    Queue->NextEntryToWrite = 0;
-    Queue->NextEntryToRead = 0;
-    u32 InitialCount = 0;
-    sem_init(&Queue->SemaphoreHandle, 0, InitialCount); 
+    u64 Now = LinuxGetMilliseconds();
+    if (Now - Loop->LastSweep < EVENT_LOOP_TIMER_PERIOD)
+        return;
+    Loop->LastSweep = Now;
     
-    for (u32 ThreadIndex = 0; ThreadIndex < ThreadCount; ThreadIndex++)
+    connection *Next = 0;
+    for (connection *Connection = Loop->Pool.First; Connection; Connection = Next)
     {
-        pthread_t ThreadID;
-        pthread_create(&ThreadID,
-                       0, // const pthread_attr_t *restrict attr,
-                       ThreadProc,
-                       Queue);
+        Next = Connection->Next;
+        if (Now - Connection->LastActivity >= Loop->IdleTimeout)
+            LinuxCloseConnection(Loop, Connection);
     }
+    
+    // NOTE(vincent): Slots other loops released may have made room for us too.
+    if (!Loop->Listening && ConnectionPoolHasRoom(&Loop->Pool))
+        LinuxSetListening(Loop, true);
 }
 
-internal b32
-HandleReceiveError(int BytesReceived, SOCKET ClientSocket)
+internal void
+LinuxAcceptConnections(linux_event_loop *Loop)
 {
-    b32 Success = true;
-    if (BytesReceived < 0)
+    for (u32 AcceptIndex = 0; AcceptIndex < EVENT_LOOP_ACCEPTS_PER_WAKEUP; AcceptIndex++)
     {
-        perror("recv failed");
-        Success = false;
+        if (!ConnectionPoolHasRoom(&Loop->Pool))
+        {
+            LinuxSetListening(Loop, false);
+            break;
+        }
+        
+        struct sockaddr_storage TheirAddress;
+        socklen_t SizeTheirAddress = sizeof(TheirAddress);
+        SOCKET ClientSocket = accept4(Loop->ListenSocket, (struct sockaddr *)&TheirAddress, 
+                                      &SizeTheirAddress, SOCK_NONBLOCK);
+        if (ClientSocket == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept failed");
+            break;
+        }
+        
+        // NOTE(vincent): Another loop may have taken the last free slot since we looked.
+        connection *Connection = AcquireConnection(&Loop->Pool);
+        if (!Connection)
+        {
+            RejectConnection((server_state *)Loop->Memory->Storage, ClientSocket);
+            continue;
+        }
+        if (!OpenConnection(Connection, ClientSocket, (struct sockaddr *)&TheirAddress))
+        {
+            RejectConnection((server_state *)Loop->Memory->Storage, ClientSocket);
+            ReleaseConnection(&Loop->Pool, Connection);
+            continue;
+        }
+        Connection->LastActivity = LinuxGetMilliseconds();
+        
+        struct epoll_event Event = {};
+        Event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        Event.data.ptr = Connection;
+        if (epoll_ctl(Loop->EpollHandle, EPOLL_CTL_ADD, ClientSocket, &Event) == -1)
+        {
+            perror("epoll_ctl() on a client socket failed");
+            CloseConnection(Connection);
+            ReleaseConnection(&Loop->Pool, Connection);
+        }
     }
-    return Success;
 }
 
-internal b32
-HandleSendError(int BytesSent, SOCKET ClientSocket)
+internal void *
+LinuxEventLoopThreadProc(void *Arg)
 {
-    b32 Success = true;
-    if (BytesSent == -1)
+    linux_event_loop *Loop = (linux_event_loop *)Arg;
+    LinuxPinThread(Loop->CPU);
+    struct epoll_event Events[EVENT_LOOP_MAX_EVENTS];
+    for (;;)
     {
-        perror("send failed");
-        Success = false;
+        int EventCount = epoll_wait(Loop->EpollHandle, Events, ArrayCount(Events), EVENT_LOOP_TIMER_PERIOD);
+        if (EventCount == -1 && errno != EINTR)
+            perror("epoll_wait failed");
+        
+        for (int EventIndex = 0; EventIndex < EventCount; EventIndex++)
+        {
+            connection *Connection = (connection *)Events[EventIndex].data.ptr;
+            if (Connection)
+                LinuxServiceConnection(Loop, Connection, Events[EventIndex].events);
+            else
+                LinuxAcceptConnections(Loop);
+        }
+        
+        LinuxCloseIdleConnections(Loop);
     }
-    return Success;
 }
 
-internal void
-ShutdownConnection(SOCKET ClientSocket)
+internal linux_event_loop *
+LinuxMakeEventLoops(server_memory *Memory, parsed_config_file_result *Config, linux_thread_layout *Layout)
 {
-    close(ClientSocket);
+    // NOTE(vincent): One loop per thread of Layout, each on its thread's node.
+    // The first one is left for the main thread to run.
+    u32 LoopCount = Layout->ThreadCount;
+    linux_event_loop *Loops = (linux_event_loop *)LinuxAllocateThreadStates(sizeof(linux_event_loop), Layout);
+    SOCKET ListenSockets[MAX_THREAD_COUNT];
+    LinuxOpenLoopListeners(Config, Layout, ListenSockets);
+    
+    for (u32 LoopIndex = 0; LoopIndex < LoopCount; LoopIndex++)
+    {
+        linux_event_loop *Loop = Loops + LoopIndex;
+        Loop->Memory = Memory;
+        Loop->ListenSocket = ListenSockets[LoopIndex];
+        Loop->CPU = Layout->CPUs[LoopIndex];
+        if (LoopIndex == 0 || Config->ReusePort)
+        {
+            if (fcntl(Loop->ListenSocket, F_SETFL, fcntl(Loop->ListenSocket, F_GETFL, 0) | O_NONBLOCK) == -1)
+            {
+                perror("fcntl() on the listening socket failed");
+                return 0;
+            }
+        }
+        Loop->Listening = false;
+        Loop->IdleTimeout = (u64)Config->IdleTimeout * 1000;
+        Loop->LastSweep = LinuxGetMilliseconds();
+        Loop->Pool = BeginConnectionPool(Memory, LoopCount);
+        Loop->Pool.Cache.Node = Layout->Nodes[LoopIndex];
+        Loop->EpollHandle = epoll_create1(0);
+        if (Loop->EpollHandle == -1)
+        {
+            perror("epoll_create1() failed");
+            return 0;
+        }
+        LinuxSetListening(Loop, true);
+    }
+    printf("Event loop mode: %u threads, up to %u connections each\n", LoopCount, Loops[0].Pool.MaxCount);
+    
+    for (u32 LoopIndex = 1; LoopIndex < LoopCount; LoopIndex++)
+    {
+        pthread_t ThreadID;
+        pthread_create(&ThreadID, 0, LinuxEventLoopThreadProc, Loops + LoopIndex);
+    }
+    return Loops;
 }
 
 int main(void)
 {
-    // NOTE(vincent): Initialize threads and work queue
+    // NOTE(vincent): A client closing its socket early would otherwise kill us on the next send().
+    signal(SIGPIPE, SIG_IGN);
+    
     platform_work_queue Queue = {};
-    LinuxMakeQueue(&Queue, NUMBER_OF_THREADS - 1);
     
     // NOTE(vincent): Initializing server memory
     server_memory ServerMemory = {};
-    void *BaseAddress = 0;
-    ServerMemory.StorageSize = SERVER_STORAGE_SIZE;
-    ServerMemory.Storage = mmap(BaseAddress, ServerMemory.StorageSize, PROT_READ | PROT_WRITE,
-                                MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-    if (ServerMemory.Storage == MAP_FAILED)
-    {
-        perror("mmap failed");
+    if (!LinuxAllocateServerMemory(&ServerMemory))
         return 1;
-    }
     initialize_server_memory_result InitResult = 
-        InitializeServerMemory(&ServerMemory, &Queue, LinuxAddEntry, LinuxDoNextWorkQueueEntry);
+        InitializeServerMemory(&ServerMemory, &Queue, LinuxAddEntry, LinuxDoNextWorkQueueEntry,
+                               LinuxSendFile, LinuxWaitOnAddress, LinuxWakeOnAddress, LinuxCountHugePages,
+                               LinuxGetThreadNode, LinuxOpenBeneath, LinuxStatBeneath,
+                               LinuxWatchConnection);
+#if RUN_BENCHMARKS
+    LinuxBenchmarkWorkRing();
+    LinuxBenchmarkWorkDeque();
+    LinuxBenchmarkParking();
+#endif
     
     if (InitResult.ParsingErrorCount == 0)
     {
-        struct addrinfo *AddressInfo = 0;
-        struct addrinfo Hints;
-        ZeroBytes((char *)&Hints, sizeof(Hints));
-        Hints.ai_family = AF_UNSPEC;
-        Hints.ai_socktype = SOCK_STREAM;
-        Hints.ai_protocol = IPPROTO_TCP;
-        Hints.ai_flags = AI_PASSIVE;      // "use my IP"
+        linux_topology Topology;
+        linux_thread_layout Layout;
+        LinuxDetectTopology(&Topology);
+        LinuxLayOutThreads(&Topology, InitResult.Config, &Layout);
         
-        // Resolve the local address and port to be used by the server
-        int AddressInfoResult = getaddrinfo(0, InitResult.PortString, &Hints, &AddressInfo);
-        if (AddressInfoResult != 0) 
-        {
-            fprintf(stderr, "getaddrinfo() failed: %s\n", gai_strerror(AddressInfoResult));
+        b32 HugePages = InitResult.Config->HugePages;
+        LinuxAdviseServerArena(&ServerMemory, HugePages);
+        LinuxAllocateFileCache(&ServerMemory, InitResult.Config->CacheSize, HugePages);
+        LinuxOpenVirtualHosts(&ServerMemory, InitResult.Config);
+        if (!LinuxAllocateConnectionSlots(&ServerMemory, HugePages, &Layout))
             return 1;
-        }
-        
-        SOCKET ListenSocket = INVALID_SOCKET;
+        char Regions[1024];
+        if (SprintMemoryRegions(Regions, &ServerMemory))
+            fputs(Regions, stdout);
+        printf("Server: waiting for a connection on port %s\n", InitResult.PortString);
         
-        // loop through all the results and bind to the first we can
-        struct addrinfo *P;
-        int One = 1;
-        for(P = AddressInfo; 
-            P; 
-            P = P->ai_next) 
+        if (InitResult.Config->Mode == ServerMode_EventLoop)
         {
-            if ((ListenSocket = socket(P->ai_family, P->ai_socktype, P->ai_protocol)) == -1) 
-            {
-                perror("socket() failed");
-                continue;
-            }
-            
-            if (setsockopt(ListenSocket, SOL_SOCKET, SO_REUSEADDR, &One, sizeof(int)) == -1) 
-            {
-                perror("setsockopt() failed");
+            // NOTE(vincent): The main thread becomes one of the event loops and never returns.
+            linux_event_loop *EventLoops = LinuxMakeEventLoops(&ServerMemory, InitResult.Config, &Layout);
+            if (!EventLoops)
                 exit(1);
-            }
-            
-            if (bind(ListenSocket, P->ai_addr, P->ai_addrlen) == -1) 
-            {
-                close(ListenSocket);
-                perror("bind() failed");
-                continue;
-            }
-            break;  // we break here when the three calls were successful
-        }
-        
-        freeaddrinfo(AddressInfo); // all done with this structure
-        
-        if (P == 0)  
-        {
-            fprintf(stderr, "failed to bind\n");
-            if (StringsAreEqual(InitResult.PortString, "80"))
-                printf("Port is 80, maybe the OS is keeping you from listening to that port?" 
-                       " Try sudo\n");
-            exit(1);
-        }
-        
-        if (listen(ListenSocket, BACKLOG) == -1) 
-        {
-            perror("listen");
-            exit(1);
-        }
-        
-        struct sockaddr_storage TheirAddress; // connector's address information
-        socklen_t SizeTheirAddress = sizeof(TheirAddress);
-        printf("Server: waiting for a connection on port %s\n", InitResult.PortString);
-        
-        for (;;)
-        {  
-            // Accept a client socket
-            SOCKET ClientSocket = 
-                accept(ListenSocket, (struct sockaddr *)&TheirAddress, &SizeTheirAddress);
-            if (ClientSocket == -1) 
-            {
-                perror("accept failed");
-                continue;
-            }
-            
-            PrepareHandshaking(&ServerMemory, (struct sockaddr *)&TheirAddress, ClientSocket, &Queue);
+            LinuxEventLoopThreadProc(EventLoops);
         }
+        else
+            LinuxRunWorkQueueMode(&ServerMemory, &Queue, InitResult.Config, &Layout);
     }
     
     return 0;
@@ -0,0 +1,1456 @@
+// NOTE(vincent): Code shared by the two Linux platform layers, server_linux.cpp and server_linux_uring.cpp:
+// the work queue, the socket routines that server.cpp expects from the platform layer,
+// and the setup of the server memory and of the listening socket.
+// It is included right after server.cpp.
+
+#define WORKER_SPIN_MIN 32     // bounds of how many times an idle worker looks for work before it parks
+#define WORKER_SPIN_MAX 4096
+#define WORKER_GROW_BACKLOG 2  // entries waiting while every worker is busy, before the elastic pool grows
+#define WORKER_GROW_WAIT 20    // milliseconds the ring may hold entries without any being taken, before it grows
+#define WATCH_SWEEP_PERIOD 1000 // milliseconds between two sweeps for idle watched connections
+#define WATCH_EVENT_COUNT 64   // events the accepting thread takes per epoll_wait()
+#define ACCEPT_PAUSE_WAIT 20   // milliseconds between two looks at the connection slots while they are all taken
+
+#define HUGE_PAGE_SIZE 2097152 // the x86-64 and arm64 default; MAP_HUGETLB sizes must be a multiple of it
+#define LINUX_PAGE_SIZE 4096   // what we align the per-thread structs to, so that each can live on its own node
+
+// NOTE(vincent): Where the threads run, and where their memory lives. LinuxDetectTopology() reads the CPUs
+// the process may run on and the NUMA node of each from /sys, and LinuxLayOutThreads() gives every thread
+// (the main thread is thread 0) a CPU and a node. Without pin_threads:"on", threads float, so there is no
+// node to speak of: everything is node 0 and the slabs aren't split.
+struct linux_topology
+{
+    u32 CPUCount;                        // CPUs the process may run on, node by node
+    s32 CPUs[CPU_SETSIZE];
+    u8 CPUNodes[CPU_SETSIZE];            // the node index of each, below SLAB_MAX_NODE_COUNT
+    u32 NodeCount;
+    s32 NodeIDs[SLAB_MAX_NODE_COUNT];    // the kernel's number of each node index, -1 if unknown
+};
+
+struct linux_thread_layout
+{
+    u32 ThreadCount;                     // how many threads there may be
+    u32 StartThreadCount;                // how many start right away, fewer with an elastic pool
+    s32 CPUs[MAX_THREAD_COUNT];          // the CPU each thread pins itself to, -1 for none
+    u32 Nodes[MAX_THREAD_COUNT];         // node index of each thread
+    u32 NodeCount;                       // how many node indices are in use, 1 without pinning
+    s32 NodeIDs[SLAB_MAX_NODE_COUNT];
+};
+
+// NOTE(vincent): The work queue has two modes.
+// - Shared (mode:"queue"): every entry goes through the ring, and workers take them one by one.
+// - Stealing (mode:"stealing"): each worker also owns a work_deque. What a worker adds goes to its
+//   own deque, which it works through before anything else. A worker whose deque is empty steals
+//   from the other deques, and only then takes an entry from the ring. What goes to the deques is
+//   follow-up work: ReceiveAndSend() adds its connection back after each step, so the next step
+//   of a busy connection is stolen by an idle worker instead of waiting for the one that ran the last.
+//   A worker takes a single entry from the ring: the others would wait in its deque while it blocks
+//   in send() or on the disk, instead of going to the next free worker.
+// The ring still takes the entries added by the accepting thread, which owns no deque.
+// Every worker has a platform_work_queue of its own, which is what its callbacks receive, so that
+// LinuxAddEntry() knows whose deque to push to.
+struct linux_work_scheduler;
+struct linux_worker;
+
+struct platform_work_queue
+{
+    linux_work_scheduler *Scheduler;
+    linux_worker *Worker;  // 0 for the accepting thread
+};
+
+struct alignas(LINUX_PAGE_SIZE) linux_worker
+{
+    work_deque Deque;
+    platform_work_queue Queue;
+    u32 RandomState;  // picks the first deque to steal from
+    s32 CPU;          // the CPU the worker pins itself to, -1 for none
+    u32 Node;         // its node index
+    u32 SpinLimit;    // how long it spins before it parks, see LinuxWaitForWork()
+    u32 volatile Running;  // whether a thread runs this worker, see LinuxStartWorker()
+    b32 StartedLater;      // its thread came from LinuxStartWorker(), and clears Starting once it runs
+};
+
+// NOTE(vincent): Idle workers park on a futex instead of a semaphore. A worker that runs out of work
+// first spins for a while, counted in SpinnerCount, looking for work. Then it counts itself in SleeperCount
+// and sleeps on WakeSequence. Producers only make a syscall when somebody is asleep and nobody is spinning:
+// they bump WakeSequence and wake one thread. A spinner that finds work and was the last one wakes a sleeper
+// in its place, so that someone keeps looking. So under load, adding an entry mostly costs no syscall
+// at all, where sem_post() and sem_wait() cost one each every time the count hit 0.
+// SpinMax is 0 with a single CPU: the producer can't run while we spin, so we park right away.
+//
+// With max_threads, the pool is elastic: Workers has room for the most threads we may run, but only
+// MinRunningCount of them start up front. LinuxStartWorker() starts one more when entries pile up
+// while every worker is busy, or when the ring hasn't moved for a while (see LinuxRunWorkQueueMode()),
+// one thread at a time. A worker above MinRunningCount that stays parked for IdleTimeout seconds exits.
+// Stopped workers keep their slot, with an empty deque, so the thieves don't need to know about them.
+struct linux_work_scheduler
+{
+    work_ring Ring;
+    alignas(CACHE_LINE_SIZE) u32 volatile SpinnerCount;
+    u32 volatile SleeperCount;
+    alignas(CACHE_LINE_SIZE) u32 volatile WakeSequence;  // the futex word
+    alignas(CACHE_LINE_SIZE) u32 volatile ParkCount;     // futex waits and wakes, for the benchmark
+    u32 volatile WakeCount;
+    alignas(CACHE_LINE_SIZE) u32 volatile RunningCount;
+    u32 volatile Starting;   // a thread is being started
+    b32 Stealing;
+    b32 Elastic;
+    u32 WorkerCount;         // slots in Workers, running or not
+    u32 MinRunningCount;
+    u32 IdleTimeout;         // seconds, 0 for workers that never exit
+    u32 SpinMax;
+    int WatchFile;           // the epoll set of the accepting thread, see LinuxWatchConnection()
+    linux_worker Workers[MAX_THREAD_COUNT];
+};
+
+internal PLATFORM_WAIT_ON_ADDRESS(LinuxWaitOnAddress);
+internal PLATFORM_WAKE_ON_ADDRESS(LinuxWakeOnAddress);
+
+internal void
+LinuxWakeWorker(linux_work_scheduler *Scheduler)
+{
+    AtomicAddU32(&Scheduler->WakeSequence, 1);
+    AtomicAddU32(&Scheduler->WakeCount, 1);
+    LinuxWakeOnAddress(&Scheduler->WakeSequence);
+}
+
+internal void *ThreadProc(void *Arg);
+
+internal void
+LinuxStartWorker(linux_work_scheduler *Scheduler)
+{
+    // NOTE(vincent): Any thread may call this. Only one thread starts at a time: the new thread clears
+    // Starting once it runs, so a burst of entries doesn't start every thread at once before the first
+    // one had a chance to help.
+    if (AtomicCompareExchangeU32(&Scheduler->Starting, 0, 1) != 0)
+        return;
+    for (u32 Index = 0; Index < Scheduler->WorkerCount; Index++)
+    {
+        linux_worker *Worker = Scheduler->Workers + Index;
+        if (AtomicCompareExchangeU32(&Worker->Running, 0, 1) == 0)
+        {
+            AtomicAddU32(&Scheduler->RunningCount, 1);
+            Worker->StartedLater = true;
+            pthread_attr_t Attributes;
+            pthread_attr_init(&Attributes);
+            pthread_attr_setdetachstate(&Attributes, PTHREAD_CREATE_DETACHED);
+            pthread_t ThreadID;
+            int Error = pthread_create(&ThreadID, &Attributes, ThreadProc, Worker);
+            pthread_attr_destroy(&Attributes);
+            if (Error == 0)
+                return;
+            
+            errno = Error;
+            perror("pthread_create() failed");
+            Worker->StartedLater = false;
+            AtomicAddU32(&Scheduler->RunningCount, (u32)-1);
+            AtomicStoreU32(&Worker->Running, 0);
+            break;
+        }
+    }
+    AtomicStoreU32(&Scheduler->Starting, 0);
+}
+
+internal b32
+LinuxAddEntry(platform_work_queue *Queue, platform_work_queue_callback *Callback, void *Data)
+{
+    // NOTE(vincent): Any thread may add entries, workers included.
+    linux_work_scheduler *Scheduler = Queue->Scheduler;
+    b32 Added = false;
+    u32 Backlog = 0;
+    if (Scheduler->Stealing && Queue->Worker)
+    {
+        Added = PushWorkDeque(&Queue->Worker->Deque, Callback, Data);
+        Backlog = WorkDequeLength(&Queue->Worker->Deque);
+    }
+    else
+    {
+        Added = PushWorkEntry(&Scheduler->Ring, Callback, Data);
+        Backlog = WorkRingLength(&Scheduler->Ring);
+    }
+    if (Added)
+    {
+        // NOTE(vincent): The fence orders our push before the loads of the counts. A worker going
+        // to sleep does the opposite, so either it sees the entry, or we see it and wake it up.
+        // A spinner sees the entry before it gives up, or in its last look before it parks.
+        AtomicFence();
+        b32 NobodySpins = !AtomicLoadU32(&Scheduler->SpinnerCount);
+        b32 SomebodySleeps = AtomicLoadU32(&Scheduler->SleeperCount);
+        if (NobodySpins && SomebodySleeps)
+            LinuxWakeWorker(Scheduler);
+        else if (NobodySpins && Scheduler->Elastic && Backlog >= WORKER_GROW_BACKLOG &&
+                 AtomicLoadU32(&Scheduler->RunningCount) < Scheduler->WorkerCount)
+            LinuxStartWorker(Scheduler);
+    }
+    return Added;
+}
+
+internal b32
+LinuxStealWorkEntry(linux_work_scheduler *Scheduler, linux_worker *Thief, platform_work_queue_entry *Result)
+{
+    // NOTE(vincent): Thieves start at a random deque, so that they don't all line up on the same one.
+    u32 Start = 0;
+    if (Thief)
+    {
+        Thief->RandomState ^= Thief->RandomState << 13;
+        Thief->RandomState ^= Thief->RandomState >> 17;
+        Thief->RandomState ^= Thief->RandomState << 5;
+        Start = Thief->RandomState;
+    }
+    for (u32 Index = 0; Index < Scheduler->WorkerCount; Index++)
+    {
+        linux_worker *Victim = Scheduler->Workers + (Start + Index) % Scheduler->WorkerCount;
+        if (Victim != Thief && StealWorkDeque(&Victim->Deque, Result))
+            return true;
+    }
+    return false;
+}
+
+internal b32
+LinuxDoNextWorkQueueEntry(platform_work_queue *Queue)
+{
+    linux_work_scheduler *Scheduler = Queue->Scheduler;
+    linux_worker *Worker = Queue->Worker;
+    b32 WeShouldSleep = false;
+    platform_work_queue_entry Entry;
+    b32 Found = false;
+    if (Scheduler->Stealing)
+    {
+        if (Worker)
+            Found = PopWorkDeque(&Worker->Deque, &Entry);
+        if (!Found)
+            Found = LinuxStealWorkEntry(Scheduler, Worker, &Entry);
+    }
+    if (!Found)
+        Found = PopWorkEntry(&Scheduler->Ring, &Entry);
+    
+    if (Found)
+        Entry.Callback(Queue, Entry.Data);
+    else
+        WeShouldSleep = true;
+    
+    return WeShouldSleep;
+}
+
+internal void LinuxPinThread(s32 CPU);
+internal void LinuxPreferNode(linux_thread_layout *Layout, void *Base, size_t Size, u32 Node);
+
+internal PLATFORM_GET_THREAD_NODE(LinuxGetThreadNode)
+{
+    return Queue->Worker ? Queue->Worker->Node : 0;
+}
+
+internal b32
+LinuxWorkIsPending(linux_work_scheduler *Scheduler)
+{
+    b32 Pending = !WorkRingLooksEmpty(&Scheduler->Ring);
+    if (Scheduler->Stealing)
+    {
+        for (u32 Index = 0; !Pending && Index < Scheduler->WorkerCount; Index++)
+            Pending = !WorkDequeLooksEmpty(&Scheduler->Workers[Index].Deque);
+    }
+    return Pending;
+}
+
+internal b32
+LinuxWaitForWork(linux_worker *Worker)
+{
+    // NOTE(vincent): Returns once there may be work: the caller looks for it again. Or returns true
+    // when the worker was idle for too long and should exit, in an elastic pool.
+    // The spin adapts to the load: when spinning found work, the next wait spins twice as long,
+    // and when we had to park anyway, the next one spins half as long. So a busy server barely
+    // ever parks, and an idle one doesn't burn its CPUs.
+    linux_work_scheduler *Scheduler = Worker->Queue.Scheduler;
+    if (Worker->SpinLimit)
+    {
+        AtomicAddU32(&Scheduler->SpinnerCount, 1);
+        for (u32 Spin = 0; Spin < Worker->SpinLimit; Spin++)
+        {
+            SpinPause();
+            if (LinuxWorkIsPending(Scheduler))
+            {
+                Worker->SpinLimit *= 2;
+                if (Worker->SpinLimit > Scheduler->SpinMax)
+                    Worker->SpinLimit = Scheduler->SpinMax;
+                if (AtomicAddU32(&Scheduler->SpinnerCount, (u32)-1) == 1 && AtomicLoadU32(&Scheduler->SleeperCount))
+                    LinuxWakeWorker(Scheduler);
+                return false;
+            }
+        }
+        AtomicAddU32(&Scheduler->SpinnerCount, (u32)-1);
+    }
+    Worker->SpinLimit /= 2;
+    if (Worker->SpinLimit < WORKER_SPIN_MIN)
+        Worker->SpinLimit = (Scheduler->SpinMax < WORKER_SPIN_MIN) ? Scheduler->SpinMax : WORKER_SPIN_MIN;
+    
+    // NOTE(vincent): We read WakeSequence before the last look at the queue: a producer that pushed
+    // after that look saw us in SleeperCount and moved WakeSequence, so the futex returns at once.
+    AtomicAddU32(&Scheduler->SleeperCount, 1);
+    AtomicFence();
+    u32 Sequence = AtomicLoadU32(&Scheduler->WakeSequence);
+    b32 TimedOut = false;
+    if (!LinuxWorkIsPending(Scheduler))
+    {
+        AtomicAddU32(&Scheduler->ParkCount, 1);
+        if (Scheduler->Elastic && Scheduler->IdleTimeout)
+        {
+            struct timespec Timeout = {};
+            Timeout.tv_sec = Scheduler->IdleTimeout;
+            long Result = syscall(SYS_futex, &Scheduler->WakeSequence, FUTEX_WAIT_PRIVATE, Sequence, &Timeout, 0, 0);
+            TimedOut = (Result == -1 && errno == ETIMEDOUT);
+        }
+        else
+            LinuxWaitOnAddress(&Scheduler->WakeSequence, Sequence);
+    }
+    AtomicAddU32(&Scheduler->SleeperCount, (u32)-1);
+    
+    // NOTE(vincent): A producer may have counted us as a sleeper and woken nobody, now that we aren't
+    // one anymore. Its entry is visible after the fence, so we stay for it.
+    b32 Retire = false;
+    if (TimedOut)
+    {
+        AtomicFence();
+        if (!LinuxWorkIsPending(Scheduler))
+        {
+            u32 Running = AtomicLoadU32(&Scheduler->RunningCount);
+            while (!Retire && Running > Scheduler->MinRunningCount)
+            {
+                u32 Previous = AtomicCompareExchangeU32(&Scheduler->RunningCount, Running, Running - 1);
+                Retire = (Previous == Running);
+                Running = Previous;
+            }
+        }
+    }
+    return Retire;
+}
+
+internal void *
+ThreadProc(void *Arg)
+{
+    linux_worker *Worker = (linux_worker *)Arg;
+    platform_work_queue *Queue = &Worker->Queue;
+    linux_work_scheduler *Scheduler = Queue->Scheduler;
+    LinuxPinThread(Worker->CPU);
+    if (Worker->StartedLater)
+    {
+        // NOTE(vincent): Not the threads LinuxMakeQueue() starts: one of them may run for the first
+        // time while another thread is being started, which would let a third one start meanwhile.
+        Worker->StartedLater = false;
+        AtomicStoreU32(&Scheduler->Starting, 0);
+        printf("Work queue: started a worker, %u workers running\n", AtomicLoadU32(&Scheduler->RunningCount));
+    }
+    for (;;)
+    {
+        if (LinuxDoNextWorkQueueEntry(Queue) && LinuxWaitForWork(Worker))
+            break;
+    }
+    printf("Work queue: a worker was idle for %u seconds and exited, %u workers running\n",
+           Scheduler->IdleTimeout, AtomicLoadU32(&Scheduler->RunningCount));
+    AtomicStoreU32(&Worker->Running, 0);  // the slot may be reused from here on
+    return 0;
+}
+
+internal void
+LinuxMakeQueue(platform_work_queue *Queue, linux_thread_layout *Layout, b32 Stealing, u32 IdleTimeout)
+{
+    // NOTE(vincent): Queue is the accepting thread's queue, the workers get theirs here.
+    // The workers are threads 1 and up of Layout, and each one's struct lives on its node:
+    // we set the policy of its pages before anything touches them. Only Layout->StartThreadCount
+    // start now, the others are for when the pool grows.
+    u32 ThreadCount = Layout->ThreadCount - 1;
+    u32 StartCount = Layout->StartThreadCount - 1;
+    Assert(ThreadCount <= ArrayCount(Queue->Scheduler->Workers));
+    linux_work_scheduler *Scheduler = 
+        (linux_work_scheduler *)mmap(0, sizeof(linux_work_scheduler), PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (Scheduler == MAP_FAILED)
+    {
+        perror("mmap() of the work queue failed");
+        exit(1);
+    }
+    Queue->Scheduler = Scheduler;
+    Queue->Worker = 0;
+    
+    InitializeWorkRing(&Scheduler->Ring);
+    Scheduler->Stealing = Stealing;
+    Scheduler->WorkerCount = ThreadCount;
+    Scheduler->MinRunningCount = StartCount;
+    Scheduler->RunningCount = StartCount;
+    Scheduler->Starting = 0;
+    Scheduler->Elastic = (StartCount < ThreadCount);
+    Scheduler->IdleTimeout = IdleTimeout;
+    Scheduler->SpinnerCount = 0;
+    Scheduler->SleeperCount = 0;
+    Scheduler->WakeSequence = 0;
+    Scheduler->SpinMax = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? WORKER_SPIN_MAX : 0;
+    
+    for (u32 ThreadIndex = 0; ThreadIndex < ThreadCount; ThreadIndex++)
+    {
+        linux_worker *Worker = Scheduler->Workers + ThreadIndex;
+        LinuxPreferNode(Layout, Worker, sizeof(*Worker), Layout->Nodes[ThreadIndex + 1]);
+        Worker->CPU = Layout->CPUs[ThreadIndex + 1];
+        Worker->Node = Layout->Nodes[ThreadIndex + 1];
+        InitializeWorkDeque(&Worker->Deque);
+        Worker->Queue.Scheduler = Scheduler;
+        Worker->Queue.Worker = Worker;
+        Worker->RandomState = 2463534242u + ThreadIndex * 0x9E3779B9u;  // xorshift32 state can't be 0
+        Worker->SpinLimit = Scheduler->SpinMax ? WORKER_SPIN_MIN : 0;
+        Worker->Running = (ThreadIndex < StartCount);
+        Worker->StartedLater = false;
+    }
+    // NOTE(vincent): Threads start after all the workers are set up, as they may steal from any of them.
+    for (u32 ThreadIndex = 0; ThreadIndex < StartCount; ThreadIndex++)
+    {
+        pthread_t ThreadID;
+        pthread_create(&ThreadID,
+                       0, // const pthread_attr_t *restrict attr,
+                       ThreadProc,
+                       Scheduler->Workers + ThreadIndex);
+    }
+}
+
+// NOTE(vincent): Contention benchmark of the work ring, for builds with RUN_BENCHMARKS.
+// Producers push as fast as they can (retrying when the ring is full), consumers pop as fast
+// as they can, and we time the whole thing for a few producer/consumer counts.
+// Threads yield when the ring is full or empty, so the runs with more threads than cores
+// still finish in reasonable time.
+struct work_ring_benchmark
+{
+    work_ring *Ring;
+    u32 ItemsPerProducer;
+    u32 volatile Started;   // threads wait for this, so that they all start together
+    u32 volatile FullCount; // how many pushes found the ring full
+};
+
+internal PLATFORM_WORK_QUEUE_CALLBACK(BenchmarkNothing)
+{
+}
+
+internal void *
+BenchmarkProducerProc(void *Arg)
+{
+    work_ring_benchmark *Benchmark = (work_ring_benchmark *)Arg;
+    while (!AtomicLoadU32(&Benchmark->Started))
+        SpinPause();
+    u32 FullCount = 0;
+    for (u32 ItemIndex = 0; ItemIndex < Benchmark->ItemsPerProducer; ItemIndex++)
+    {
+        while (!PushWorkEntry(Benchmark->Ring, BenchmarkNothing, 0))
+        {
+            FullCount++;
+            sched_yield();
+        }
+    }
+    AtomicAddU32(&Benchmark->FullCount, FullCount);
+    return 0;
+}
+
+internal void *
+BenchmarkConsumerProc(void *Arg)
+{
+    // NOTE(vincent): Stops on an entry without callback, which the main thread pushes
+    // after all the producers are done.
+    work_ring_benchmark *Benchmark = (work_ring_benchmark *)Arg;
+    while (!AtomicLoadU32(&Benchmark->Started))
+        SpinPause();
+    for (;;)
+    {
+        platform_work_queue_entry Entry;
+        if (PopWorkEntry(Benchmark->Ring, &Entry))
+        {
+            if (!Entry.Callback)
+                break;
+            Entry.Callback(0, Entry.Data);
+        }
+        else
+            sched_yield();
+    }
+    return 0;
+}
+
+internal void
+LinuxBenchmarkWorkRing()
+{
+    work_ring *Ring = (work_ring *)mmap(0, sizeof(work_ring), PROT_READ | PROT_WRITE,
+                                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (Ring == MAP_FAILED)
+        return;
+    
+    u32 ThreadCounts[][2] = { {1, 1}, {1, 3}, {2, 2}, {3, 1}, {4, 4}, {8, 8} };  // producers, consumers
+    u32 TotalItems = 1 << 22;
+    printf("Work ring benchmark, %u entries, %ld cores:\n", TotalItems, sysconf(_SC_NPROCESSORS_ONLN));
+    for (u32 RunIndex = 0; RunIndex < ArrayCount(ThreadCounts); RunIndex++)
+    {
+        u32 ProducerCount = ThreadCounts[RunIndex][0];
+        u32 ConsumerCount = ThreadCounts[RunIndex][1];
+        InitializeWorkRing(Ring);
+        work_ring_benchmark Benchmark = {};
+        Benchmark.Ring = Ring;
+        Benchmark.ItemsPerProducer = TotalItems / ProducerCount;
+        
+        pthread_t Producers[8];
+        pthread_t Consumers[8];
+        for (u32 Index = 0; Index < ProducerCount; Index++)
+            pthread_create(Producers + Index, 0, BenchmarkProducerProc, &Benchmark);
+        for (u32 Index = 0; Index < ConsumerCount; Index++)
+            pthread_create(Consumers + Index, 0, BenchmarkConsumerProc, &Benchmark);
+        
+        struct timespec Start, End;
+        clock_gettime(CLOCK_MONOTONIC, &Start);
+        AtomicStoreU32(&Benchmark.Started, 1);
+        for (u32 Index = 0; Index < ProducerCount; Index++)
+            pthread_join(Producers[Index], 0);
+        for (u32 Index = 0; Index < ConsumerCount; Index++)
+        {
+            while (!PushWorkEntry(Ring, 0, 0))
+                SpinPause();
+        }
+        for (u32 Index = 0; Index < ConsumerCount; Index++)
+            pthread_join(Consumers[Index], 0);
+        clock_gettime(CLOCK_MONOTONIC, &End);
+        
+        f64 Seconds = (f64)(End.tv_sec - Start.tv_sec) + (f64)(End.tv_nsec - Start.tv_nsec) / 1e9;
+        u32 ItemCount = Benchmark.ItemsPerProducer * ProducerCount;
+        printf("  %u producers, %u consumers: %6.2f M entries/s, %6.1f ns each, ring full %u times\n",
+               ProducerCount, ConsumerCount, ItemCount / Seconds / 1e6, Seconds * 1e9 / ItemCount,
+               Benchmark.FullCount);
+    }
+    munmap(Ring, sizeof(work_ring));
+}
+
+// NOTE(vincent): Same thing for the work-stealing deque: the owner pushes entries and pops them
+// back while thieves steal from the other end. Each entry counts itself in Seen, so we also check
+// that every entry ran exactly once.
+struct work_deque_benchmark
+{
+    work_deque *Deque;
+    u32 volatile Started;
+    u32 volatile Done;         // set by the owner once the deque is empty for good
+    u32 volatile StolenCount;
+};
+
+internal PLATFORM_WORK_QUEUE_CALLBACK(BenchmarkCount)
+{
+    u8 *Seen = (u8 *)Data;
+    (*Seen)++;
+}
+
+internal void *
+BenchmarkThiefProc(void *Arg)
+{
+    work_deque_benchmark *Benchmark = (work_deque_benchmark *)Arg;
+    while (!AtomicLoadU32(&Benchmark->Started))
+        SpinPause();
+    u32 StolenCount = 0;
+    while (!AtomicLoadU32(&Benchmark->Done))
+    {
+        platform_work_queue_entry Entry;
+        if (StealWorkDeque(Benchmark->Deque, &Entry))
+        {
+            Entry.Callback(0, Entry.Data);
+            StolenCount++;
+        }
+        else
+            sched_yield();
+    }
+    AtomicAddU32(&Benchmark->StolenCount, StolenCount);
+    return 0;
+}
+
+internal void
+LinuxBenchmarkWorkDeque()
+{
+    u32 TotalItems = 1 << 22;
+    size_t MemorySize = sizeof(work_deque) + TotalItems;
+    work_deque *Deque = (work_deque *)mmap(0, MemorySize, PROT_READ | PROT_WRITE,
+                                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (Deque == MAP_FAILED)
+        return;
+    u8 *Seen = (u8 *)(Deque + 1);
+    
+    u32 ThiefCounts[] = {0, 1, 3, 7};
+    printf("Work deque benchmark, %u entries:\n", TotalItems);
+    for (u32 RunIndex = 0; RunIndex < ArrayCount(ThiefCounts); RunIndex++)
+    {
+        u32 ThiefCount = ThiefCounts[RunIndex];
+        InitializeWorkDeque(Deque);
+        memset(Seen, 0, TotalItems);
+        work_deque_benchmark Benchmark = {};
+        Benchmark.Deque = Deque;
+        
+        pthread_t Thieves[8];
+        for (u32 Index = 0; Index < ThiefCount; Index++)
+            pthread_create(Thieves + Index, 0, BenchmarkThiefProc, &Benchmark);
+        
+        struct timespec Start, End;
+        clock_gettime(CLOCK_MONOTONIC, &Start);
+        AtomicStoreU32(&Benchmark.Started, 1);
+        // NOTE(vincent): The owner pushes a few entries at a time, then pops one,
+        // like a worker that spawns follow-up work.
+        u32 OwnerCount = 0;
+        platform_work_queue_entry Entry;
+        for (u32 ItemIndex = 0; ItemIndex < TotalItems; ItemIndex++)
+        {
+            while (!PushWorkDeque(Deque, BenchmarkCount, Seen + ItemIndex))
+            {
+                if (PopWorkDeque(Deque, &Entry))
+                {
+                    Entry.Callback(0, Entry.Data);
+                    OwnerCount++;
+                }
+            }
+            if ((ItemIndex & 3) == 3 && PopWorkDeque(Deque, &Entry))
+            {
+                Entry.Callback(0, Entry.Data);
+                OwnerCount++;
+            }
+        }
+        while (PopWorkDeque(Deque, &Entry))
+        {
+            Entry.Callback(0, Entry.Data);
+            OwnerCount++;
+        }
+        AtomicStoreU32(&Benchmark.Done, 1);
+        for (u32 Index = 0; Index < ThiefCount; Index++)
+            pthread_join(Thieves[Index], 0);
+        clock_gettime(CLOCK_MONOTONIC, &End);
+        
+        u32 WrongCount = 0;
+        for (u32 ItemIndex = 0; ItemIndex < TotalItems; ItemIndex++)
+            WrongCount += (Seen[ItemIndex] != 1);
+        f64 Seconds = (f64)(End.tv_sec - Start.tv_sec) + (f64)(End.tv_nsec - Start.tv_nsec) / 1e9;
+        printf("  %u thieves: %6.2f M entries/s, %6.1f ns each, %u popped by the owner, %u stolen, %u not run exactly once\n",
+               ThiefCount, TotalItems / Seconds / 1e6, Seconds * 1e9 / TotalItems, OwnerCount,
+               Benchmark.StolenCount, WrongCount);
+    }
+    munmap(Deque, MemorySize);
+}
+
+// NOTE(vincent): Latency benchmark of the worker parking, for builds with RUN_BENCHMARKS. The main thread
+// adds entries to a real scheduler, like the accepting thread does, with a fixed gap between them:
+// back to back, then lighter and lighter loads. Each entry carries the time it was added, and the
+// worker that runs it replaces that with how long it waited. We also count the futex waits and wakes,
+// which are the only syscalls the queue makes.
+// The scheduler and its workers stay around, parked, for the rest of the process.
+struct parking_benchmark_entry
+{
+    u64 Nanoseconds;       // when it was added, then how long it waited
+    u32 volatile *DoneCount;
+};
+
+internal u64
+LinuxBenchmarkNow()
+{
+    struct timespec Now;
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    return (u64)Now.tv_sec * 1000000000ull + (u64)Now.tv_nsec;
+}
+
+internal PLATFORM_WORK_QUEUE_CALLBACK(BenchmarkLatency)
+{
+    parking_benchmark_entry *Entry = (parking_benchmark_entry *)Data;
+    Entry->Nanoseconds = LinuxBenchmarkNow() - Entry->Nanoseconds;
+    AtomicAddU32(Entry->DoneCount, 1);
+}
+
+internal int
+CompareU64(const void *A, const void *B)
+{
+    u64 First = *(u64 *)A;
+    u64 Second = *(u64 *)B;
+    return (First > Second) - (First < Second);
+}
+
+internal void
+LinuxBenchmarkParking()
+{
+    u32 WorkerCount = 4;
+    u32 MaxEntryCount = 20000;
+    size_t MemorySize = MaxEntryCount * (sizeof(parking_benchmark_entry) + sizeof(u64));
+    parking_benchmark_entry *Entries = 
+        (parking_benchmark_entry *)mmap(0, MemorySize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (Entries == MAP_FAILED)
+        return;
+    u64 *Latencies = (u64 *)(Entries + MaxEntryCount);
+    
+    linux_thread_layout Layout = {};
+    Layout.ThreadCount = WorkerCount + 1;
+    Layout.StartThreadCount = Layout.ThreadCount;
+    for (u32 ThreadIndex = 0; ThreadIndex < Layout.ThreadCount; ThreadIndex++)
+        Layout.CPUs[ThreadIndex] = -1;
+    Layout.NodeCount = 1;
+    Layout.NodeIDs[0] = -1;
+    platform_work_queue Queue;
+    LinuxMakeQueue(&Queue, &Layout, false, 0);
+    linux_work_scheduler *Scheduler = Queue.Scheduler;
+    
+    u64 Gaps[] = {0, 1000, 10000, 100000, 1000000};  // nanoseconds between two entries
+    printf("Worker parking benchmark, %u workers, %ld cores, spinning up to %u times:\n",
+           WorkerCount, sysconf(_SC_NPROCESSORS_ONLN), Scheduler->SpinMax);
+    for (u32 RunIndex = 0; RunIndex < ArrayCount(Gaps); RunIndex++)
+    {
+        u64 Gap = Gaps[RunIndex];
+        u32 EntryCount = MaxEntryCount;
+        if (Gap && EntryCount > 500000000 / Gap)
+            EntryCount = (u32)(500000000 / Gap);  // half a second per run at most
+        
+        u32 volatile DoneCount = 0;
+        u32 ParkCount = AtomicLoadU32(&Scheduler->ParkCount);
+        u32 WakeCount = AtomicLoadU32(&Scheduler->WakeCount);
+        u64 Next = LinuxBenchmarkNow();
+        for (u32 EntryIndex = 0; EntryIndex < EntryCount; EntryIndex++)
+        {
+            while (LinuxBenchmarkNow() < Next)
+                SpinPause();
+            parking_benchmark_entry *Entry = Entries + EntryIndex;
+            Entry->DoneCount = &DoneCount;
+            Entry->Nanoseconds = LinuxBenchmarkNow();
+            while (!LinuxAddEntry(&Queue, BenchmarkLatency, Entry))
+                sched_yield();
+            Next = Entry->Nanoseconds + Gap;
+        }
+        while (AtomicLoadU32(&DoneCount) != EntryCount)
+            sched_yield();
+        ParkCount = AtomicLoadU32(&Scheduler->ParkCount) - ParkCount;
+        WakeCount = AtomicLoadU32(&Scheduler->WakeCount) - WakeCount;
+        
+        u64 Total = 0;
+        for (u32 EntryIndex = 0; EntryIndex < EntryCount; EntryIndex++)
+        {
+            Latencies[EntryIndex] = Entries[EntryIndex].Nanoseconds;
+            Total += Latencies[EntryIndex];
+        }
+        qsort(Latencies, EntryCount, sizeof(u64), CompareU64);
+        printf("  gap %7llu ns, %5u entries: latency %8.1f us average, %8.1f us median, %8.1f us p99, %8.1f us max, "
+               "%.3f wakes and %.3f parks per entry\n",
+               (unsigned long long)Gap, EntryCount, Total / 1000.0 / EntryCount,
+               Latencies[EntryCount / 2] / 1000.0, Latencies[EntryCount - EntryCount / 100 - 1] / 1000.0,
+               Latencies[EntryCount - 1] / 1000.0, (f64)WakeCount / EntryCount, (f64)ParkCount / EntryCount);
+    }
+    munmap(Entries, MemorySize);
+}
+
+internal b32
+HandleReceiveError(int BytesReceived, SOCKET ClientSocket)
+{
+    b32 Success = true;
+    if (BytesReceived < 0)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            perror("recv failed");
+        Success = false;
+    }
+    return Success;
+}
+
+internal b32
+HandleSendError(int BytesSent, SOCKET ClientSocket)
+{
+    b32 Success = true;
+    if (BytesSent == -1)
+    {
+        perror("send failed");
+        Success = false;
+    }
+    return Success;
+}
+
+internal void
+ShutdownConnection(SOCKET ClientSocket)
+{
+    close(ClientSocket);
+}
+
+internal PLATFORM_WAIT_ON_ADDRESS(LinuxWaitOnAddress)
+{
+    // NOTE(vincent): The kernel checks *Address == Expected and puts us to sleep atomically,
+    // so a wake that comes after our last check can't be missed.
+    syscall(SYS_futex, Address, FUTEX_WAIT_PRIVATE, Expected, 0, 0, 0);
+}
+
+internal PLATFORM_WAKE_ON_ADDRESS(LinuxWakeOnAddress)
+{
+    syscall(SYS_futex, Address, FUTEX_WAKE_PRIVATE, 1, 0, 0, 0);
+}
+
+internal PLATFORM_SEND_FILE(LinuxSendFile)
+{
+    // NOTE(vincent): The kernel moves the page cache pages of the file to the socket,
+    // the bytes never come up to user space. errno is left as sendfile() set it.
+    off_t FileOffset = (off_t)Offset;
+    return sendfile(ClientSocket, fileno(File), &FileOffset, Count);
+}
+
+internal PLATFORM_OPEN_BENEATH(LinuxOpenBeneath)
+{
+    // NOTE(vincent): RESOLVE_BENEATH makes the kernel fail the lookup with EXDEV on "..", absolute symlinks,
+    // or anything else that would leave Directory. openat2() came with Linux 5.6: before that, we make
+    // do with openat(), and server.cpp refuses ".." in paths anyway.
+    opened_file Result = {};
+    struct open_how How = {};
+    How.flags = O_RDONLY | O_CLOEXEC;
+    How.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+    int File = (int)syscall(SYS_openat2, (int)Directory, RelativePath, &How, sizeof(How));
+    if (File < 0 && errno == ENOSYS)
+        File = openat((int)Directory, RelativePath, O_RDONLY | O_CLOEXEC);
+    if (File < 0)
+        return Result;
+    
+    struct stat Status;
+    if (fstat(File, &Status) == 0 && S_ISREG(Status.st_mode) && Status.st_size <= 0xFFFFFFFF)
+        Result.Handle = fdopen(File, "rb");
+    if (Result.Handle)
+        Result.Size = (u32)Status.st_size;
+    else
+        close(File);
+    return Result;
+}
+
+internal PLATFORM_STAT_BENEATH(LinuxStatBeneath)
+{
+    // NOTE(vincent): fstatat() has no RESOLVE_BENEATH, so a symlink may take it out of Directory. It only
+    // tells whether something is there and when it changed: what we read or send always comes from
+    // LinuxOpenBeneath(), which refuses that symlink. And server.cpp refuses ".." in paths.
+    return fstatat((int)Directory, RelativePath, Status, 0) == 0;
+}
+
+internal void
+LinuxOpenVirtualHosts(server_memory *ServerMemory, parsed_config_file_result *Config)
+{
+    // NOTE(vincent): Every directory under the root is a site, see server_vhosts.cpp. The descriptors are
+    // O_PATH: they are only ever used to resolve paths from, and stay open as long as the server runs.
+    DIR *Listing = opendir(Config->Root);
+    if (!Listing)
+    {
+        perror("Virtual hosts: can't open the root directory, every request will get a 400");
+        return;
+    }
+    u32 Count = 0;
+    for (struct dirent *Entry = readdir(Listing); Entry; Entry = readdir(Listing))
+    {
+        if (Entry->d_name[0] == '.')
+            continue;
+        int Directory = openat(dirfd(Listing), Entry->d_name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (Directory < 0)
+            continue;  // a file, not a site
+        if (AddVirtualHost(ServerMemory, Entry->d_name, Directory))
+            Count++;
+        else
+        {
+            printf("Virtual hosts: %s has the same name as another site, ignored\n", Entry->d_name);
+            close(Directory);
+        }
+    }
+    closedir(Listing);
+    printf("Virtual hosts: %u sites under %s\n", Count, Config->Root);
+}
+
+internal u64
+LinuxGetMilliseconds()
+{
+    // NOTE(vincent): Only used for idle timeouts, so the coarse clock is plenty.
+    struct timespec Time;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &Time);
+    return (u64)Time.tv_sec * 1000 + (u64)Time.tv_nsec / 1000000;
+}
+
+internal PLATFORM_WATCH_CONNECTION(LinuxWatchConnection)
+{
+    // NOTE(vincent): From a worker. The socket goes to the epoll set of the accepting thread, armed for one
+    // event with EPOLLONESHOT, so the connection goes back to the work queue once. It stays in the set, disarmed,
+    // until it closes, so the next time only takes EPOLL_CTL_MOD. We set Watched before we arm it: from then on,
+    // the connection belongs to the accepting thread, which may shut the socket down for the idle timeout.
+    linux_work_scheduler *Scheduler = Queue->Scheduler;
+    SOCKET Socket = Connection->Socket;
+    Connection->LastActivity = LinuxGetMilliseconds();
+    Connection->WatchData = Data;
+    AtomicStoreU32(&Connection->Watched, 1);
+    
+    struct epoll_event Event = {};
+    Event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    Event.data.ptr = Connection;
+    if (epoll_ctl(Scheduler->WatchFile, EPOLL_CTL_MOD, Socket, &Event) == 0)
+        return true;
+    if (errno == ENOENT && epoll_ctl(Scheduler->WatchFile, EPOLL_CTL_ADD, Socket, &Event) == 0)
+        return true;
+    
+    perror("epoll_ctl() failed");
+    AtomicStoreU32(&Connection->Watched, 0);
+    return false;
+}
+
+internal void
+LinuxShutdownIdleConnections(connection_slots *Slots, u64 Now, u64 IdleTimeout)
+{
+    // NOTE(vincent): From the accepting thread, the only one that clears Watched: while it is set, nobody else
+    // touches the connection, so its socket stays open. shutdown() makes the socket readable, and the worker
+    // that gets the connection back reads the end of the stream and closes it.
+    for (u32 SlotIndex = 0; SlotIndex < Slots->Count; SlotIndex++)
+    {
+        connection *Connection = Slots->Connections + SlotIndex;
+        if (AtomicLoadU32(&Connection->Watched) && Now - Connection->LastActivity >= IdleTimeout)
+            shutdown(Connection->Socket, SHUT_RDWR);
+    }
+}
+
+internal PLATFORM_COUNT_HUGE_PAGES(LinuxCountHugePages)
+{
+    // NOTE(vincent): The kernel only reports huge pages per mapping, in /proc/self/smaps: we add up
+    // the counters of every mapping that overlaps Base..Base+Size. Mappings are never split by us,
+    // but the kernel splits a reservation where the protection or the advice changes,
+    // hence more than one mapping per region.
+    size_t Result = 0;
+    FILE *Smaps = fopen("/proc/self/smaps", "r");
+    if (!Smaps)
+        return 0;
+    
+    unsigned long RegionStart = (unsigned long)Base;
+    unsigned long RegionEnd = RegionStart + Size;
+    b32 InRegion = false;
+    char Line[512];
+    while (fgets(Line, sizeof(Line), Smaps))
+    {
+        unsigned long MappingStart, MappingEnd;
+        size_t Kilobytes;
+        if (sscanf(Line, "%lx-%lx ", &MappingStart, &MappingEnd) == 2)
+            InRegion = (MappingStart < RegionEnd && MappingEnd > RegionStart);
+        else if (InRegion &&
+                 (sscanf(Line, "AnonHugePages: %zu kB", &Kilobytes) == 1 ||
+                  sscanf(Line, "Private_Hugetlb: %zu kB", &Kilobytes) == 1 ||
+                  sscanf(Line, "Shared_Hugetlb: %zu kB", &Kilobytes) == 1))
+            Result += Kilobytes*1024;
+    }
+    fclose(Smaps);
+    return Result;
+}
+
+internal huge_page_backing
+LinuxAdviseHugePages(void *Base, size_t Size)
+{
+    // NOTE(vincent): Transparent huge pages: the kernel backs the 2 MB aligned parts of the range
+    // with huge pages when they are first touched, or later from khugepaged, if it has some to give.
+    // Nothing is set aside, so this can't fail for lack of huge pages, only if THP is compiled out.
+    if (madvise(Base, Size, MADV_HUGEPAGE) != 0)
+    {
+        perror("madvise(MADV_HUGEPAGE) failed, using 4 KB pages");
+        return HugePageBacking_None;
+    }
+    return HugePageBacking_Transparent;
+}
+
+internal void
+LinuxAdviseServerArena(server_memory *ServerMemory, b32 HugePages)
+{
+    // NOTE(vincent): The server memory is reserved before we know the config, so it only ever gets
+    // transparent huge pages, for what the arena commits from here on.
+    huge_page_backing Backing = HugePageBacking_None;
+    if (HugePages)
+        Backing = LinuxAdviseHugePages(ServerMemory->Storage, ServerMemory->StorageSize);
+    AddMemoryRegion(ServerMemory, "server arena", ServerMemory->Storage, ServerMemory->StorageSize, Backing);
+}
+
+internal b32
+LinuxAllocateServerMemory(server_memory *ServerMemory)
+{
+    // NOTE(vincent): Address space only, the server arena commits what it uses.
+    void *BaseAddress = 0;
+    ServerMemory->StorageSize = SERVER_STORAGE_RESERVE;
+    ServerMemory->Storage = ReserveMemory(BaseAddress, ServerMemory->StorageSize);
+    if (!ServerMemory->Storage)
+    {
+        perror("mmap failed");
+        return false;
+    }
+    return true;
+}
+
+internal void
+LinuxAllocateFileCache(server_memory *ServerMemory, u32 CacheSizeInMegabytes, b32 HugePages)
+{
+    // NOTE(vincent): Pages are only backed by physical memory once the cache writes to them.
+    // With huge pages, we first try the pool of explicit huge pages (vm.nr_hugepages), which the
+    // cache gets all of at once, rounded up to whole huge pages. If the pool is too small,
+    // it falls back to regular pages with the transparent huge page advice.
+    size_t CacheSize = (size_t)Megabytes(CacheSizeInMegabytes);
+    void *CacheMemory = 0;
+    huge_page_backing Backing = HugePageBacking_None;
+    if (CacheSize && HugePages)
+    {
+        size_t HugeCacheSize = (CacheSize + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+        CacheMemory = mmap(0, HugeCacheSize, PROT_READ | PROT_WRITE,
+                           MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
+        if (CacheMemory == MAP_FAILED)
+        {
+            perror("mmap of the file cache with MAP_HUGETLB failed, trying transparent huge pages");
+            CacheMemory = 0;
+        }
+        else
+        {
+            CacheSize = HugeCacheSize;
+            Backing = HugePageBacking_Explicit;
+        }
+    }
+    if (CacheSize && !CacheMemory)
+    {
+        CacheMemory = mmap(0, CacheSize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (CacheMemory == MAP_FAILED)
+        {
+            perror("mmap of the file cache failed, running without it");
+            CacheMemory = 0;
+            CacheSize = 0;
+        }
+        else if (HugePages)
+            Backing = LinuxAdviseHugePages(CacheMemory, CacheSize);
+    }
+    if (CacheMemory)
+        AddMemoryRegion(ServerMemory, "file cache", CacheMemory, CacheSize, Backing);
+    InitializeServerFileCache(ServerMemory, CacheMemory, CacheSize);
+}
+
+internal b32
+LinuxAllocateConnectionSlots(server_memory *ServerMemory, b32 HugePages, linux_thread_layout *Layout)
+{
+    // NOTE(vincent): Same as the file cache: slots and slabs that no connection ever used
+    // don't cost any physical memory. Most of it is the address space of the slot arenas, 
+    // hence the reservation without swap accounting.
+    size_t SlotsMemorySize = ConnectionSlotsMemorySize(ServerMemory);
+    void *SlotsMemory = ReserveMemory(0, SlotsMemorySize);
+    if (!SlotsMemory)
+    {
+        perror("mmap of the connection slots failed");
+        return false;
+    }
+    InitializeConnectionSlots(ServerMemory, SlotsMemory, SlotsMemorySize, Layout->NodeCount);
+    
+    // NOTE(vincent): Only the slabs get the huge page advice: the slot arenas give their memory back
+    // past CONNECTION_ARENA_RETAIN, which would only split the huge pages again.
+    // Every node's share of the slabs goes on that node. The slot arenas are left to the default policy:
+    // their pages land on the node of the first thread that writes to them.
+    server_state *State = (server_state *)ServerMemory->Storage;
+    slab_allocator *Slab = &State->Slots.Slab;
+    size_t SlabSize = (size_t)Slab->SlabCount*SLAB_SIZE;
+    huge_page_backing Backing = HugePageBacking_None;
+    if (HugePages)
+        Backing = LinuxAdviseHugePages(Slab->Base, SlabSize);
+    AddMemoryRegion(ServerMemory, "connection slabs", Slab->Base, SlabSize, Backing);
+    for (u32 NodeIndex = 0; NodeIndex < Slab->NodeCount; NodeIndex++)
+    {
+        slab_node *Node = Slab->Nodes + NodeIndex;
+        LinuxPreferNode(Layout, Slab->Base + (size_t)Node->FirstSlab*SLAB_SIZE, (size_t)Node->SlabCount*SLAB_SIZE, NodeIndex);
+    }
+    return true;
+}
+
+internal SOCKET
+LinuxOpenListenSocket(char *PortString, u32 Backlog, b32 ReusePort, s32 IncomingCPU)
+{
+    // NOTE(vincent): Exits the process on failure, there is nothing to serve without a socket.
+    // With ReusePort, every socket opened on the port joins the same group, and the kernel spreads
+    // the incoming connections over them. IncomingCPU, if not -1, asks it to prefer this socket
+    // for the connections whose packets the network stack handles on that CPU.
+    struct addrinfo *AddressInfo = 0;
+    struct addrinfo Hints;
+    ZeroBytes((char *)&Hints, sizeof(Hints));
+    Hints.ai_family = AF_UNSPEC;
+    Hints.ai_socktype = SOCK_STREAM;
+    Hints.ai_protocol = IPPROTO_TCP;
+    Hints.ai_flags = AI_PASSIVE;      // "use my IP"
+    
+    // Resolve the local address and port to be used by the server
+    int AddressInfoResult = getaddrinfo(0, PortString, &Hints, &AddressInfo);
+    if (AddressInfoResult != 0) 
+    {
+        fprintf(stderr, "getaddrinfo() failed: %s\n", gai_strerror(AddressInfoResult));
+        exit(1);
+    }
+    
+    SOCKET ListenSocket = INVALID_SOCKET;
+    
+    // loop through all the results and bind to the first we can
+    struct addrinfo *P;
+    int One = 1;
+    for(P = AddressInfo; 
+        P; 
+        P = P->ai_next) 
+    {
+        if ((ListenSocket = socket(P->ai_family, P->ai_socktype, P->ai_protocol)) == -1) 
+        {
+            perror("socket() failed");
+            continue;
+        }
+        
+        if (setsockopt(ListenSocket, SOL_SOCKET, SO_REUSEADDR, &One, sizeof(int)) == -1) 
+        {
+            perror("setsockopt() failed");
+            exit(1);
+        }
+        if (ReusePort && setsockopt(ListenSocket, SOL_SOCKET, SO_REUSEPORT, &One, sizeof(int)) == -1)
+        {
+            perror("setsockopt(SO_REUSEPORT) failed");
+            exit(1);
+        }
+        if (IncomingCPU >= 0 && 
+            setsockopt(ListenSocket, SOL_SOCKET, SO_INCOMING_CPU, &IncomingCPU, sizeof(int)) == -1)
+            perror("setsockopt(SO_INCOMING_CPU) failed");
+        
+        if (bind(ListenSocket, P->ai_addr, P->ai_addrlen) == -1) 
+        {
+            close(ListenSocket);
+            perror("bind() failed");
+            continue;
+        }
+        break;  // we break here when the three calls were successful
+    }
+    
+    freeaddrinfo(AddressInfo); // all done with this structure
+    
+    if (P == 0)  
+    {
+        fprintf(stderr, "failed to bind\n");
+        if (StringsAreEqual(PortString, "80"))
+            printf("Port is 80, maybe the OS is keeping you from listening to that port?" 
+                   " Try sudo\n");
+        exit(1);
+    }
+    
+    if (listen(ListenSocket, (int)Backlog) == -1) 
+    {
+        perror("listen");
+        exit(1);
+    }
+    
+    return ListenSocket;
+}
+
+internal b32
+LinuxParseCPUList(char *List, cpu_set_t *Set)
+{
+    // NOTE(vincent): The /sys list format, as in "0-3,8,10-11". Numbers past CPU_SETSIZE are dropped.
+    CPU_ZERO(Set);
+    char *At = List;
+    while (*At >= '0' && *At <= '9')
+    {
+        u32 First = (u32)strtoul(At, &At, 10);
+        u32 Last = First;
+        if (*At == '-')
+            Last = (u32)strtoul(At + 1, &At, 10);
+        for (u32 Index = First; Index <= Last && Index < CPU_SETSIZE; Index++)
+            CPU_SET(Index, Set);
+        if (*At == ',')
+            At++;
+    }
+    return (*At == 0 || *At == '\n');
+}
+
+internal b32
+LinuxReadCPUList(char *Path, cpu_set_t *Set)
+{
+    char Line[4096];
+    FILE *File = fopen(Path, "r");
+    if (!File)
+        return false;
+    b32 Result = (fgets(Line, sizeof(Line), File) != 0) && LinuxParseCPUList(Line, Set);
+    fclose(File);
+    return Result;
+}
+
+internal void
+LinuxDetectTopology(linux_topology *Topology)
+{
+    // NOTE(vincent): Must run before any thread pins itself: the main thread's affinity is what
+    // sched_getaffinity() returns. Nodes past SLAB_MAX_NODE_COUNT share the last node index.
+    // CPUs /sys doesn't put on any node, or all of them when there is no NUMA support, go to node 0.
+    Topology->CPUCount = 0;
+    Topology->NodeCount = 0;
+    cpu_set_t Allowed;
+    if (sched_getaffinity(0, sizeof(Allowed), &Allowed) != 0)
+    {
+        perror("sched_getaffinity() failed");
+        CPU_ZERO(&Allowed);
+        long OnlineCount = sysconf(_SC_NPROCESSORS_ONLN);
+        for (long CPU = 0; CPU < OnlineCount && CPU < CPU_SETSIZE; CPU++)
+            CPU_SET(CPU, &Allowed);
+    }
+    
+    cpu_set_t Nodes;  // not CPUs, but it's the same list format
+    if (!LinuxReadCPUList("/sys/devices/system/node/online", &Nodes))
+        CPU_ZERO(&Nodes);
+    cpu_set_t Placed;
+    CPU_ZERO(&Placed);
+    for (s32 NodeID = 0; NodeID < CPU_SETSIZE; NodeID++)
+    {
+        char Path[64];
+        cpu_set_t NodeCPUs;
+        sprintf(Path, "/sys/devices/system/node/node%d/cpulist", NodeID);
+        if (!CPU_ISSET(NodeID, &Nodes) || !LinuxReadCPUList(Path, &NodeCPUs))
+            continue;
+        CPU_AND(&NodeCPUs, &NodeCPUs, &Allowed);
+        if (CPU_COUNT(&NodeCPUs) == 0)
+            continue;
+        
+        u32 NodeIndex = SLAB_MAX_NODE_COUNT - 1;
+        if (Topology->NodeCount < SLAB_MAX_NODE_COUNT)
+        {
+            NodeIndex = Topology->NodeCount++;
+            Topology->NodeIDs[NodeIndex] = NodeID;
+        }
+        for (s32 CPU = 0; CPU < CPU_SETSIZE; CPU++)
+        {
+            if (CPU_ISSET(CPU, &NodeCPUs) && !CPU_ISSET(CPU, &Placed))
+            {
+                CPU_SET(CPU, &Placed);
+                Topology->CPUNodes[Topology->CPUCount] = (u8)NodeIndex;
+                Topology->CPUs[Topology->CPUCount++] = CPU;
+            }
+        }
+    }
+    
+    if (Topology->NodeCount == 0)
+    {
+        Topology->NodeCount = 1;
+        Topology->NodeIDs[0] = -1;
+    }
+    for (s32 CPU = 0; CPU < CPU_SETSIZE; CPU++)
+    {
+        if (CPU_ISSET(CPU, &Allowed) && !CPU_ISSET(CPU, &Placed))
+        {
+            Topology->CPUNodes[Topology->CPUCount] = 0;
+            Topology->CPUs[Topology->CPUCount++] = CPU;
+        }
+    }
+}
+
+internal void
+LinuxLayOutThreads(linux_topology *Topology, parsed_config_file_result *Config, linux_thread_layout *Layout)
+{
+    // NOTE(vincent): One thread per CPU unless the config says otherwise, and at least two in the work queue
+    // modes, where the main thread only accepts. With fewer threads than CPUs, pinned threads are spread
+    // evenly over the list of CPUs, which goes node by node, so every node gets its share of the threads.
+    // With max_threads, the work queue modes lay out that many threads, but only start the first ones.
+    u32 ThreadCount = Config->ThreadCount ? Config->ThreadCount : Topology->CPUCount;
+    if (ThreadCount < 1)
+        ThreadCount = 1;
+    if (ThreadCount < 2 && Config->Mode != ServerMode_EventLoop)
+        ThreadCount = 2;
+    if (ThreadCount > MAX_THREAD_COUNT)
+        ThreadCount = MAX_THREAD_COUNT;
+    u32 StartThreadCount = ThreadCount;
+    if (Config->MaxThreadCount && Config->Mode == ServerMode_EventLoop)
+        printf("max_threads only applies to the work queue modes\n");
+    else if (Config->MaxThreadCount > ThreadCount)
+        ThreadCount = (Config->MaxThreadCount < MAX_THREAD_COUNT) ? Config->MaxThreadCount : MAX_THREAD_COUNT;
+    Layout->ThreadCount = ThreadCount;
+    Layout->StartThreadCount = StartThreadCount;
+    
+    Layout->NodeCount = Config->PinThreads ? Topology->NodeCount : 1;
+    for (u32 NodeIndex = 0; NodeIndex < Layout->NodeCount; NodeIndex++)
+        Layout->NodeIDs[NodeIndex] = Config->PinThreads ? Topology->NodeIDs[NodeIndex] : -1;
+    for (u32 ThreadIndex = 0; ThreadIndex < ThreadCount; ThreadIndex++)
+    {
+        Layout->CPUs[ThreadIndex] = -1;
+        Layout->Nodes[ThreadIndex] = 0;
+        if (Config->PinThreads && Topology->CPUCount)
+        {
+            u32 CPUIndex = ThreadIndex % Topology->CPUCount;
+            if (ThreadCount <= Topology->CPUCount)
+                CPUIndex = ThreadIndex*Topology->CPUCount / ThreadCount;
+            Layout->CPUs[ThreadIndex] = Topology->CPUs[CPUIndex];
+            Layout->Nodes[ThreadIndex] = Topology->CPUNodes[CPUIndex];
+        }
+    }
+    
+    if (StartThreadCount < ThreadCount)
+        printf("Threads: %u to %u, on %u CPUs and %u NUMA nodes\n", StartThreadCount, ThreadCount,
+               Topology->CPUCount, Topology->NodeCount);
+    else
+        printf("Threads: %u, on %u CPUs and %u NUMA nodes\n", ThreadCount, Topology->CPUCount, Topology->NodeCount);
+    if (Config->PinThreads)
+    {
+        printf("Threads pinned to CPUs (node):");
+        for (u32 ThreadIndex = 0; ThreadIndex < ThreadCount; ThreadIndex++)
+            printf(" %d (%u)", Layout->CPUs[ThreadIndex], Layout->Nodes[ThreadIndex]);
+        printf("\n");
+    }
+}
+
+internal void
+LinuxPreferNode(linux_thread_layout *Layout, void *Base, size_t Size, u32 Node)
+{
+    // NOTE(vincent): Pages of Base..Base+Size that nobody touched yet will be allocated on the node,
+    // whichever thread touches them first. Preferred, not bound: a full node spills to the others
+    // instead of failing. Base must be page aligned. Nothing to do on a machine with one node.
+    if (Layout->NodeCount < 2 || Node >= Layout->NodeCount)
+        return;
+    s32 NodeID = Layout->NodeIDs[Node];
+    if (NodeID < 0 || NodeID >= 64)
+        return;
+    u64 NodeMask = (u64)1 << NodeID;
+    Assert(((uintptr_t)Base & (LINUX_PAGE_SIZE - 1)) == 0);
+    if (syscall(SYS_mbind, Base, Size, MPOL_PREFERRED, &NodeMask, 64, 0) != 0)
+        perror("mbind() failed");
+}
+
+internal void *
+LinuxAllocateThreadStates(size_t Size, linux_thread_layout *Layout)
+{
+    // NOTE(vincent): An array of one Size struct per thread, each on the node of its thread.
+    // Size is a multiple of the page size, so no two threads share a page.
+    Assert(Size % LINUX_PAGE_SIZE == 0);
+    u8 *Result = (u8 *)mmap(0, Size*Layout->ThreadCount, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (Result == MAP_FAILED)
+    {
+        perror("mmap() of the thread states failed");
+        exit(1);
+    }
+    for (u32 ThreadIndex = 0; ThreadIndex < Layout->ThreadCount; ThreadIndex++)
+        LinuxPreferNode(Layout, Result + ThreadIndex*Size, Size, Layout->Nodes[ThreadIndex]);
+    return Result;
+}
+
+internal void
+LinuxPinThread(s32 CPU)
+{
+    // NOTE(vincent): Called by the thread itself, first thing, so that what it allocates and touches
+    // afterwards is local to that CPU.
+    if (CPU < 0)
+        return;
+    cpu_set_t Set;
+    CPU_ZERO(&Set);
+    CPU_SET(CPU, &Set);
+    int Error = pthread_setaffinity_np(pthread_self(), sizeof(Set), &Set);
+    if (Error != 0)
+        fprintf(stderr, "pthread_setaffinity_np() on CPU %d failed: %s\n", CPU, strerror(Error));
+}
+
+internal void
+LinuxOpenLoopListeners(parsed_config_file_result *Config, linux_thread_layout *Layout, SOCKET *ListenSockets)
+{
+    // NOTE(vincent): For the event loops. Either they all share one listening socket, or, with
+    // listen:"reuseport", each gets its own, and the kernel hands every connection to one of them.
+    // A loop then accepts and serves its connections without ever seeing the others':
+    // no shared accept queue, no wakeup of another thread. With pin_threads:"on", each socket also
+    // asks for the connections that arrive on the CPU its loop is pinned to.
+    SOCKET SharedSocket = INVALID_SOCKET;
+    if (!Config->ReusePort)
+        SharedSocket = LinuxOpenListenSocket(Config->PortString, Config->Backlog, false, -1);
+    for (u32 LoopIndex = 0; LoopIndex < Layout->ThreadCount; LoopIndex++)
+    {
+        if (Config->ReusePort)
+            ListenSockets[LoopIndex] = LinuxOpenListenSocket(Config->PortString, Config->Backlog, true,
+                                                             Layout->CPUs[LoopIndex]);
+        else
+            ListenSockets[LoopIndex] = SharedSocket;
+    }
+    if (Config->ReusePort)
+        printf("Listening with one SO_REUSEPORT socket per thread\n");
+}
+
+internal void
+LinuxRunWorkQueueMode(server_memory *ServerMemory, platform_work_queue *Queue, parsed_config_file_result *Config,
+                      linux_thread_layout *Layout)
+{
+    // NOTE(vincent): The main thread accepts connections and hands them to the work queue, forever.
+    // It also watches the connections that have nothing to read (see LinuxWatchConnection()), in the same
+    // epoll set as the listening socket: a readable one goes back to the work queue, and a sweep every
+    // WATCH_SWEEP_PERIOD milliseconds shuts down the ones that stayed quiet for the idle timeout.
+    if (Config->ReusePort)
+        printf("listen:\"reuseport\" only applies to the event loop mode\n");
+    SOCKET ListenSocket = LinuxOpenListenSocket(Config->PortString, Config->Backlog, false, -1);
+    int WatchFile = epoll_create1(0);
+    struct epoll_event ListenEvent = {};
+    ListenEvent.events = EPOLLIN;
+    ListenEvent.data.ptr = 0;
+    if (WatchFile == -1 || epoll_ctl(WatchFile, EPOLL_CTL_ADD, ListenSocket, &ListenEvent) == -1)
+    {
+        perror("epoll for the accepting thread failed");
+        exit(1);
+    }
+    u64 IdleTimeout = (u64)Config->IdleTimeout*1000;
+    LinuxMakeQueue(Queue, Layout, Config->Mode == ServerMode_WorkStealing, Config->ThreadIdleTimeout);
+    LinuxPinThread(Layout->CPUs[0]);
+    linux_work_scheduler *Scheduler = Queue->Scheduler;
+    Scheduler->WatchFile = WatchFile;  // before any connection comes in
+    server_state *State = (server_state *)ServerMemory->Storage;
+    
+    // NOTE(vincent): With an elastic pool, we also watch the ring while we wait for connections:
+    // when entries sit in it and none was taken for WORKER_GROW_WAIT milliseconds, every worker is stuck
+    // (on a slow disk, on slow clients), and we start one more.
+    u32 LastRead = AtomicLoadU32(&Scheduler->Ring.NextEntryToRead);
+    struct timespec LastProgress;
+    clock_gettime(CLOCK_MONOTONIC, &LastProgress);
+    u64 LastSweep = LinuxGetMilliseconds();
+    b32 AcceptPaused = false;
+    
+    struct epoll_event Events[WATCH_EVENT_COUNT];
+    struct sockaddr_storage TheirAddress; // connector's address information
+    socklen_t SizeTheirAddress = sizeof(TheirAddress);
+    for (;;)
+    {
+        // NOTE(vincent): With overload:"queue", PrepareHandshaking() sleeps until a slot frees up, but the
+        // connections that hold the slots may be watched ones, which only we resume or time out. So while
+        // every slot is taken, we leave new connections in the backlog and keep watching.
+        b32 SlotsTaken = (Config->Overload == OverloadPolicy_Queue &&
+                          AtomicLoadU32(&State->Slots.InUseCount) >= State->Slots.Count);
+        if (SlotsTaken != AcceptPaused)
+        {
+            ListenEvent.events = SlotsTaken ? 0 : (u32)EPOLLIN;
+            if (epoll_ctl(WatchFile, EPOLL_CTL_MOD, ListenSocket, &ListenEvent) == -1)
+                perror("epoll_ctl() failed");
+            AcceptPaused = SlotsTaken;
+        }
+        
+        int Timeout = WATCH_SWEEP_PERIOD;
+        if (AcceptPaused)
+            Timeout = ACCEPT_PAUSE_WAIT;
+        else if (Scheduler->Elastic && !WorkRingLooksEmpty(&Scheduler->Ring))
+            Timeout = WORKER_GROW_WAIT;
+        int EventCount = epoll_wait(WatchFile, Events, WATCH_EVENT_COUNT, Timeout);
+        
+        if (Scheduler->Elastic)
+        {
+            struct timespec Now;
+            clock_gettime(CLOCK_MONOTONIC, &Now);
+            u32 Read = AtomicLoadU32(&Scheduler->Ring.NextEntryToRead);
+            s64 Waited = (s64)(Now.tv_sec - LastProgress.tv_sec)*1000 + (Now.tv_nsec - LastProgress.tv_nsec)/1000000;
+            if (Read != LastRead || WorkRingLooksEmpty(&Scheduler->Ring))
+            {
+                LastRead = Read;
+                LastProgress = Now;
+            }
+            else if (Waited >= WORKER_GROW_WAIT)
+            {
+                if (AtomicLoadU32(&Scheduler->RunningCount) < Scheduler->WorkerCount)
+                    LinuxStartWorker(Scheduler);
+                LastProgress = Now;
+            }
+        }
+        
+        u64 Now = LinuxGetMilliseconds();
+        if (Now - LastSweep >= WATCH_SWEEP_PERIOD)
+        {
+            LinuxShutdownIdleConnections(&State->Slots, Now, IdleTimeout);
+            LastSweep = Now;
+        }
+        
+        for (int EventIndex = 0; EventIndex < EventCount; EventIndex++)
+        {
+            connection *Connection = (connection *)Events[EventIndex].data.ptr;
+            if (Connection)
+            {
+                AtomicStoreU32(&Connection->Watched, 0);
+                ResumeWatchedConnection(ServerMemory, Queue, Connection->WatchData);
+                continue;
+            }
+            
+            // Accept a client socket
+            SOCKET ClientSocket = 
+                accept(ListenSocket, (struct sockaddr *)&TheirAddress, &SizeTheirAddress);
+            if (ClientSocket == -1) 
+            {
+                perror("accept failed");
+                continue;
+            }
+            PrepareHandshaking(ServerMemory, (struct sockaddr *)&TheirAddress, ClientSocket, Queue);
+        }
+    }
+}
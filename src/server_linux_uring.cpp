@@ -0,0 +1,707 @@
+// NOTE(vincent): Second Linux platform layer, built by build.sh into server_linux_uring.
+// It serves the same server.cpp as server_linux.cpp, but instead of one system call per accept(),
+// recv(), send() and fread(), every thread queues these operations in its own io_uring
+// and hands them all to the kernel with a single io_uring_enter() per loop iteration.
+// - accept is multishot: one submission keeps producing a completion per incoming connection,
+// - recv picks its buffer from a small ring of buffers registered with IORING_REGISTER_PBUF_RING:
+//   the kernel only takes one once bytes arrive, and we copy them to ReceiveBuffer. Idle connections
+//   hold no buffer, so the few the kernel writes to stay hot in the cache. When they are all taken,
+//   or the kernel has no buffer rings, recv writes to ReceiveBuffer directly,
+// - small files are read into SendBuffer with IORING_OP_READ. Registering the connection slabs as a fixed
+//   buffer would save mapping the pages on every read, but it pins and commits every slab at startup,
+//   charged to RLIMIT_MEMLOCK once per ring, where the slabs are otherwise only backed once touched,
+// - bigger files are spliced to the socket through a pipe (IORING_OP_SPLICE, file to pipe then 
+//   pipe to socket), so their bytes never come up to user space,
+// - idle keep-alive connections are found by a sweep that a periodic IORING_OP_TIMEOUT triggers,
+// - the work queue is still there (server_linux_common.cpp) and mode:"queue" behaves exactly like
+//   in server_linux.cpp.
+// We talk to the kernel with raw system calls, there is no liburing dependency.
+// Requires Linux 5.19 or newer for multishot accept.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <pthread.h>  // NOTE(vincent):  Compile and link with -pthread.
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
+#include <linux/openat2.h>
+#include <linux/io_uring.h>
+#include "common.h"
+#define RING_SUBMISSION_ENTRIES 256  // how many operations we can queue before we have to enter the kernel
+#define RING_TIMER_PERIOD 1000  // milliseconds between two sweeps for idle connections
+#define RING_PIPE_SIZE 65536    // how much of a file one splice moves, at most
+#define RING_RECEIVE_BUFFER_COUNT 64    // provided buffers per ring for recv, a power of 2
+#define RING_RECEIVE_BUFFER_SIZE 4096
+#define RING_RECEIVE_BUFFER_GROUP 0
+
+#define INVALID_SOCKET -1  // this helps for platform-independent code compatibility with Windows
+typedef int SOCKET;        // same
+#include "server.cpp"
+#include "server_linux_common.cpp"
+
+
+struct linux_ring
+{
+    int Handle;
+    
+    u32 *SubmissionHead;    // advanced by the kernel
+    u32 *SubmissionTail;    // advanced by us
+    u32 SubmissionMask;
+    u32 SubmissionCount;
+    struct io_uring_sqe *Submissions;
+    u32 LocalTail;          // entries up to here are filled, but not published to the kernel yet
+    u32 ToSubmit;
+    
+    u32 *CompletionHead;    // advanced by us
+    u32 *CompletionTail;    // advanced by the kernel
+    u32 CompletionMask;
+    struct io_uring_cqe *Completions;
+};
+
+internal b32
+LinuxInitializeRing(linux_ring *Ring, u32 CompletionCount)
+{
+    struct io_uring_params Params = {};
+    Params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    Params.cq_entries = CompletionCount;
+    Ring->Handle = (int)syscall(__NR_io_uring_setup, RING_SUBMISSION_ENTRIES, &Params);
+    if (Ring->Handle == -1 && errno == EINVAL)
+    {
+        // NOTE(vincent): SINGLE_ISSUER and COOP_TASKRUN are only optimization hints, older kernels reject them.
+        ZeroBytes((char *)&Params, sizeof(Params));
+        Params.flags = IORING_SETUP_CQSIZE;
+        Params.cq_entries = CompletionCount;
+        Ring->Handle = (int)syscall(__NR_io_uring_setup, RING_SUBMISSION_ENTRIES, &Params);
+    }
+    if (Ring->Handle == -1)
+    {
+        perror("io_uring_setup failed");
+        return false;
+    }
+    
+    u32 SubmissionRingSize = Params.sq_off.array + Params.sq_entries * sizeof(u32);
+    u32 CompletionRingSize = Params.cq_off.cqes + Params.cq_entries * sizeof(struct io_uring_cqe);
+    b32 SingleMap = (Params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (SingleMap && CompletionRingSize > SubmissionRingSize)
+        SubmissionRingSize = CompletionRingSize;
+    
+    u8 *SubmissionRing = (u8 *)mmap(0, SubmissionRingSize, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE, Ring->Handle, IORING_OFF_SQ_RING);
+    u8 *CompletionRing = SubmissionRing;
+    if (!SingleMap && SubmissionRing != MAP_FAILED)
+        CompletionRing = (u8 *)mmap(0, CompletionRingSize, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE, Ring->Handle, IORING_OFF_CQ_RING);
+    Ring->Submissions = (struct io_uring_sqe *)mmap(0, Params.sq_entries * sizeof(struct io_uring_sqe),
+                                                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                                    Ring->Handle, IORING_OFF_SQES);
+    if (SubmissionRing == MAP_FAILED || CompletionRing == MAP_FAILED || Ring->Submissions == MAP_FAILED)
+    {
+        perror("mmap of the io_uring failed");
+        return false;
+    }
+    
+    Ring->SubmissionHead = (u32 *)(SubmissionRing + Params.sq_off.head);
+    Ring->SubmissionTail = (u32 *)(SubmissionRing + Params.sq_off.tail);
+    Ring->SubmissionMask = *(u32 *)(SubmissionRing + Params.sq_off.ring_mask);
+    Ring->SubmissionCount = Params.sq_entries;
+    Ring->LocalTail = *Ring->SubmissionTail;
+    Ring->ToSubmit = 0;
+    
+    // NOTE(vincent): The submission array is an indirection we don't need:
+    // slot i of the ring always refers to submission entry i.
+    u32 *SubmissionArray = (u32 *)(SubmissionRing + Params.sq_off.array);
+    for (u32 EntryIndex = 0; EntryIndex < Params.sq_entries; EntryIndex++)
+        SubmissionArray[EntryIndex] = EntryIndex;
+    
+    Ring->CompletionHead = (u32 *)(CompletionRing + Params.cq_off.head);
+    Ring->CompletionTail = (u32 *)(CompletionRing + Params.cq_off.tail);
+    Ring->CompletionMask = *(u32 *)(CompletionRing + Params.cq_off.ring_mask);
+    Ring->Completions = (struct io_uring_cqe *)(CompletionRing + Params.cq_off.cqes);
+    
+    return true;
+}
+
+internal void
+LinuxRingEnter(linux_ring *Ring, u32 MinComplete)
+{
+    // NOTE(vincent): Publishes the queued submissions, then waits for at least MinComplete completions.
+    __atomic_store_n(Ring->SubmissionTail, Ring->LocalTail, __ATOMIC_RELEASE);
+    u32 Flags = MinComplete ? IORING_ENTER_GETEVENTS : 0;
+    int Submitted = (int)syscall(__NR_io_uring_enter, Ring->Handle, Ring->ToSubmit, MinComplete, Flags, 0, 0);
+    if (Submitted >= 0)
+        Ring->ToSubmit -= Submitted;
+    else if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        perror("io_uring_enter failed");
+}
+
+internal struct io_uring_sqe *
+LinuxRingGetSubmission(linux_ring *Ring)
+{
+    u32 Head = __atomic_load_n(Ring->SubmissionHead, __ATOMIC_ACQUIRE);
+    while (Ring->LocalTail - Head >= Ring->SubmissionCount)
+    {
+        // NOTE(vincent): Submission ring is full, hand it to the kernel right away.
+        LinuxRingEnter(Ring, 0);
+        Head = __atomic_load_n(Ring->SubmissionHead, __ATOMIC_ACQUIRE);
+    }
+    
+    struct io_uring_sqe *Entry = Ring->Submissions + (Ring->LocalTail & Ring->SubmissionMask);
+    ZeroBytes((char *)Entry, sizeof(*Entry));
+    Ring->LocalTail++;
+    Ring->ToSubmit++;
+    return Entry;
+}
+
+
+// NOTE(vincent): What a completion is about is encoded in the low bits of its user_data,
+// the rest being the connection pointer (connections are at least 8-byte aligned).
+// Every connection has at most one operation in flight at a time.
+enum ring_operation
+{
+    RingOperation_Accept,
+    RingOperation_Cancel,
+    RingOperation_Receive,
+    RingOperation_Send,
+    RingOperation_Read,
+    RingOperation_Timer,
+    RingOperation_SpliceIn,   // file to pipe
+    RingOperation_SpliceOut,  // pipe to socket
+};
+#define RING_OPERATION_MASK 7
+
+struct alignas(LINUX_PAGE_SIZE) linux_ring_loop
+{
+    linux_ring Ring;
+    SOCKET ListenSocket;     // shared by all the loops, or, with listen:"reuseport", our own
+    s32 CPU;                 // the CPU the loop's thread pins itself to, -1 if none
+    b32 AcceptArmed;         // a multishot accept is in flight
+    b32 AcceptCancelled;     // and we asked the kernel to stop it because the pool is exhausted
+    server_memory *Memory;
+    connection_pool Pool;
+    struct io_uring_buf_ring *ReceiveBuffers;  // registered with IORING_REGISTER_PBUF_RING, 0 if that failed
+    u8 *ReceiveBufferMemory;                   // RING_RECEIVE_BUFFER_COUNT buffers, after the ring itself
+    u16 ReceiveBufferTail;
+    u64 IdleTimeout;         // in milliseconds
+    struct __kernel_timespec TimerPeriod;  // must outlive the submission of the timeout
+};
+
+inline void
+LinuxRingPrepare(struct io_uring_sqe *Entry, u8 Opcode, int FileHandle, void *Address, u32 Length,
+                 connection *Connection, ring_operation Operation)
+{
+    Entry->opcode = Opcode;
+    Entry->fd = FileHandle;
+    Entry->addr = (u64)Address;
+    Entry->len = Length;
+    Entry->user_data = (u64)Connection | Operation;
+}
+
+internal void
+LinuxRingProvideBuffer(linux_ring_loop *Loop, u16 BufferID)
+{
+    // NOTE(vincent): Gives a receive buffer (back) to the kernel. The tail overlays the reserved field
+    // of the first entry, and the kernel reads the entries up to it once it sees the new tail.
+    u32 EntryIndex = Loop->ReceiveBufferTail & (RING_RECEIVE_BUFFER_COUNT - 1);
+    struct io_uring_buf *Buffer = Loop->ReceiveBuffers->bufs + EntryIndex;
+    Buffer->addr = (u64)(Loop->ReceiveBufferMemory + BufferID*RING_RECEIVE_BUFFER_SIZE);
+    Buffer->len = RING_RECEIVE_BUFFER_SIZE;
+    Buffer->bid = BufferID;
+    Loop->ReceiveBufferTail++;
+    __atomic_store_n(&Loop->ReceiveBuffers->tail, Loop->ReceiveBufferTail, __ATOMIC_RELEASE);
+}
+
+internal void
+LinuxRingRegisterReceiveBuffers(linux_ring_loop *Loop)
+{
+    // NOTE(vincent): The ring of buffer entries must be page-aligned, the buffers follow it.
+    size_t RingSize = (RING_RECEIVE_BUFFER_COUNT*sizeof(struct io_uring_buf) + LINUX_PAGE_SIZE - 1) & ~(size_t)(LINUX_PAGE_SIZE - 1);
+    size_t Size = RingSize + RING_RECEIVE_BUFFER_COUNT*RING_RECEIVE_BUFFER_SIZE;
+    u8 *Memory = (u8 *)mmap(0, Size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (Memory == MAP_FAILED)
+    {
+        perror("mmap of the receive buffers failed, recv falls back to the connection buffers");
+        return;
+    }
+    
+    struct io_uring_buf_reg Registration = {};
+    Registration.ring_addr = (u64)Memory;
+    Registration.ring_entries = RING_RECEIVE_BUFFER_COUNT;
+    Registration.bgid = RING_RECEIVE_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, Loop->Ring.Handle, IORING_REGISTER_PBUF_RING, &Registration, 1) != 0)
+    {
+        perror("io_uring_register of the receive buffers failed, recv falls back to the connection buffers");
+        munmap(Memory, Size);
+        return;
+    }
+    
+    Loop->ReceiveBuffers = (struct io_uring_buf_ring *)Memory;
+    Loop->ReceiveBufferMemory = Memory + RingSize;
+    Loop->ReceiveBufferTail = 0;
+    for (u16 BufferID = 0; BufferID < RING_RECEIVE_BUFFER_COUNT; BufferID++)
+        LinuxRingProvideBuffer(Loop, BufferID);
+}
+
+internal void
+LinuxRingPrepareReceive(linux_ring_loop *Loop, connection *Connection, b32 SelectBuffer)
+{
+    u32 Room = Connection->ReceiveBufferSize - Connection->ReceivedCount;
+    struct io_uring_sqe *Entry = LinuxRingGetSubmission(&Loop->Ring);
+    if (SelectBuffer && Loop->ReceiveBuffers)
+    {
+        LinuxRingPrepare(Entry, IORING_OP_RECV, Connection->Socket, 0,
+                         Minimum(Room, (u32)RING_RECEIVE_BUFFER_SIZE), Connection, RingOperation_Receive);
+        Entry->flags = IOSQE_BUFFER_SELECT;
+        Entry->buf_group = RING_RECEIVE_BUFFER_GROUP;
+    }
+    else
+        LinuxRingPrepare(Entry, IORING_OP_RECV, Connection->Socket,
+                         Connection->ReceiveBuffer + Connection->ReceivedCount, Room,
+                         Connection, RingOperation_Receive);
+}
+
+internal void
+LinuxRingUpdateAccept(linux_ring_loop *Loop)
+{
+    // NOTE(vincent): Keep exactly one multishot accept alive while the pool has room.
+    b32 HasRoom = ConnectionPoolHasRoom(&Loop->Pool);
+    if (HasRoom && !Loop->AcceptArmed)
+    {
+        struct io_uring_sqe *Entry = LinuxRingGetSubmission(&Loop->Ring);
+        LinuxRingPrepare(Entry, IORING_OP_ACCEPT, Loop->ListenSocket, 0, 0, 0, RingOperation_Accept);
+        Entry->ioprio = IORING_ACCEPT_MULTISHOT;
+        Loop->AcceptArmed = true;
+        Loop->AcceptCancelled = false;
+    }
+    else if (!HasRoom && Loop->AcceptArmed && !Loop->AcceptCancelled)
+    {
+        // Connections stay in the listen backlog, for the other threads to take, or,
+        // with our own SO_REUSEPORT socket, until we have room again.
+        struct io_uring_sqe *Entry = LinuxRingGetSubmission(&Loop->Ring);
+        LinuxRingPrepare(Entry, IORING_OP_ASYNC_CANCEL, -1, 0, 0, 0, RingOperation_Cancel);
+        Entry->addr = RingOperation_Accept;  // user_data of the operation to cancel
+        Loop->AcceptCancelled = true;
+    }
+}
+
+internal b32
+LinuxOpenFilePipe(connection *Connection)
+{
+    // NOTE(vincent): Pipes are kept from one connection to the next, unless a connection closes 
+    // with bytes still in its pipe.
+    if (Connection->FilePipe[0] == -1)
+    {
+        if (pipe2(Connection->FilePipe, O_CLOEXEC) == -1)
+        {
+            perror("pipe2 failed");
+            return false;
+        }
+        int PipeSize = fcntl(Connection->FilePipe[1], F_SETPIPE_SZ, RING_PIPE_SIZE);
+        if (PipeSize == -1)
+            PipeSize = fcntl(Connection->FilePipe[1], F_GETPIPE_SZ);
+        Connection->FilePipeSize = PipeSize > 0 ? (u32)Minimum(PipeSize, RING_PIPE_SIZE) : 4096;
+        Connection->FilePipeCount = 0;
+    }
+    return true;
+}
+
+internal void
+LinuxCloseFilePipe(connection *Connection)
+{
+    if (Connection->FilePipe[0] != -1)
+    {
+        close(Connection->FilePipe[0]);
+        close(Connection->FilePipe[1]);
+        Connection->FilePipe[0] = -1;
+        Connection->FilePipe[1] = -1;
+    }
+    Connection->FilePipeCount = 0;
+}
+
+inline void
+LinuxRingPrepareSplice(struct io_uring_sqe *Entry, int FileHandleIn, s64 OffsetIn, int FileHandleOut, u32 Length,
+                       u32 Flags, connection *Connection, ring_operation Operation)
+{
+    // NOTE(vincent): An offset of -1 means "no offset", which is what pipes and sockets want.
+    LinuxRingPrepare(Entry, IORING_OP_SPLICE, FileHandleOut, 0, Length, Connection, Operation);
+    Entry->off = (u64)-1;
+    Entry->splice_off_in = (u64)OffsetIn;
+    Entry->splice_fd_in = FileHandleIn;
+    Entry->splice_flags = Flags;
+}
+
+internal void
+LinuxRingContinue(linux_ring_loop *Loop, connection *Connection)
+{
+    // NOTE(vincent): Queue the next operation the connection needs, or close it.
+    // A keep-alive connection that sent its last byte either goes back to receiving,
+    // or starts sending the response to a pipelined request, hence the loop.
+    linux_ring *Ring = &Loop->Ring;
+    while (Connection->State != ConnectionState_Closing)
+    {
+        if (Connection->State == ConnectionState_Sending)
+        {
+            if (Connection->FilePipeCount)
+            {
+                u32 Flags = Connection->FileRemaining ? SPLICE_F_MORE : 0;
+                struct io_uring_sqe *Entry = LinuxRingGetSubmission(Ring);
+                LinuxRingPrepareSplice(Entry, Connection->FilePipe[0], -1, Connection->Socket,
+                                       Connection->FilePipeCount, Flags, Connection, RingOperation_SpliceOut);
+                return;
+            }
+            
+            size_t FileBytes = NextFileBytesToSend(Connection);
+            if (FileBytes)
+            {
+                if (!LinuxOpenFilePipe(Connection))
+                {
+                    Connection->State = ConnectionState_Closing;
+                    continue;
+                }
+                u32 Length = (u32)Minimum(FileBytes, (size_t)Connection->FilePipeSize);
+                struct io_uring_sqe *Entry = LinuxRingGetSubmission(Ring);
+                LinuxRingPrepareSplice(Entry, fileno(Connection->File), Connection->FileOffset,
+                                       Connection->FilePipe[1], Length, 0, Connection, RingOperation_SpliceIn);
+                return;
+            }
+            
+            u32 ChunkSize = NextFileChunkSize(Loop->Memory, Connection);
+            if (ChunkSize)
+            {
+                struct io_uring_sqe *Entry = LinuxRingGetSubmission(Ring);
+                LinuxRingPrepare(Entry, IORING_OP_READ, fileno(Connection->File),
+                                 Connection->SendBuffer + Connection->SendLength,
+                                 ChunkSize, Connection, RingOperation_Read);
+                Entry->off = Connection->FileOffset;
+                return;
+            }
+            
+            string ToSend = NextBytesToSend(Loop->Memory, Connection);
+            if (ToSend.Length)
+            {
+                struct io_uring_sqe *Entry = LinuxRingGetSubmission(Ring);
+                LinuxRingPrepare(Entry, IORING_OP_SEND, Connection->Socket, ToSend.Base, ToSend.Length,
+                                 Connection, RingOperation_Send);
+                Entry->msg_flags = MSG_NOSIGNAL | (FileFollows(Connection) ? MSG_MORE : 0);
+                return;
+            }
+        }
+        else
+        {
+            Assert(Connection->State == ConnectionState_Receiving);
+            LinuxRingPrepareReceive(Loop, Connection, true);
+            return;
+        }
+    }
+    
+    Assert(Connection->State == ConnectionState_Closing);
+    if (Connection->FilePipeCount)
+        LinuxCloseFilePipe(Connection);
+    CloseConnection(Connection);
+    ReleaseConnection(&Loop->Pool, Connection);
+    LinuxRingUpdateAccept(Loop);
+}
+
+internal void
+LinuxRingAccepted(linux_ring_loop *Loop, SOCKET ClientSocket)
+{
+    connection *Connection = AcquireConnection(&Loop->Pool);
+    if (!Connection)
+    {
+        // NOTE(vincent): Happens in the short window between asking to cancel the accept and the kernel
+        // actually cancelling it, or when other loops took the last free slots while our accept was armed.
+        RejectConnection((server_state *)Loop->Memory->Storage, ClientSocket);
+        LinuxRingUpdateAccept(Loop);
+        return;
+    }
+    
+    // NOTE(vincent): A multishot accept would write every peer address to the same place,
+    // so we ask for it afterwards.
+    struct sockaddr_storage TheirAddress = {};
+    socklen_t SizeTheirAddress = sizeof(TheirAddress);
+    getpeername(ClientSocket, (struct sockaddr *)&TheirAddress, &SizeTheirAddress);
+    
+    if (!OpenConnection(Connection, ClientSocket, (struct sockaddr *)&TheirAddress))
+    {
+        RejectConnection((server_state *)Loop->Memory->Storage, ClientSocket);
+        ReleaseConnection(&Loop->Pool, Connection);
+        LinuxRingUpdateAccept(Loop);
+        return;
+    }
+    Connection->LastActivity = LinuxGetMilliseconds();
+    LinuxRingContinue(Loop, Connection);
+    LinuxRingUpdateAccept(Loop);
+}
+
+internal void
+LinuxRingArmTimer(linux_ring_loop *Loop)
+{
+    struct io_uring_sqe *Entry = LinuxRingGetSubmission(&Loop->Ring);
+    LinuxRingPrepare(Entry, IORING_OP_TIMEOUT, -1, &Loop->TimerPeriod, 1, 0, RingOperation_Timer);
+}
+
+internal void
+LinuxRingCloseIdleConnections(linux_ring_loop *Loop)
+{
+    // NOTE(vincent): An idle connection always has an operation in flight, so we can't release it here.
+    // Shutting the socket down makes that operation complete, and the connection closes from there.
+    u64 Now = LinuxGetMilliseconds();
+    for (connection *Connection = Loop->Pool.First; Connection; Connection = Connection->Next)
+    {
+        if (Now - Connection->LastActivity >= Loop->IdleTimeout)
+            shutdown(Connection->Socket, SHUT_RDWR);
+    }
+    
+    // NOTE(vincent): Slots other loops released may have made room for us too.
+    LinuxRingUpdateAccept(Loop);
+}
+
+internal void
+LinuxRingComplete(linux_ring_loop *Loop, u64 UserData, s32 Result, u32 Flags)
+{
+    connection *Connection = (connection *)(UserData & ~(u64)RING_OPERATION_MASK);
+    ring_operation Operation = (ring_operation)(UserData & RING_OPERATION_MASK);
+    if (Connection)
+        Connection->LastActivity = LinuxGetMilliseconds();
+    
+    switch (Operation)
+    {
+        case RingOperation_Accept:
+        {
+            if (Result >= 0)
+                LinuxRingAccepted(Loop, Result);
+            else if (Result != -ECANCELED)
+                fprintf(stderr, "accept failed: %s\n", strerror(-Result));
+            
+            if (!(Flags & IORING_CQE_F_MORE))
+            {
+                Loop->AcceptArmed = false;
+                LinuxRingUpdateAccept(Loop);
+            }
+        } break;
+        
+        case RingOperation_Cancel: break;
+        
+        case RingOperation_Receive:
+        {
+            if (Flags & IORING_CQE_F_BUFFER)
+            {
+                u16 BufferID = (u16)(Flags >> IORING_CQE_BUFFER_SHIFT);
+                if (Result > 0)
+                    memcpy(Connection->ReceiveBuffer + Connection->ReceivedCount,
+                           Loop->ReceiveBufferMemory + BufferID*RING_RECEIVE_BUFFER_SIZE, (u32)Result);
+                LinuxRingProvideBuffer(Loop, BufferID);
+            }
+            else if (Result == -ENOBUFS)
+            {
+                // NOTE(vincent): Every provided buffer is out, this one receives in place.
+                LinuxRingPrepareReceive(Loop, Connection, false);
+                break;
+            }
+            
+            if (Result > 0)
+                ConnectionReceived(Loop->Memory, Connection, (u32)Result);
+            else
+            {
+                if (Result < 0)
+                    fprintf(stderr, "recv failed: %s\n", strerror(-Result));
+                Connection->State = ConnectionState_Closing;
+            }
+            LinuxRingContinue(Loop, Connection);
+        } break;
+        
+        case RingOperation_Send:
+        {
+            if (Result >= 0)
+                ConnectionSent(Connection, (u32)Result);
+            else
+            {
+                fprintf(stderr, "send failed: %s\n", strerror(-Result));
+                Connection->State = ConnectionState_Closing;
+            }
+            LinuxRingContinue(Loop, Connection);
+        } break;
+        
+        case RingOperation_Read:
+        {
+            u32 ChunkSize = NextFileChunkSize(Loop->Memory, Connection);
+            ConnectionFileRead(Connection, ChunkSize, Result >= 0 ? (u32)Result : 0);
+            LinuxRingContinue(Loop, Connection);
+        } break;
+        
+        case RingOperation_SpliceIn:
+        {
+            // NOTE(vincent): Once in the pipe, the bytes count as sent as far as server.cpp is concerned.
+            if (Result >= 0)
+            {
+                Connection->FilePipeCount = (u32)Result;
+                ConnectionFileSent(Connection, (size_t)Result);
+            }
+            else
+            {
+                fprintf(stderr, "splice from file failed: %s\n", strerror(-Result));
+                Connection->State = ConnectionState_Closing;
+            }
+            LinuxRingContinue(Loop, Connection);
+        } break;
+        
+        case RingOperation_SpliceOut:
+        {
+            if (Result > 0)
+                Connection->FilePipeCount -= (u32)Result;
+            else
+            {
+                if (Result < 0 && Result != -EPIPE && Result != -ECONNRESET)
+                    fprintf(stderr, "splice to socket failed: %s\n", strerror(-Result));
+                Connection->State = ConnectionState_Closing;
+            }
+            LinuxRingContinue(Loop, Connection);
+        } break;
+        
+        case RingOperation_Timer:
+        {
+            LinuxRingCloseIdleConnections(Loop);
+            LinuxRingArmTimer(Loop);
+        } break;
+        
+        InvalidDefaultCase;
+    }
+}
+
+internal void *
+LinuxRingThreadProc(void *Arg)
+{
+    linux_ring_loop *Loop = (linux_ring_loop *)Arg;
+    linux_ring *Ring = &Loop->Ring;
+    LinuxPinThread(Loop->CPU);
+    
+    // NOTE(vincent): The ring is created by the thread that uses it, as IORING_SETUP_SINGLE_ISSUER wants.
+    // Every connection has at most one operation in flight, plus the accept, its cancellation and the timer.
+    // The kernel wants at least as many completion entries as submission entries.
+    u32 CompletionCount = 2*(Loop->Pool.MaxCount + 3);
+    if (CompletionCount < 2*RING_SUBMISSION_ENTRIES)
+        CompletionCount = 2*RING_SUBMISSION_ENTRIES;
+    if (!LinuxInitializeRing(Ring, CompletionCount))
+        exit(1);
+    LinuxRingRegisterReceiveBuffers(Loop);
+    
+    Loop->TimerPeriod.tv_sec = RING_TIMER_PERIOD / 1000;
+    Loop->TimerPeriod.tv_nsec = (RING_TIMER_PERIOD % 1000) * 1000000;
+    LinuxRingArmTimer(Loop);
+    
+    LinuxRingUpdateAccept(Loop);
+    for (;;)
+    {
+        LinuxRingEnter(Ring, 1);
+        
+        u32 Head = *Ring->CompletionHead;
+        u32 Tail = __atomic_load_n(Ring->CompletionTail, __ATOMIC_ACQUIRE);
+        while (Head != Tail)
+        {
+            struct io_uring_cqe *Completion = Ring->Completions + (Head & Ring->CompletionMask);
+            u64 UserData = Completion->user_data;
+            s32 Result = Completion->res;
+            u32 Flags = Completion->flags;
+            Head++;
+            __atomic_store_n(Ring->CompletionHead, Head, __ATOMIC_RELEASE);
+            
+            LinuxRingComplete(Loop, UserData, Result, Flags);
+        }
+    }
+}
+
+internal linux_ring_loop *
+LinuxMakeRingLoops(server_memory *Memory, parsed_config_file_result *Config, linux_thread_layout *Layout)
+{
+    // NOTE(vincent): One loop per thread of Layout, each on its thread's node.
+    // The first one is left for the main thread to run.
+    u32 LoopCount = Layout->ThreadCount;
+    linux_ring_loop *Loops = (linux_ring_loop *)LinuxAllocateThreadStates(sizeof(linux_ring_loop), Layout);
+    SOCKET ListenSockets[MAX_THREAD_COUNT];
+    LinuxOpenLoopListeners(Config, Layout, ListenSockets);
+    
+    for (u32 LoopIndex = 0; LoopIndex < LoopCount; LoopIndex++)
+    {
+        linux_ring_loop *Loop = Loops + LoopIndex;
+        Loop->Memory = Memory;
+        Loop->ListenSocket = ListenSockets[LoopIndex];
+        Loop->CPU = Layout->CPUs[LoopIndex];
+        Loop->IdleTimeout = (u64)Config->IdleTimeout * 1000;
+        Loop->Pool = BeginConnectionPool(Memory, LoopCount);
+        Loop->Pool.Cache.Node = Layout->Nodes[LoopIndex];
+    }
+    printf("io_uring mode: %u threads, up to %u connections each\n", LoopCount, Loops[0].Pool.MaxCount);
+    
+    for (u32 LoopIndex = 1; LoopIndex < LoopCount; LoopIndex++)
+    {
+        pthread_t ThreadID;
+        pthread_create(&ThreadID, 0, LinuxRingThreadProc, Loops + LoopIndex);
+    }
+    return Loops;
+}
+
+int main(void)
+{
+    // NOTE(vincent): A client closing its socket early would otherwise kill us on the next send().
+    signal(SIGPIPE, SIG_IGN);
+    
+    platform_work_queue Queue = {};
+    
+    // NOTE(vincent): Initializing server memory
+    server_memory ServerMemory = {};
+    if (!LinuxAllocateServerMemory(&ServerMemory))
+        return 1;
+    initialize_server_memory_result InitResult =
+        InitializeServerMemory(&ServerMemory, &Queue, LinuxAddEntry, LinuxDoNextWorkQueueEntry,
+                               LinuxSendFile, LinuxWaitOnAddress, LinuxWakeOnAddress, LinuxCountHugePages,
+                               LinuxGetThreadNode, LinuxOpenBeneath, LinuxStatBeneath,
+                               LinuxWatchConnection);
+#if RUN_BENCHMARKS
+    LinuxBenchmarkWorkRing();
+    LinuxBenchmarkWorkDeque();
+    LinuxBenchmarkParking();
+#endif
+    
+    if (InitResult.ParsingErrorCount == 0)
+    {
+        linux_topology Topology;
+        linux_thread_layout Layout;
+        LinuxDetectTopology(&Topology);
+        LinuxLayOutThreads(&Topology, InitResult.Config, &Layout);
+        
+        b32 HugePages = InitResult.Config->HugePages;
+        LinuxAdviseServerArena(&ServerMemory, HugePages);
+        LinuxAllocateFileCache(&ServerMemory, InitResult.Config->CacheSize, HugePages);
+        LinuxOpenVirtualHosts(&ServerMemory, InitResult.Config);
+        if (!LinuxAllocateConnectionSlots(&ServerMemory, HugePages, &Layout))
+            return 1;
+        char Regions[1024];
+        if (SprintMemoryRegions(Regions, &ServerMemory))
+            fputs(Regions, stdout);
+        printf("Server: waiting for a connection on port %s\n", InitResult.PortString);
+        
+        if (InitResult.Config->Mode == ServerMode_EventLoop)
+        {
+            // NOTE(vincent): The main thread runs one of the rings and never returns.
+            linux_ring_loop *RingLoops = LinuxMakeRingLoops(&ServerMemory, InitResult.Config, &Layout);
+            LinuxRingThreadProc(RingLoops);
+        }
+        else
+            LinuxRunWorkQueueMode(&ServerMemory, &Queue, InitResult.Config, &Layout);
+    }
+    
+    return 0;
+}
@@ -0,0 +1,417 @@
+// NOTE(vincent): A slab allocator for the buffers of the connections, with a few size classes.
+// Its memory is one block of slabs of SLAB_SIZE bytes, which the platform layer allocates along
+// with the connection slots. A class that runs out of free blocks takes a whole slab from the
+// shared pool and cuts it into blocks of its size, so the classes split the memory in whatever
+// proportion the traffic asks for, instead of a carve-up fixed at startup. The allocator counts
+// the blocks of every slab that sit in its depot: once they all do, and the depot has another slab's
+// worth of free blocks besides, the slab goes back to the pool, with its pages given back to the OS.
+// So a burst of one class doesn't starve the others afterwards.
+//
+// Each thread keeps a magazine of free blocks per class (slab_cache). Allocating and freeing
+// is then a push or a pop on memory only that thread touches, and the shared depot of the class,
+// behind a ticket mutex, is only visited to move half a magazine of blocks at once.
+// Only buffers come from here: what a request pushes goes to the arena of its connection slot.
+//
+// On a NUMA machine, the platform layer splits the slabs between the nodes and binds each share
+// to its node. Every node has its own pool and depots, and a thread allocates from the node its
+// slab_cache names, only going to the other nodes when its own is out of memory. A block always
+// goes back to the depot of the node it belongs to, which its address tells.
+
+enum slab_class
+{
+    SlabClass_4K,
+    SlabClass_8K,
+    SlabClass_16K,
+    SlabClass_64K,
+    SlabClass_Count,
+};
+
+#define SLAB_SIZE 262144         // a multiple of the page size and of every block size
+#define SLAB_MAGAZINE_SIZE 16    // free blocks a thread keeps per class, at most a slab's worth
+#define SLAB_MAX_NODE_COUNT 8    // NUMA nodes with slabs of their own
+
+struct slab_magazine
+{
+    u32 Count;
+    u8 *Blocks[SLAB_MAGAZINE_SIZE];
+};
+
+struct slab_cache
+{
+    u32 Node;  // where the thread's blocks come from, and the only node whose blocks its magazines hold
+    slab_magazine Magazines[SlabClass_Count];
+};
+
+struct slab_depot
+{
+    alignas(CACHE_LINE_SIZE) ticket_mutex Mutex;
+    u32 BlockSize;
+    u32 MagazineSize;
+    u8 **FreeBlocks;  // the free blocks that no magazine holds, room for all the blocks of the class
+    u32 FreeCount;
+    u32 SlabCount;    // slabs the class took from the pool
+};
+
+struct slab_node
+{
+    u32 FirstSlab;
+    u32 SlabCount;
+    index_stack FreeSlabs;  // indices from FirstSlab
+    slab_depot Depots[SlabClass_Count];
+};
+
+struct slab_allocator
+{
+    u8 *Base;
+    u32 SlabCount;
+    u32 NodeCount;
+    u32 SlabsPerNode;  // the last node also gets the remainder
+    u32 *DepotBlockCounts;  // per slab: how many of its blocks are in the depot of its class
+    b32 DecommitFreeSlabs;  // whether slabs going back to the pool give their pages back to the OS
+    slab_node Nodes[SLAB_MAX_NODE_COUNT];
+};
+
+inline u32
+SlabBlockSize(slab_class Class)
+{
+    u32 Result = 0;
+    switch (Class)
+    {
+        case SlabClass_4K: Result = 4096; break;
+        case SlabClass_8K: Result = 8192; break;
+        case SlabClass_16K: Result = 16384; break;
+        case SlabClass_64K: Result = 65536; break;
+        InvalidDefaultCase;
+    }
+    return Result;
+}
+
+inline slab_class
+SlabClassFor(u32 Size)
+{
+    // NOTE(vincent): The smallest class that fits Size, or SlabClass_Count if none does.
+    u32 Class = 0;
+    while (Class < SlabClass_Count && SlabBlockSize((slab_class)Class) < Size)
+        Class++;
+    return (slab_class)Class;
+}
+
+internal size_t
+SlabDepotStorageSize(u32 SlabCount)
+{
+    // NOTE(vincent): What InitializeSlabAllocator() needs for the FreeBlocks arrays of the depots.
+    size_t Result = 0;
+    for (u32 Class = 0; Class < SlabClass_Count; Class++)
+        Result += (size_t)SlabCount*(SLAB_SIZE / SlabBlockSize((slab_class)Class))*sizeof(u8 *);
+    return Result;
+}
+
+internal void
+InitializeSlabAllocator(slab_allocator *Slab, u8 *Base, u32 SlabCount, u32 NodeCount,
+                        u32 volatile *NextFreeSlab, u8 **DepotStorage, u32 *DepotBlockCounts)
+{
+    // NOTE(vincent): The slabs are split in NodeCount contiguous shares, see SlabNodeOf().
+    // NextFreeSlab and DepotBlockCounts have room for SlabCount entries.
+    if (NodeCount > SLAB_MAX_NODE_COUNT)
+        NodeCount = SLAB_MAX_NODE_COUNT;
+    if (NodeCount > SlabCount)
+        NodeCount = SlabCount;
+    if (NodeCount == 0)
+        NodeCount = 1;
+    Slab->Base = Base;
+    Slab->SlabCount = SlabCount;
+    Slab->NodeCount = NodeCount;
+    Slab->SlabsPerNode = SlabCount / NodeCount;
+    Slab->DepotBlockCounts = DepotBlockCounts;
+    Slab->DecommitFreeSlabs = true;
+    for (u32 NodeIndex = 0; NodeIndex < NodeCount; NodeIndex++)
+    {
+        slab_node *Node = Slab->Nodes + NodeIndex;
+        Node->FirstSlab = NodeIndex*Slab->SlabsPerNode;
+        Node->SlabCount = (NodeIndex + 1 < NodeCount) ? Slab->SlabsPerNode : SlabCount - Node->FirstSlab;
+        InitializeIndexStack(&Node->FreeSlabs, NextFreeSlab + Node->FirstSlab, Node->SlabCount);
+        for (u32 Class = 0; Class < SlabClass_Count; Class++)
+        {
+            slab_depot *Depot = Node->Depots + Class;
+            Depot->Mutex.Ticket = 0;
+            Depot->Mutex.Serving = 0;
+            Depot->BlockSize = SlabBlockSize((slab_class)Class);
+            Depot->MagazineSize = Minimum(SLAB_MAGAZINE_SIZE, SLAB_SIZE / Depot->BlockSize);
+            Depot->FreeBlocks = DepotStorage;
+            Depot->FreeCount = 0;
+            Depot->SlabCount = 0;
+            DepotStorage += Node->SlabCount*(SLAB_SIZE / Depot->BlockSize);
+        }
+    }
+}
+
+inline u32
+SlabIndexOf(slab_allocator *Slab, u8 *Block)
+{
+    return (u32)((Block - Slab->Base) / SLAB_SIZE);
+}
+
+inline u32
+SlabNodeOf(slab_allocator *Slab, u8 *Block)
+{
+    u32 SlabIndex = SlabIndexOf(Slab, Block);
+    u32 Result = SlabIndex / Slab->SlabsPerNode;
+    if (Result >= Slab->NodeCount)
+        Result = Slab->NodeCount - 1;
+    return Result;
+}
+
+inline u32
+SlabHomeNode(slab_allocator *Slab, slab_cache *Cache)
+{
+    return (Cache && Cache->Node < Slab->NodeCount) ? Cache->Node : 0;
+}
+
+internal void
+TakeSlab(slab_allocator *Slab, slab_node *Node, slab_depot *Depot)
+{
+    // NOTE(vincent): With the depot's mutex held. Does nothing if the node's pool is empty.
+    u32 SlabIndex;
+    if (PopIndex(&Node->FreeSlabs, &SlabIndex))
+    {
+        u8 *Base = Slab->Base + (size_t)(Node->FirstSlab + SlabIndex)*SLAB_SIZE;
+        if (Slab->DecommitFreeSlabs && !CommitMemory(Base, SLAB_SIZE))
+        {
+            PushIndex(&Node->FreeSlabs, SlabIndex);
+            return;
+        }
+        for (u32 Offset = SLAB_SIZE; Offset > 0; Offset -= Depot->BlockSize)
+            Depot->FreeBlocks[Depot->FreeCount++] = Base + Offset - Depot->BlockSize;
+        Slab->DepotBlockCounts[Node->FirstSlab + SlabIndex] = SLAB_SIZE / Depot->BlockSize;
+        Depot->SlabCount++;
+    }
+}
+
+internal void
+ReleaseSlab(slab_allocator *Slab, slab_node *Node, slab_depot *Depot, u32 SlabIndex)
+{
+    // NOTE(vincent): With the depot's mutex held, once every block of the slab is in the depot.
+    // Its blocks may be anywhere in FreeBlocks, so we go through all of them, but this only happens
+    // when a whole slab's worth of blocks came back on top of another one.
+    u8 *Base = Slab->Base + (size_t)SlabIndex*SLAB_SIZE;
+    u32 Kept = 0;
+    for (u32 Index = 0; Index < Depot->FreeCount; Index++)
+    {
+        u8 *Block = Depot->FreeBlocks[Index];
+        if (Block < Base || Block >= Base + SLAB_SIZE)
+            Depot->FreeBlocks[Kept++] = Block;
+    }
+    Assert(Depot->FreeCount - Kept == SLAB_SIZE / Depot->BlockSize);
+    Depot->FreeCount = Kept;
+    Depot->SlabCount--;
+    Slab->DepotBlockCounts[SlabIndex] = 0;
+    
+    // NOTE(vincent): Before the push: once the slab is in the pool, another class may take it.
+    if (Slab->DecommitFreeSlabs)
+        DecommitMemory(Base, SLAB_SIZE);
+    PushIndex(&Node->FreeSlabs, SlabIndex - Node->FirstSlab);
+}
+
+inline u8 *
+PopDepotBlock(slab_allocator *Slab, slab_depot *Depot)
+{
+    // NOTE(vincent): With the depot's mutex held, and a free block in the depot.
+    u8 *Block = Depot->FreeBlocks[--Depot->FreeCount];
+    Slab->DepotBlockCounts[SlabIndexOf(Slab, Block)]--;
+    return Block;
+}
+
+inline void
+PushDepotBlock(slab_allocator *Slab, slab_node *Node, slab_depot *Depot, u8 *Block)
+{
+    // NOTE(vincent): With the depot's mutex held. A slab whose blocks are all back only returns to the pool
+    // when the depot keeps another slab's worth of free blocks, so that a class going back and forth
+    // across a slab boundary doesn't take and release the same slab over and over.
+    u32 SlabIndex = SlabIndexOf(Slab, Block);
+    u32 BlocksPerSlab = SLAB_SIZE / Depot->BlockSize;
+    Depot->FreeBlocks[Depot->FreeCount++] = Block;
+    if (++Slab->DepotBlockCounts[SlabIndex] == BlocksPerSlab && Depot->FreeCount >= 2*BlocksPerSlab)
+        ReleaseSlab(Slab, Node, Depot, SlabIndex);
+}
+
+internal u8 *
+SlabAllocate(slab_allocator *Slab, slab_cache *Cache, slab_class Class)
+{
+    // NOTE(vincent): Returns 0 when the class has no free block and the pool no free slab, on any node.
+    // Without a Cache, the block comes straight from the depot of the first node.
+    // Blocks of another node are only handed out one at a time, they never go in the magazine.
+    slab_magazine *Magazine = Cache ? Cache->Magazines + Class : 0;
+    if (Magazine && Magazine->Count)
+        return Magazine->Blocks[--Magazine->Count];
+    
+    u8 *Result = 0;
+    u32 Home = SlabHomeNode(Slab, Cache);
+    for (u32 Step = 0; Step < Slab->NodeCount && !Result; Step++)
+    {
+        slab_node *Node = Slab->Nodes + (Home + Step) % Slab->NodeCount;
+        slab_depot *Depot = Node->Depots + Class;
+        BeginTicketMutex(&Depot->Mutex);
+        if (Depot->FreeCount == 0)
+            TakeSlab(Slab, Node, Depot);
+        if (Depot->FreeCount)
+        {
+            Result = PopDepotBlock(Slab, Depot);
+            while (Step == 0 && Magazine && Magazine->Count < Depot->MagazineSize / 2 && Depot->FreeCount)
+                Magazine->Blocks[Magazine->Count++] = PopDepotBlock(Slab, Depot);
+        }
+        EndTicketMutex(&Depot->Mutex);
+    }
+    return Result;
+}
+
+internal void
+SlabFree(slab_allocator *Slab, slab_cache *Cache, slab_class Class, u8 *Block)
+{
+    // NOTE(vincent): A full magazine gives half of its blocks back, so that a thread going back and forth
+    // across the boundary doesn't visit the depot on every call. A block of another node than the
+    // cache's goes straight back to its own depot.
+    Assert(Block >= Slab->Base && Block < Slab->Base + (size_t)Slab->SlabCount*SLAB_SIZE);
+    u32 NodeIndex = SlabNodeOf(Slab, Block);
+    slab_node *Node = Slab->Nodes + NodeIndex;
+    slab_depot *Depot = Node->Depots + Class;
+    slab_magazine *Magazine = (Cache && SlabHomeNode(Slab, Cache) == NodeIndex) ? Cache->Magazines + Class : 0;
+    if (Magazine && Magazine->Count < Depot->MagazineSize)
+    {
+        Magazine->Blocks[Magazine->Count++] = Block;
+        return;
+    }
+    
+    BeginTicketMutex(&Depot->Mutex);
+    while (Magazine && Magazine->Count > Depot->MagazineSize / 2)
+        PushDepotBlock(Slab, Node, Depot, Magazine->Blocks[--Magazine->Count]);
+    PushDepotBlock(Slab, Node, Depot, Block);
+    EndTicketMutex(&Depot->Mutex);
+}
+
+internal void
+FlushSlabCache(slab_allocator *Slab, slab_cache *Cache)
+{
+    // NOTE(vincent): Gives every cached block back to the depots, before the cache goes away.
+    slab_node *Node = Slab->Nodes + SlabHomeNode(Slab, Cache);
+    for (u32 Class = 0; Class < SlabClass_Count; Class++)
+    {
+        slab_magazine *Magazine = Cache->Magazines + Class;
+        if (Magazine->Count)
+        {
+            slab_depot *Depot = Node->Depots + Class;
+            BeginTicketMutex(&Depot->Mutex);
+            while (Magazine->Count)
+                PushDepotBlock(Slab, Node, Depot, Magazine->Blocks[--Magazine->Count]);
+            EndTicketMutex(&Depot->Mutex);
+        }
+    }
+}
+
+internal u32
+SprintSlabOccupancy(char *Dest, slab_allocator *Slab)
+{
+    // NOTE(vincent): One line per class: the slabs it took, and how many of their blocks are out.
+    // Blocks sitting in the magazines of the threads count as out: only the depot knows what is free.
+    // With more than one node, the classes add up the nodes, and a line per node follows.
+    u32 Length = 0;
+    u32 TakenSlabCount = 0;
+    u32 NodeTakenCounts[SLAB_MAX_NODE_COUNT] = {};
+    for (u32 Class = 0; Class < SlabClass_Count; Class++)
+    {
+        u32 SlabCount = 0;
+        u32 FreeCount = 0;
+        for (u32 NodeIndex = 0; NodeIndex < Slab->NodeCount; NodeIndex++)
+        {
+            slab_depot *Depot = Slab->Nodes[NodeIndex].Depots + Class;
+            BeginTicketMutex(&Depot->Mutex);
+            SlabCount += Depot->SlabCount;
+            NodeTakenCounts[NodeIndex] += Depot->SlabCount;
+            FreeCount += Depot->FreeCount;
+            EndTicketMutex(&Depot->Mutex);
+        }
+        u32 BlockSize = SlabBlockSize((slab_class)Class);
+        u32 BlockCount = SlabCount*(SLAB_SIZE / BlockSize);
+        
+        TakenSlabCount += SlabCount;
+        Length += Sprint(Dest + Length, "  ");
+        Length += SprintInt(Dest + Length, BlockSize / 1024);
+        Length += Sprint(Dest + Length, " KB blocks: ");
+        Length += SprintInt(Dest + Length, BlockCount - FreeCount);
+        Length += Sprint(Dest + Length, " out of ");
+        Length += SprintInt(Dest + Length, BlockCount);
+        Length += Sprint(Dest + Length, " in ");
+        Length += SprintInt(Dest + Length, SlabCount);
+        Length += Sprint(Dest + Length, " slabs\n");
+    }
+    Length += Sprint(Dest + Length, "  Slabs taken: ");
+    Length += SprintInt(Dest + Length, TakenSlabCount);
+    Length += Sprint(Dest + Length, " of ");
+    Length += SprintInt(Dest + Length, Slab->SlabCount);
+    Length += Sprint(Dest + Length, "\n");
+    for (u32 NodeIndex = 0; Slab->NodeCount > 1 && NodeIndex < Slab->NodeCount; NodeIndex++)
+    {
+        Length += Sprint(Dest + Length, "  Node ");
+        Length += SprintInt(Dest + Length, NodeIndex);
+        Length += Sprint(Dest + Length, ": ");
+        Length += SprintInt(Dest + Length, NodeTakenCounts[NodeIndex]);
+        Length += Sprint(Dest + Length, " of ");
+        Length += SprintInt(Dest + Length, Slab->Nodes[NodeIndex].SlabCount);
+        Length += Sprint(Dest + Length, " slabs taken\n");
+    }
+    return Length;
+}
+
+internal void
+TestSlabNodes()
+{
+    // NOTE(vincent): Five slabs on two nodes: 2 on node 0, 3 on node 1. The allocator never writes
+    // to the blocks, so reserved address space is enough. A thread of node 1 gets the blocks of node 1
+    // first, then those of node 0, and every block goes back to the depot of its own node.
+    // Once they are all back, the slabs go back to the pools, but one per node, for another class.
+    u32 SlabCount = 5;
+    u8 *Base = (u8 *)ReserveMemory(0, (size_t)SlabCount*SLAB_SIZE);
+    u32 NextFreeSlab[5];
+    u32 DepotBlockCounts[5];
+    u8 *DepotStorage[5*(SLAB_SIZE/4096 + SLAB_SIZE/8192 + SLAB_SIZE/16384 + SLAB_SIZE/65536)];
+    Assert(SlabDepotStorageSize(SlabCount) <= sizeof(DepotStorage));
+    slab_allocator Slab;
+    InitializeSlabAllocator(&Slab, Base, SlabCount, 2, NextFreeSlab, DepotStorage, DepotBlockCounts);
+    b32 Success = (Slab.NodeCount == 2 && Slab.Nodes[0].SlabCount == 2 && Slab.Nodes[1].SlabCount == 3);
+    
+    slab_cache Cache = {};
+    Cache.Node = 1;
+    u8 *Blocks[20];
+    for (u32 BlockIndex = 0; BlockIndex < ArrayCount(Blocks); BlockIndex++)
+    {
+        Blocks[BlockIndex] = SlabAllocate(&Slab, &Cache, SlabClass_64K);
+        Success &= (Blocks[BlockIndex] != 0);
+        Success &= (SlabNodeOf(&Slab, Blocks[BlockIndex]) == (BlockIndex < 12 ? 1u : 0u));
+    }
+    Success &= (SlabAllocate(&Slab, &Cache, SlabClass_64K) == 0);
+    
+    // The 64K class took every slab of both nodes, so there is nothing left for the others.
+    Success &= (SlabAllocate(&Slab, 0, SlabClass_4K) == 0);
+    
+    for (u32 BlockIndex = 0; BlockIndex < ArrayCount(Blocks); BlockIndex++)
+        SlabFree(&Slab, &Cache, SlabClass_64K, Blocks[BlockIndex]);
+    FlushSlabCache(&Slab, &Cache);
+    for (u32 NodeIndex = 0; NodeIndex < 2; NodeIndex++)
+    {
+        slab_depot *Depot = Slab.Nodes[NodeIndex].Depots + SlabClass_64K;
+        Success &= (Depot->SlabCount == 1 && Depot->FreeCount == 4);
+    }
+    
+    // The 4K class now gets the three slabs the 64K class gave back, from both nodes.
+    u8 *SmallBlocks[3*(SLAB_SIZE / 4096)];
+    for (u32 BlockIndex = 0; BlockIndex < ArrayCount(SmallBlocks); BlockIndex++)
+    {
+        SmallBlocks[BlockIndex] = SlabAllocate(&Slab, &Cache, SlabClass_4K);
+        Success &= (SmallBlocks[BlockIndex] != 0);
+    }
+    Success &= (SlabAllocate(&Slab, &Cache, SlabClass_4K) == 0);
+    for (u32 BlockIndex = 0; BlockIndex < ArrayCount(SmallBlocks); BlockIndex++)
+        SlabFree(&Slab, &Cache, SlabClass_4K, SmallBlocks[BlockIndex]);
+    FlushSlabCache(&Slab, &Cache);
+    Success &= (Slab.Nodes[0].Depots[SlabClass_4K].SlabCount + Slab.Nodes[1].Depots[SlabClass_4K].SlabCount == 2);
+    Assert(Success);
+}
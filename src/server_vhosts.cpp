@@ -0,0 +1,117 @@
+// NOTE(vincent): Every site is a directory under the root, named after its host: http://verti/ is
+// served from root/verti. The platform layer opens each of these directories once, at startup, and
+// hands us the handle with AddVirtualHost(). The Host field of a request, without its port and
+// lowercased, finds its site in a hash table, and the file is opened relative to the site's handle
+// and beneath it (PLATFORM_OPEN_BENEATH): the kernel resolves the request path from the site
+// directory instead of from /, and nothing outside the site can be reached, through ".." or a
+// symlink. A host that isn't in the table gets a 400 before we touch the file system. The file
+// cache and CheckAccess() stat() what is in the site from the same handle (PLATFORM_STAT_BENEATH).
+// Sites added after startup are only served after a restart.
+// A platform layer without PlatformOpenBeneath (Windows) has no table: files are opened by path,
+// under root/host, as before. Host names and paths that would climb out of the root are still refused.
+
+#define VIRTUAL_HOST_BUCKET_COUNT 256  // must be a power of two
+#define VIRTUAL_HOST_NAME_MAX 255      // a DNS name takes at most 253 characters
+
+struct virtual_host
+{
+    virtual_host *NextInBucket;
+    u32 Hash;
+    string Name;          // lowercased
+    string Path;          // root/name as on disk, null-terminated: where the paths of the site's files start
+    s64 Directory;        // the platform layer's handle on that directory
+};
+
+struct virtual_hosts
+{
+    platform_open_beneath *PlatformOpenBeneath;  // null: no table, files are opened by path
+    platform_stat_beneath *PlatformStatBeneath;
+    virtual_host *Buckets[VIRTUAL_HOST_BUCKET_COUNT];
+    u32 Count;
+};
+
+internal string
+NormalizeHostName(string Host, char *Dest)
+{
+    // NOTE(vincent): Host without its port, lowercased, into Dest (Host.Length + 1 bytes), null-terminated.
+    // The result has a null Base if it can't be a site name: empty, too long, starting with a dot,
+    // or with a path separator in it.
+    string Result = StringBaseLength(Dest, 0);
+    string Name = StringPrefixUntil(Host, ':');
+    if (Host.Length && Host.Base[0] == '[')
+    {
+        Name = StringPrefixUntil(Host, ']');  // an IPv6 address: its colons aren't the port's
+        if (Name.Length < Host.Length)
+            Name.Length++;
+    }
+
+    b32 Valid = (Name.Length > 0 && Name.Length <= VIRTUAL_HOST_NAME_MAX && Name.Base[0] != '.');
+    for (u32 Index = 0; Valid && Index < Name.Length; Index++)
+    {
+        char C = Name.Base[Index];
+        Valid = (C != '/' && C != '\\' && C != 0);
+        Dest[Index] = ToLowerCase(C);
+    }
+    if (Valid)
+    {
+        Result.Length = Name.Length;
+        Dest[Result.Length] = 0;
+    }
+    else
+        Result.Base = 0;
+    return Result;
+}
+
+internal b32
+PathClimbs(string Path)
+{
+    // NOTE(vincent): Whether Path has a ".." segment. Both separators count, for Windows.
+    u32 SegmentStart = 0;
+    for (u32 Index = 0; Index <= Path.Length; Index++)
+    {
+        if (Index == Path.Length || Path.Base[Index] == '/' || Path.Base[Index] == '\\')
+        {
+            if (Index - SegmentStart == 2 && Path.Base[SegmentStart] == '.' && Path.Base[SegmentStart + 1] == '.')
+                return true;
+            SegmentStart = Index + 1;
+        }
+    }
+    return false;
+}
+
+internal virtual_host *
+FindVirtualHost(virtual_hosts *Hosts, string Name)
+{
+    // NOTE(vincent): Name comes from NormalizeHostName(). The table doesn't change once connections come in,
+    // so there is no lock.
+    u32 Hash = HashPath(Name);
+    virtual_host *Host = Hosts->Buckets[Hash & (VIRTUAL_HOST_BUCKET_COUNT - 1)];
+    while (Host && !(Host->Hash == Hash && StringsAreEqual(Host->Name, Name)))
+        Host = Host->NextInBucket;
+    return Host;
+}
+
+internal void
+TestVirtualHostNames()
+{
+    char Dest[64];
+    b32 Success = true;
+    Success &= StringsAreEqual(NormalizeHostName(StringFromLiteral("Verti"), Dest), "verti");
+    Success &= StringsAreEqual(NormalizeHostName(StringFromLiteral("verti:3490"), Dest), "verti");
+    Success &= StringsAreEqual(NormalizeHostName(StringFromLiteral("WWW.Example.COM:80"), Dest), "www.example.com");
+    Success &= StringsAreEqual(NormalizeHostName(StringFromLiteral("[::1]:8080"), Dest), "[::1]");
+    Success &= StringsAreEqual(NormalizeHostName(StringFromLiteral("[::1]"), Dest), "[::1]");
+    Success &= (NormalizeHostName(StringFromLiteral(""), Dest).Base == 0);
+    Success &= (NormalizeHostName(StringFromLiteral(":80"), Dest).Base == 0);
+    Success &= (NormalizeHostName(StringFromLiteral(".."), Dest).Base == 0);
+    Success &= (NormalizeHostName(StringFromLiteral("../../etc"), Dest).Base == 0);
+    Success &= (NormalizeHostName(StringFromLiteral("a/b"), Dest).Base == 0);
+    Success &= (NormalizeHostName(StringFromLiteral("a\\b"), Dest).Base == 0);
+
+    Success &= !PathClimbs(StringFromLiteral("/index.html"));
+    Success &= !PathClimbs(StringFromLiteral("/a..b/..c/d../"));
+    Success &= PathClimbs(StringFromLiteral("/../etc/passwd"));
+    Success &= PathClimbs(StringFromLiteral("/images/.."));
+    Success &= PathClimbs(StringFromLiteral("/images\\..\\..\\x"));
+    Assert(Success);
+}
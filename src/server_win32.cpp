@@ -20,65 +20,38 @@
 #include "common.h"
 #include "server.cpp"
 #pragma comment(lib, "Ws2_32.lib")
+#pragma comment(lib, "Synchronization.lib")  // WaitOnAddress()
 
 
 struct platform_work_queue
 {
-    u32 volatile NextEntryToWrite;
-    u32 volatile NextEntryToRead;
+    work_ring Ring;
     HANDLE SemaphoreHandle;
-    platform_work_queue_entry Entries[256];
 };
 
-internal void
+internal b32
 Win32AddEntry(platform_work_queue *Queue, platform_work_queue_callback *Callback, void *Data)
 {
-    u32 NewNextEntryToWrite = (Queue->NextEntryToWrite + 1) % ArrayCount(Queue->Entries);
-    Assert(NewNextEntryToWrite != Queue->NextEntryToWrite);
-    
-    if (NewNextEntryToWrite != Queue->NextEntryToRead)
+    // NOTE(vincent): Any thread may add entries, workers included.
+    b32 Added = PushWorkEntry(&Queue->Ring, Callback, Data);
+    if (Added)
     {
-        platform_work_queue_entry *Entry = Queue->Entries + Queue->NextEntryToWrite;
-        Entry->Callback = Callback;
-        Entry->Data = Data;
-        //_WriteBarrier(); // TODO(vincent): hmmmm... why would you use that?
-        Queue->NextEntryToWrite = NewNextEntryToWrite;
         // increase semaphore count so a thread can wake up
         ReleaseSemaphore(Queue->SemaphoreHandle, 1, 0); 
     }
-    
+    return Added;
 }
 
 internal b32
 Win32DoNextWorkQueueEntry(platform_work_queue *Queue)
 {
-    // Many threads may be executing this function simultaneously.
-    // Queue is subject to concurrent modifications so we have to be careful.
-    // Entries in the work queue are laid out in a circular buffer.
+    // Many threads may be executing this function simultaneously, see server_work_queue.cpp.
     b32 WeShouldSleep = false;
-    u32 OriginalNextEntryToRead = Queue->NextEntryToRead; // read this once and try to work with that
-    u32 NewNextEntryToRead = (OriginalNextEntryToRead + 1) % ArrayCount(Queue->Entries);
-    if (OriginalNextEntryToRead != Queue->NextEntryToWrite) // if read pointer hasn't caught up 
-    {
-        // Atomically increment the queue's NextEntryToRead iff somebody else hasn't already done it.
-        u32 Index = InterlockedCompareExchange((LONG volatile *)&Queue->NextEntryToRead, 
-                                               NewNextEntryToRead, OriginalNextEntryToRead);
-        // Index is the old value of Queue->NextEntryToRead, 
-        // so we are successfully the ones to have done the incrementation 
-        // iff Index == OriginalNextEntryToRead, 
-        // and in that case we are the thread that should do that entry's work.
-        if (Index == OriginalNextEntryToRead)
-        {
-            platform_work_queue_entry Entry = Queue->Entries[Index];
-            Entry.Callback(Queue, Entry.Data);
-            //InterlockedIncrement((LONG volatile *) &Queue->Completioncount);
-            // Other people may be retrieving other entries simultaneously so this should also be atomic.
-        }
-    }
+    platform_work_queue_entry Entry;
+    if (PopWorkEntry(&Queue->Ring, &Entry))
+        Entry.Callback(Queue, Entry.Data);
     else
-    {
         WeShouldSleep = true; // this thread found that there is no work left to do
-    }
     
     return WeShouldSleep;
 }
@@ -99,10 +72,9 @@ ThreadProc(LPVOID lpParameter)
 internal void
 Win32MakeQueue(platform_work_queue *Queue, u32 ThreadCount)
 {
-    Queue->NextEntryToWrite = 0;
-    Queue->NextEntryToRead = 0;
+    InitializeWorkRing(&Queue->Ring);
     u32 InitialCount = 0;
-    Queue->SemaphoreHandle = CreateSemaphoreEx(0, InitialCount, ThreadCount, 0, 0, SEMAPHORE_ALL_ACCESS);
+    Queue->SemaphoreHandle = CreateSemaphoreEx(0, InitialCount, WORK_RING_SIZE, 0, 0, SEMAPHORE_ALL_ACCESS);
     for (u32 ThreadIndex = 0; ThreadIndex < ThreadCount; ThreadIndex++)
     {
         DWORD ThreadID;
@@ -158,24 +130,68 @@ ShutdownConnection(SOCKET ClientSocket)
     closesocket(ClientSocket);
 }
 
+internal PLATFORM_WAIT_ON_ADDRESS(Win32WaitOnAddress)
+{
+    WaitOnAddress(Address, &Expected, sizeof(Expected), INFINITE);
+}
+
+internal PLATFORM_WAKE_ON_ADDRESS(Win32WakeOnAddress)
+{
+    WakeByAddressSingle((PVOID)Address);
+}
+
 int main() 
 {
-    // NOTE(vincent): Initialize threads and work queue
     platform_work_queue Queue = {};
-    Win32MakeQueue(&Queue, NUMBER_OF_THREADS - 1);
     
     // NOTE(vincent): Initializing server memory
     server_memory ServerMemory = {};
     LPVOID BaseAddress = 0;//(LPVOID) Terabytes(2);
-    ServerMemory.StorageSize = SERVER_STORAGE_SIZE; 
-    ServerMemory.Storage = VirtualAlloc(BaseAddress, ServerMemory.StorageSize,
-                                        MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    ServerMemory.StorageSize = SERVER_STORAGE_RESERVE; 
+    ServerMemory.Storage = ReserveMemory(BaseAddress, ServerMemory.StorageSize);
     initialize_server_memory_result InitResult =
-        InitializeServerMemory(&ServerMemory, &Queue, Win32AddEntry, Win32DoNextWorkQueueEntry);
+        InitializeServerMemory(&ServerMemory, &Queue, Win32AddEntry, Win32DoNextWorkQueueEntry, 0,
+                               Win32WaitOnAddress, Win32WakeOnAddress, 0, 0, 0, 0, 0);
     
     
     if (InitResult.ParsingErrorCount == 0)
     {
+        // NOTE(vincent): Initialize threads and work queue. The main thread only accepts,
+        // so there are at least two threads. No pinning nor NUMA placement on Windows.
+        u32 ThreadCount = InitResult.Config->ThreadCount;
+        if (ThreadCount == 0)
+        {
+            SYSTEM_INFO SystemInfo;
+            GetSystemInfo(&SystemInfo);
+            ThreadCount = SystemInfo.dwNumberOfProcessors;
+        }
+        if (ThreadCount < 2)
+            ThreadCount = 2;
+        ThreadCount = Minimum(ThreadCount, MAX_THREAD_COUNT);
+        Win32MakeQueue(&Queue, ThreadCount - 1);
+        if (InitResult.Config->PinThreads)
+            printf("pin_threads is not supported on Windows\n");
+        if (InitResult.Config->MaxThreadCount)
+            printf("max_threads is not supported on Windows, the pool stays at %u threads\n", ThreadCount);
+        
+        // NOTE(vincent): Large pages on Windows need the SeLockMemoryPrivilege and committed memory,
+        // which the growable arenas don't do. Not supported for now.
+        if (InitResult.Config->HugePages)
+            printf("huge_pages is not supported on Windows, using 4 KB pages\n");
+        
+        size_t CacheSize = (size_t)Megabytes(InitResult.Config->CacheSize);
+        void *CacheMemory = CacheSize ? VirtualAlloc(0, CacheSize, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE) : 0;
+        InitializeServerFileCache(&ServerMemory, CacheMemory, CacheSize);
+        
+        size_t SlotsMemorySize = ConnectionSlotsMemorySize(&ServerMemory);
+        void *SlotsMemory = ReserveMemory(0, SlotsMemorySize);  // InitializeConnectionSlots() commits
+        if (!SlotsMemory)
+        {
+            printf("VirtualAlloc of the connection slots failed\n");
+            return 1;
+        }
+        InitializeConnectionSlots(&ServerMemory, SlotsMemory, SlotsMemorySize, 1);
+        
         // NOTE(vincent): The rest of this is basically following the instructions on MSDN 
         // to set up a TCP server:
         // https://docs.microsoft.com/en-us/windows/win32/winsock/winsock-server-applicationup
@@ -232,7 +248,7 @@ int main()
         
         freeaddrinfo(AddressInfo);
         
-        if (listen(ListenSocket, SOMAXCONN) == SOCKET_ERROR) 
+        if (listen(ListenSocket, (int)InitResult.Config->Backlog) == SOCKET_ERROR) 
         {
             printf( "Listen failed with error: %ld\n", WSAGetLastError());
             closesocket(ListenSocket);
@@ -258,7 +274,12 @@ int main()
                 return 6;
             }
             else
+            {
+                // NOTE(vincent): Idle keep-alive connections time out in recv(). Windows wants milliseconds.
+                DWORD ReceiveTimeout = InitResult.Config->IdleTimeout * 1000;
+                setsockopt(ClientSocket, SOL_SOCKET, SO_RCVTIMEO, (char *)&ReceiveTimeout, sizeof(ReceiveTimeout));
                 PrepareHandshaking(&ServerMemory, (struct sockaddr *)&TheirAddress, ClientSocket, &Queue);
+            }
         }
         
         //WSACleanup(); 
@@ -0,0 +1,267 @@
+// NOTE(vincent): The ring buffer behind the platform work queues, shared by the Linux and Windows
+// platform layers, which add a way to put idle threads to sleep: a semaphore on Windows, a futex on Linux.
+//
+// It is a bounded multi-producer multi-consumer queue (Dmitry Vyukov's design): each slot carries
+// a sequence number that says whose turn it is.
+// - A slot is free for the producer that claims position P when its Sequence is P.
+//   The producer claims P by moving NextEntryToWrite from P to P+1 with a compare-exchange,
+//   fills in the entry, then publishes it by storing P+1 in Sequence (release).
+// - A consumer can take position P once Sequence is P+1. It claims P by moving NextEntryToRead,
+//   copies the entry, then hands the slot back to producers by storing P+WORK_RING_SIZE.
+// So producers only contend with producers on NextEntryToWrite, and consumers with consumers
+// on NextEntryToRead. Those two live on cache lines of their own, so that they don't
+// bounce between the cores of the two groups either.
+// Positions are free-running u32 counters: they wrap around, and differences are taken as s32.
+
+#define WORK_RING_SIZE 256  // must be a power of two
+#define WORK_RING_MASK (WORK_RING_SIZE - 1)
+
+struct work_ring_slot
+{
+    u32 volatile Sequence;
+    platform_work_queue_entry Entry;
+};
+
+struct work_ring
+{
+    alignas(CACHE_LINE_SIZE) u32 volatile NextEntryToWrite;
+    alignas(CACHE_LINE_SIZE) u32 volatile NextEntryToRead;
+    alignas(CACHE_LINE_SIZE) work_ring_slot Slots[WORK_RING_SIZE];
+};
+
+internal void
+InitializeWorkRing(work_ring *Ring)
+{
+    Ring->NextEntryToWrite = 0;
+    Ring->NextEntryToRead = 0;
+    for (u32 SlotIndex = 0; SlotIndex < WORK_RING_SIZE; SlotIndex++)
+        Ring->Slots[SlotIndex].Sequence = SlotIndex;
+}
+
+internal b32
+PushWorkEntry(work_ring *Ring, platform_work_queue_callback *Callback, void *Data)
+{
+    // NOTE(vincent): Any thread may push. Returns false if the ring is full, and then the entry
+    // is not in it: the caller decides what to do instead, nothing gets dropped silently.
+    work_ring_slot *Slot = 0;
+    u32 Position = AtomicLoadU32(&Ring->NextEntryToWrite);
+    for (;;)
+    {
+        Slot = Ring->Slots + (Position & WORK_RING_MASK);
+        s32 Difference = (s32)(AtomicLoadU32(&Slot->Sequence) - Position);
+        if (Difference == 0)
+        {
+            u32 Previous = AtomicCompareExchangeU32(&Ring->NextEntryToWrite, Position, Position + 1);
+            if (Previous == Position)
+                break;
+            Position = Previous;
+        }
+        else if (Difference < 0)
+        {
+            // That slot still holds the entry from one lap ago: the ring is full.
+            return false;
+        }
+        else
+        {
+            // Another producer claimed Position already.
+            Position = AtomicLoadU32(&Ring->NextEntryToWrite);
+        }
+    }
+
+    Slot->Entry.Callback = Callback;
+    Slot->Entry.Data = Data;
+    AtomicStoreU32(&Slot->Sequence, Position + 1);
+    return true;
+}
+
+internal u32
+PopWorkEntries(work_ring *Ring, platform_work_queue_entry *Results, u32 MaxCount)
+{
+    // NOTE(vincent): Any thread may pop. Takes up to MaxCount entries in a row with a single
+    // compare-exchange on NextEntryToRead, and returns how many it took: 0 if the ring is empty.
+    // A slot that was published stays published until the consumer that claims it hands it back,
+    // so the slots we counted before the compare-exchange are still ours after it.
+    u32 Count = 0;
+    u32 Position = AtomicLoadU32(&Ring->NextEntryToRead);
+    for (;;)
+    {
+        work_ring_slot *Slot = Ring->Slots + (Position & WORK_RING_MASK);
+        s32 Difference = (s32)(AtomicLoadU32(&Slot->Sequence) - (Position + 1));
+        if (Difference == 0)
+        {
+            Count = 1;
+            while (Count < MaxCount)
+            {
+                Slot = Ring->Slots + ((Position + Count) & WORK_RING_MASK);
+                if (AtomicLoadU32(&Slot->Sequence) != Position + Count + 1)
+                    break;
+                Count++;
+            }
+            u32 Previous = AtomicCompareExchangeU32(&Ring->NextEntryToRead, Position, Position + Count);
+            if (Previous == Position)
+                break;
+            Position = Previous;
+        }
+        else if (Difference < 0)
+        {
+            // Nothing was published at Position yet: the ring is empty.
+            return 0;
+        }
+        else
+        {
+            Position = AtomicLoadU32(&Ring->NextEntryToRead);
+        }
+    }
+
+    for (u32 Index = 0; Index < Count; Index++)
+    {
+        work_ring_slot *Slot = Ring->Slots + ((Position + Index) & WORK_RING_MASK);
+        Results[Index] = Slot->Entry;
+        AtomicStoreU32(&Slot->Sequence, Position + Index + WORK_RING_SIZE);
+    }
+    return Count;
+}
+
+internal b32
+PopWorkEntry(work_ring *Ring, platform_work_queue_entry *Result)
+{
+    // NOTE(vincent): Any thread may pop. Returns false if the ring is empty.
+    b32 Popped = (PopWorkEntries(Ring, Result, 1) == 1);
+    return Popped;
+}
+
+internal b32
+WorkRingLooksEmpty(work_ring *Ring)
+{
+    // NOTE(vincent): Any thread may look, without taking anything and without writing to the ring,
+    // so that idle threads can poll it without bouncing its cache lines. The answer may be stale
+    // by the time it returns.
+    u32 Position = AtomicLoadU32(&Ring->NextEntryToRead);
+    work_ring_slot *Slot = Ring->Slots + (Position & WORK_RING_MASK);
+    b32 Empty = (AtomicLoadU32(&Slot->Sequence) != Position + 1);
+    return Empty;
+}
+
+internal u32
+WorkRingLength(work_ring *Ring)
+{
+    // NOTE(vincent): Any thread may ask. Counts the entries being pushed too, and is stale like
+    // WorkRingLooksEmpty(): good enough to tell how far behind the consumers are.
+    u32 Read = AtomicLoadU32(&Ring->NextEntryToRead);
+    u32 Write = AtomicLoadU32(&Ring->NextEntryToWrite);
+    s32 Length = (s32)(Write - Read);
+    return (Length > 0) ? (u32)Length : 0;
+}
+
+// NOTE(vincent): A work-stealing deque (Chase and Lev's, with the orderings of Le et al. for
+// weak memory models). Its owner pushes and pops at the Bottom end, like a stack, without
+// any compare-exchange except for the very last entry. Other threads steal the oldest entry
+// at the Top end, with a compare-exchange on Top. So as long as every worker mostly works
+// out of its own deque, nobody contends on anything.
+// Unlike the original, the array doesn't grow: PushWorkDeque() returns false when it is full.
+
+#define WORK_DEQUE_SIZE 256  // must be a power of two
+#define WORK_DEQUE_MASK (WORK_DEQUE_SIZE - 1)
+
+struct work_deque
+{
+    alignas(CACHE_LINE_SIZE) u32 volatile Top;     // thieves take from here
+    alignas(CACHE_LINE_SIZE) u32 volatile Bottom;  // the owner pushes and pops here
+    alignas(CACHE_LINE_SIZE) platform_work_queue_entry Entries[WORK_DEQUE_SIZE];
+};
+
+internal void
+InitializeWorkDeque(work_deque *Deque)
+{
+    Deque->Top = 0;
+    Deque->Bottom = 0;
+}
+
+internal b32
+PushWorkDeque(work_deque *Deque, platform_work_queue_callback *Callback, void *Data)
+{
+    // NOTE(vincent): Only the owner may push.
+    u32 Bottom = Deque->Bottom;
+    u32 Top = AtomicLoadU32(&Deque->Top);
+    if ((s32)(Bottom - Top) >= WORK_DEQUE_SIZE)
+        return false;
+    
+    platform_work_queue_entry *Entry = Deque->Entries + (Bottom & WORK_DEQUE_MASK);
+    Entry->Callback = Callback;
+    Entry->Data = Data;
+    AtomicStoreU32(&Deque->Bottom, Bottom + 1);  // release: thieves see the entry before the new Bottom
+    return true;
+}
+
+internal b32
+PopWorkDeque(work_deque *Deque, platform_work_queue_entry *Result)
+{
+    // NOTE(vincent): Only the owner may pop. Returns false if the deque is empty.
+    // We first take the entry by moving Bottom, then look at Top. The full fence in between
+    // guarantees that a thief looking at the same entry either sees the new Bottom and backs off,
+    // or got its Top load in before our own, and then we see Top == Bottom and race it fairly.
+    u32 Bottom = Deque->Bottom - 1;
+    AtomicStoreU32(&Deque->Bottom, Bottom);
+    AtomicFence();
+    u32 Top = AtomicLoadU32(&Deque->Top);
+    
+    b32 Found = false;
+    if ((s32)(Bottom - Top) >= 0)
+    {
+        *Result = Deque->Entries[Bottom & WORK_DEQUE_MASK];
+        Found = true;
+        if (Bottom == Top)
+        {
+            // The last entry: thieves may be after it too, whoever moves Top gets it.
+            if (AtomicCompareExchangeU32(&Deque->Top, Top, Top + 1) != Top)
+                Found = false;
+            AtomicStoreU32(&Deque->Bottom, Bottom + 1);
+        }
+    }
+    else
+    {
+        AtomicStoreU32(&Deque->Bottom, Bottom + 1);  // it was empty, put Bottom back
+    }
+    return Found;
+}
+
+internal b32
+StealWorkDeque(work_deque *Deque, platform_work_queue_entry *Result)
+{
+    // NOTE(vincent): Any thread may steal. Returns false if the deque is empty, or if someone else
+    // took the entry first: thieves are better off trying another deque than retrying this one.
+    u32 Top = AtomicLoadU32(&Deque->Top);
+    AtomicFence();
+    u32 Bottom = AtomicLoadU32(&Deque->Bottom);
+    if ((s32)(Bottom - Top) <= 0)
+        return false;
+    
+    // We may read an entry that is being overwritten by a push one lap later, but only if Top
+    // moved in the meantime, and then the compare-exchange fails and we don't use it.
+    platform_work_queue_entry Entry = Deque->Entries[Top & WORK_DEQUE_MASK];
+    if (AtomicCompareExchangeU32(&Deque->Top, Top, Top + 1) != Top)
+        return false;
+    *Result = Entry;
+    return true;
+}
+
+internal b32
+WorkDequeLooksEmpty(work_deque *Deque)
+{
+    // NOTE(vincent): Any thread may look. Like WorkRingLooksEmpty(), the answer may be stale,
+    // and while the owner pops, the deque may look empty when it isn't: the owner is awake then.
+    u32 Top = AtomicLoadU32(&Deque->Top);
+    u32 Bottom = AtomicLoadU32(&Deque->Bottom);
+    b32 Empty = ((s32)(Bottom - Top) <= 0);
+    return Empty;
+}
+
+internal u32
+WorkDequeLength(work_deque *Deque)
+{
+    // NOTE(vincent): Any thread may ask, with the same caveats as WorkDequeLooksEmpty().
+    u32 Top = AtomicLoadU32(&Deque->Top);
+    u32 Bottom = AtomicLoadU32(&Deque->Bottom);
+    s32 Length = (s32)(Bottom - Top);
+    return (Length > 0) ? (u32)Length : 0;
+}